@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+#	Runs tftp_bench from each build variant and prints a side by side
+#	comparison (ns/op, and speedup relative to the first variant).
+#
+#	Usage: bench_report.sh <build dir> <variant> [variant...]
+#
+set -e
+
+BUILD=$1
+shift
+OUT=$(mktemp -d /tmp/tftp_report.XXXXXX)
+trap 'rm -rf "$OUT"' EXIT
+
+for v in "$@"; do
+	"$BUILD/$v/tftp_bench" "${BENCH_MS:-300}" > "$OUT/$v"
+done
+
+echo "TFTP micro-benchmark report ($(uname -m), $(${CXX:-g++} --version | head -n 1))"
+echo
+awk -v variants="$*" '
+BEGIN {
+	n = split(variants, v, " ")
+	printf "%-20s", "benchmark"
+	for (i = 1; i <= n; ++i) printf "%14s", v[i] " ns/op"
+	for (i = 2; i <= n; ++i) printf "%12s", v[i] " x"
+	printf "\n"
+}
+/ ns\/op$/ {
+	split(FILENAME, path, "/")
+	variant = path[length(path)]
+	name = $0
+	sub(/ +[0-9]+ iters .*/, "", name)
+	gsub(/ /, "_", name)
+	ns[name, variant] = $(NF - 1)
+	if (!(name in seen)) { seen[name] = 1; order[++count] = name }
+}
+END {
+	for (b = 1; b <= count; ++b) {
+		name = order[b]
+		printf "%-20s", name
+		for (i = 1; i <= n; ++i) printf "%14.2f", ns[name, v[i]]
+		for (i = 2; i <= n; ++i)
+			printf "%11.2fx", (ns[name, v[i]] > 0 ? ns[name, v[1]] / ns[name, v[i]] : 0)
+		printf "\n"
+	}
+}' $(for v in "$@"; do echo "$OUT/$v"; done)
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+#	PGO training run: serves a synthetic PXE-style root with the instrumented
+#	server and drives it with the load generator, then stops it with SIGTERM
+#	so the profile is written out.
+#
+#	Usage: bench_train.sh <variant dir> <port> <requests>
+#
+set -e
+
+DIR=$(cd "$1" && pwd)
+PORT=$2
+REQS=$3
+ROOT=$(mktemp -d /tmp/tftp_train.XXXXXX)
+trap 'rm -rf "$ROOT"' EXIT
+
+# Per-host configs, a few boot files and directories to list
+mkdir -p "$ROOT/pxelinux.cfg"
+i=0
+while [ $i -lt 64 ]; do
+	printf 'default linux\nlabel linux\n  kernel vmlinuz\n  append initrd=initrd.img ip=dhcp host=%03d\n' $i \
+		> "$ROOT/pxelinux.cfg/01-52-54-00-00-00-$(printf %02x $i)"
+	i=$((i + 1))
+done
+mkdir -p "$ROOT/boot"
+head -c 400 /dev/urandom > "$ROOT/boot/pxelinux.0"
+head -c 200 /dev/urandom > "$ROOT/boot/ldlinux.c32"
+head -c 65536 /dev/urandom > "$ROOT/boot/menu.c32"
+
+cd "$ROOT"
+"$DIR/tftpserver" "$PORT" ./ > /dev/null &
+SERVER=$!
+sleep 0.5
+
+"$DIR/tftp_loadgen" -p "$PORT" -c 16 -n "$REQS" -t 200 -r 3 \
+	boot/pxelinux.0 boot/ldlinux.c32 boot/menu.c32 \
+	pxelinux.cfg/01-52-54-00-00-00-00 pxelinux.cfg/01-52-54-00-00-00-1f \
+	pxelinux.cfg/01-52-54-00-00-00-3e pxelinux.cfg/C0A8 \
+	'?boot' '?pxelinux.cfg' || true
+
+kill -TERM $SERVER
+wait $SERVER || true
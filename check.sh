@@ -0,0 +1,250 @@
+#!/bin/sh
+#
+#	Regression cases for `make check`: simulator runs in virtual time, then
+#	servers on loopback driven by tftp_client, tftp_loadgen and tftp_replay.
+#	Each case prints PASS or FAIL; exits 1 if any case failed.  Servers
+#	listen on <port> and <port>+1.
+#
+#	Usage: check.sh <variant dir> <port>
+#
+set -e
+
+DIR=$(cd "$1" && pwd)
+PORT=$2
+EDGE_PORT=$(($2 + 1))
+TMP=$(mktemp -d /tmp/tftp_check.XXXXXX)
+SERVERS=
+FAILED=0
+trap 'for pid in $SERVERS; do kill -KILL $pid 2>/dev/null || true; done; rm -rf "$TMP"' EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+pass(){ echo "PASS  $1"; }
+fail(){ echo "FAIL  $1"; FAILED=1; }
+
+# start <port> <rootdir> [server options...]: serves rootdir in the background, pid in $SERVER
+start(){
+	port=$1; root=$2; shift 2
+	"$DIR/tftpserver" "$@" "$port" "$root/" > "$TMP/server.$port.log" 2>&1 &
+	SERVER=$!
+	SERVERS="$SERVERS $SERVER"
+	sleep 0.5
+}
+
+# stop <pid> [signal]: the server has to exit with status 0
+stop(){
+	kill -${2:-TERM} $1
+	status=0
+	wait $1 || status=$?
+	return $status
+}
+
+client(){ "$DIR/tftp_client" -p "$PORT" -t 500 "$@"; }
+
+# newroot <name>: a root with small, exact (two full blocks), big (2 MB) and empty
+newroot(){
+	mkdir -p "$TMP/$1"
+	cp "$TMP/small" "$TMP/exact" "$TMP/big" "$TMP/$1/"
+	: > "$TMP/$1/empty"
+	echo "$TMP/$1"
+}
+
+head -c 1000 /dev/urandom > "$TMP/small"
+head -c 1024 /dev/urandom > "$TMP/exact"
+head -c 2097152 /dev/urandom > "$TMP/big"
+
+# Simulator: many lock-step clients, then windows under a global rate
+if "$DIR/tftp_simulate" -m clients=200,size=256K > "$TMP/sim.out" &&
+	grep -q "(200 completed, 0 failed, 0 errors, 0 corrupt DATA)" "$TMP/sim.out"; then
+	pass "simulate 200 clients"
+else
+	fail "simulate 200 clients"; cat "$TMP/sim.out"
+fi
+if "$DIR/tftp_simulate" -m clients=20,size=2M,window=64 -r global=20M > "$TMP/sim.out" &&
+	grep -q "(20 completed, 0 failed" "$TMP/sim.out" &&
+	awk '/^goodput:/ { exit !($2 >= 17) }' "$TMP/sim.out"; then
+	pass "simulate windowsize 64 under global=20M"
+else
+	fail "simulate windowsize 64 under global=20M"; cat "$TMP/sim.out"
+fi
+
+# Congestion control under 1% loss: every transfer completes, lost windows
+# are recovered by the retransmit timer, and goodput stays up
+for mode in aimd ledbat; do
+	if "$DIR/tftp_simulate" -m clients=20,size=1M,window=64,delay=20,loss=0.01,rate=10M \
+			-g mode=$mode > "$TMP/sim.out" &&
+		grep -q "(20 completed, 0 failed, 0 errors, 0 corrupt DATA)" "$TMP/sim.out" &&
+		awk '/^retransmit:/ { exit !($3 > 0) }' "$TMP/sim.out" &&
+		awk '/^goodput:/ { exit !($2 >= 1.4) }' "$TMP/sim.out"; then
+		pass "simulate $mode under loss"
+	else
+		fail "simulate $mode under loss"; cat "$TMP/sim.out"
+	fi
+done
+
+# Lock-step and windowed reads, including a last block that is empty
+ROOT=$(newroot plain)
+start $PORT "$ROOT"
+for f in small exact big empty; do
+	if client get $f "$TMP/got" && cmp -s "$TMP/got" "$ROOT/$f" &&
+		client -w 16 get $f "$TMP/got" && cmp -s "$TMP/got" "$ROOT/$f"; then
+		pass "get $f"
+	else
+		fail "get $f"
+	fi
+done
+if ! client get missing "$TMP/got" 2> "$TMP/err" && grep -q "File Not Found" "$TMP/err"; then
+	pass "get missing"
+else
+	fail "get missing"
+fi
+if stop $SERVER; then pass "SIGTERM"; else fail "SIGTERM"; fi
+
+# Listings of rootdir, which is not the working directory, from both backends
+for type in fs ram; do
+	start $PORT "$ROOT" -b type=$type,load=1
+	if client get '?' "$TMP/got" && grep -q "^small|1000$" "$TMP/got"; then
+		pass "list with type=$type"
+	else
+		fail "list with type=$type"
+	fi
+	stop $SERVER || fail "SIGTERM with type=$type"
+done
+
+# SIGINT stops the server like SIGTERM does
+start $PORT "$ROOT"
+client get small "$TMP/got" || true
+if stop $SERVER INT; then pass "SIGINT"; else fail "SIGINT"; fi
+
+# Windowed transfers under -r keep close to the rate
+start $PORT "$ROOT" -r global=20M
+if client -w 64 get big "$TMP/got" && cmp -s "$TMP/got" "$ROOT/big"; then
+	pass "get windowsize 64 under global=20M"
+else
+	fail "get windowsize 64 under global=20M"
+fi
+if "$DIR/tftp_loadgen" -p $PORT -c 4 -n 8 -w 64 big > "$TMP/load.out" &&
+	grep -q "^completed:  8$" "$TMP/load.out" &&
+	awk '/^goodput:/ { exit !($2 >= 15) }' "$TMP/load.out"; then
+	pass "loadgen windowsize 64 under global=20M"
+else
+	fail "loadgen windowsize 64 under global=20M"; cat "$TMP/load.out"
+fi
+stop $SERVER || fail "SIGTERM under -r"
+
+# Windowed reads with congestion control, through 1% loss
+for mode in aimd ledbat; do
+	start $PORT "$ROOT" -i loss=0.01,seed=7 -g mode=$mode
+	if client -w 64 get big "$TMP/got" && cmp -s "$TMP/got" "$ROOT/big"; then
+		pass "get windowsize 64 with $mode under loss"
+	else
+		fail "get windowsize 64 with $mode under loss"
+	fi
+	stop $SERVER || fail "SIGTERM with -g mode=$mode"
+done
+
+# Replay: capture a few transfers, replay them against a fresh server
+start $PORT "$ROOT" -c "$TMP/trace"
+client get small "$TMP/got" && client get exact "$TMP/got" && client get big "$TMP/got" || true
+client get missing "$TMP/got" 2> /dev/null || true
+stop $SERVER || fail "SIGTERM with -c"
+start $PORT "$ROOT"
+if "$DIR/tftp_replay" -p $PORT -f "$TMP/trace" > "$TMP/replay.out"; then
+	pass "replay"
+else
+	fail "replay"; cat "$TMP/replay.out"
+fi
+stop $SERVER || fail "SIGTERM after replay"
+
+# Resume: an upload cut short after 100 KB continues from there
+ROOT=$(newroot upload)
+start $PORT "$ROOT"
+client -k 102400 put "$TMP/big" up || true
+sleep 0.2
+if client -c put "$TMP/big" up@102400 && client get up "$TMP/got" && cmp -s "$TMP/got" "$TMP/big"; then
+	pass "resume upload"
+else
+	fail "resume upload"
+fi
+client -k 102400 put "$TMP/big" up2 || true
+sleep 0.2
+if ! client -c put "$TMP/small" up2@1000 2> "$TMP/err" && grep -q "Prefix mismatch" "$TMP/err"; then
+	pass "resume with another prefix"
+else
+	fail "resume with another prefix"
+fi
+stop $SERVER || fail "SIGTERM after uploads"
+
+# Uploads into a full RAM store fail at once
+start $PORT "$ROOT" -b type=ram,limit=100K
+if ! client put "$TMP/big" full 2> "$TMP/err" && grep -q "Disk full" "$TMP/err"; then
+	pass "upload into a full store"
+else
+	fail "upload into a full store"
+fi
+stop $SERVER || fail "SIGTERM with type=ram"
+
+# Edge: files fetched from an origin, then served from the edge's root
+ROOT=$(newroot origin)
+start $PORT "$ROOT"
+ORIGIN=$SERVER
+mkdir "$TMP/edge"
+start $EDGE_PORT "$TMP/edge" -u host=127.0.0.1,port=$PORT
+EDGE=$SERVER
+if "$DIR/tftp_client" -p $EDGE_PORT get big "$TMP/got" && cmp -s "$TMP/got" "$ROOT/big" &&
+	"$DIR/tftp_client" -p $EDGE_PORT -w 16 get big "$TMP/got" && cmp -s "$TMP/got" "$ROOT/big" &&
+	cmp -s "$TMP/edge/big" "$ROOT/big"; then
+	pass "edge"
+else
+	fail "edge"
+fi
+if ! "$DIR/tftp_client" -p $EDGE_PORT get missing "$TMP/got" 2> /dev/null; then
+	pass "edge missing"
+else
+	fail "edge missing"
+fi
+stop $EDGE || fail "SIGTERM edge"
+stop $ORIGIN || fail "SIGTERM origin"
+
+# Preload: a preloaded file that is truncated on disk is served as it is now
+ROOT=$(newroot preload)
+printf 'big\nsmall\n' > "$TMP/manifest"
+start $PORT "$ROOT" -w "$TMP/manifest"
+client get big "$TMP/got" || true
+truncate -s 1000 "$ROOT/big"
+client get big "$TMP/got" || true	# The copy may be trusted for a second
+sleep 1.1
+if client get big "$TMP/got" && cmp -s "$TMP/got" "$ROOT/big" && kill -0 $SERVER; then
+	pass "preload, file truncated"
+else
+	fail "preload, file truncated"
+fi
+stop $SERVER || fail "SIGTERM with -w"
+
+# Pack: a new pack renamed into place is served (names missing from the old
+# one included), one overwritten in place is refused without a crash
+mkdir "$TMP/pack1" "$TMP/pack2"
+cp "$TMP/big" "$TMP/pack1/"
+cp "$TMP/small" "$TMP/exact" "$TMP/pack2/"
+"$DIR/tftp_mkpack" "$TMP/pack1" "$TMP/root.pack" > /dev/null
+start $PORT "$TMP/pack1" -p "$TMP/root.pack" -n entries=64
+client get small "$TMP/got" 2> /dev/null || true
+"$DIR/tftp_mkpack" "$TMP/pack2" "$TMP/root.pack" > /dev/null
+sleep 1.1
+if client get small "$TMP/got" && cmp -s "$TMP/got" "$TMP/small" &&
+	! client get big "$TMP/got" 2> /dev/null; then
+	pass "pack renamed into place"
+else
+	fail "pack renamed into place"
+fi
+truncate -s 100 "$TMP/root.pack"
+sleep 1.1
+if ! client get small "$TMP/got" 2> "$TMP/err" && grep -q "Pack unavailable" "$TMP/err" &&
+	kill -0 $SERVER; then
+	pass "pack changed in place"
+else
+	fail "pack changed in place"
+fi
+stop $SERVER || fail "SIGTERM with -p"
+
+[ $FAILED = 0 ] && echo "all cases passed" || echo "some cases FAILED"
+exit $FAILED
@@ -1,73 +1,304 @@
 
 #include "tftp_server.h"
+#include "tftp_trace.h"
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 using namespace std;
 
+#define USAGE "TFTPServer [-d] [-i impairment] [-r ratelimits] [-a admission] [-w manifest] [-t threads] [-p pack] [-v virtualfiles] [-c trace] [-e spans] [-n negcache] [-s sockets] [-g congestion] [-b storage] [-u upstream] [port [rootdir]]\n" \
+	"  -i  loss=P,dup=P,reorder=P,delay=MS,jitter=MS,reorder_ms=MS,seed=N\n" \
+	"  -r  global=B/s,subnet=B/s,client=B/s,burst=B,prefix=N,quantum=B,txtime=0|1\n" \
+	"  -a  sessions=N,files=N,rate=REQ/s,burst=N,busy=error|drop\n" \
+	"  -w  file listing paths/globs (relative to rootdir) to load into memory before serving\n" \
+	"  -t  warm-up threads (default: one per CPU)\n" \
+	"  -p  serve from a packed archive (built with tftp_mkpack) instead of rootdir\n" \
+	"  -v  virtual file config: lines of \"pattern template [datafile]\"\n" \
+	"  -c  capture every datagram into a trace file (see tftp_replay)\n" \
+	"  -e  out=FILE,sample=N,ring=N: latency spans of one session in N, Chrome trace JSON (SIGUSR1 writes it)\n" \
+	"  -n  entries=N,ttl=MS,watch=0|1: cache of missing names (entries=0 turns it off)\n" \
+	"  -s  size=N,sndbuf=B,rcvbuf=B,connect=0|1: pool of spare transfer sockets (size=0 turns it off)\n" \
+	"  -g  mode=fixed|aimd|ledbat,ack=N,max=N,target=MS: congestion control of windowed RRQs\n" \
+	"  -b  type=fs|ram,cache=N,revalidate=MS,limit=B,files=N,load=0|1: where files are served from and uploaded to\n" \
+	"  -u  host=IP,port=N,window=N,revalidate=MS: edge mode, rootdir caches this TFTP server's files\n"
+
 TFTP_SERVER* server;
 int debug = 0;
+volatile sig_atomic_t terminate_requested = 0;
 
-void closeTFTPServer(int signum, siginfo_t* info, void* ptr){
-	char ans = '0';
-shutdown_prompt:
-	cout << "tftp> Would you like to shutdown the Server? (y/n): ";
-	cin >> ans;
-	switch(ans){
-		case 'n':
-			return;
-		case 'y':
-			break;
-		default:
-			goto shutdown_prompt;
-	}
-	if(debug) cout << "main::closeTFTPServer() - Closing TFTP Server...\n";
-	server->closeServer();
-	if(debug) cout << "TFTP_SERVER::disconnect() - Disconnecting Clients...\n";
-	for(int i = 0; i < MAX_CLIENTS; ++i)
-		server->disconnect(&(server->clients[i]));
-	if(debug) cout << "TFTP_SERVER::disconnect() - Closing Server...\n";
-	delete server;
-	kill(getpid(),SIGTERM);
+/*
+ *	SIGHUP/SIGUSR2: hand the listener to a freshly exec'd server and exit
+ *	once the transfers in flight have finished
+ */
+void restartTFTPServer(int signum){
+	if(server) server->restart();
+}
+
+/*
+ *	SIGUSR1: write the latency spans out (from the event loop)
+ */
+void dumpSpans(int signum){
+	TFTP_SPANS::dump_requested = 1;
+}
+
+/*
+ *	SIGINT/SIGTERM: stop and let main() delete the server and return
+ *	normally (so exit handlers, e.g. profile dumps, still run).  Only
+ *	flags are set here: the event loop does the rest.
+ */
+void terminateTFTPServer(int signum){
+	terminate_requested = 1;
+	if(server) server->stop();
 }
 
 int main(int argc, char* argv[]){
 	int port = TFTP_DEFAULT_PORT;
 	char* rootdir = (char*)"./";
-	struct sigaction act;
-	memset(&act,0,sizeof(act));
-	act.sa_handler = SIG_IGN;
-	act.sa_flags = SA_SIGINFO;
-	act.sa_sigaction = closeTFTPServer;
-	sigaction(SIGINT, &act, NULL);
+	signal(SIGINT, terminateTFTPServer);
+	signal(SIGTERM, terminateTFTPServer);
+	signal(SIGHUP, restartTFTPServer);
+	signal(SIGUSR2, restartTFTPServer);
+	signal(SIGUSR1, dumpSpans);
 	
-	switch(argc){
-		case 3:
-			rootdir = argv[2];
+	/* Started by a restart: the old process passes us its listener */
+	int handoff_channel = -1;
+	int listen_fd = tftp_handoff_receive(&handoff_channel);
+	
+	/* Options */
+	TFTP_TRANSPORT* transport = NULL;
+	TFTP_IMPAIRED_TRANSPORT* impaired = NULL;
+	TFTP_TRACE_TRANSPORT* tracer = NULL;
+	char* trace_file = NULL;
+	TFTP_SPAN_CONFIG spans;
+	TFTP_NEGATIVE_CONFIG negative;
+	TFTP_SOCKET_POOL_CONFIG socket_pool;
+	TFTP_CONGESTION_CONFIG congestion;
+	TFTP_STORAGE_CONFIG storage_config;
+	TFTP_UPSTREAM_CONFIG upstream;
+	TFTP_IMPAIRMENT impairment;
+	TFTP_RATE_LIMITS limits;
+	TFTP_ADMISSION_LIMITS admission;
+	char* manifest = NULL;
+	char* pack_file = NULL;
+	char* virtual_config = NULL;
+	int warmup_threads = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "di:r:a:w:t:p:v:c:e:n:s:g:b:u:")) != -1){
+		switch(opt){
+			case 'd':
+				debug = 1;
+				break;
+			case 'i':
+				if(TFTP_IMPAIRMENT::parse(optarg, &impairment) < 0){
+					cerr << "TFTPServer: Bad impairment spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				transport = impaired = new TFTP_IMPAIRED_TRANSPORT(new TFTP_SOCKET_TRANSPORT(), impairment);
+				break;
+			case 'r':
+				if(TFTP_RATE_LIMITS::parse(optarg, &limits) < 0){
+					cerr << "TFTPServer: Bad rate limit spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 'a':
+				if(TFTP_ADMISSION_LIMITS::parse(optarg, &admission) < 0){
+					cerr << "TFTPServer: Bad admission spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 'w':
+				manifest = optarg;
+				break;
+			case 't':
+				warmup_threads = atoi(optarg);
+				break;
+			case 'p':
+				pack_file = optarg;
+				break;
+			case 'v':
+				virtual_config = optarg;
+				break;
+			case 'c':
+				trace_file = optarg;
+				break;
+			case 'e':
+				if(TFTP_SPAN_CONFIG::parse(optarg, &spans) < 0){
+					cerr << "TFTPServer: Bad span spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				TFTP_SPANS::configure(spans);
+				break;
+			case 'n':
+				if(TFTP_NEGATIVE_CONFIG::parse(optarg, &negative) < 0){
+					cerr << "TFTPServer: Bad negative cache spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 's':
+				if(TFTP_SOCKET_POOL_CONFIG::parse(optarg, &socket_pool) < 0){
+					cerr << "TFTPServer: Bad socket pool spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 'g':
+				if(TFTP_CONGESTION_CONFIG::parse(optarg, &congestion) < 0){
+					cerr << "TFTPServer: Bad congestion control spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 'b':
+				if(TFTP_STORAGE_CONFIG::parse(optarg, &storage_config) < 0){
+					cerr << "TFTPServer: Bad storage spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			case 'u':
+				if(TFTP_UPSTREAM_CONFIG::parse(optarg, &upstream) < 0){
+					cerr << "TFTPServer: Bad upstream spec \"" << optarg << "\"\n";
+					return 0;
+				}
+				break;
+			default:
+				cout << USAGE;
+				return 0;
+		}
+	}
+	
+	switch(argc - optind){
+		case 2:
+			rootdir = argv[optind + 1];
 			if(debug)
 				cout << "TFTP Server - Main - Root Dir = " << rootdir << endl;
-		case 2:
-			port = atoi(argv[1]);
+		case 1:
+			port = atoi(argv[optind]);
 			if(debug)
 				cout << "TFTP Server - Main - port = " << port << endl;
 			break;
 		default:
-			if(argc > 3){
+			if(argc - optind > 2){
 				cerr << "TFTPServer: Too Many Arguments\n";
-				cout << "TFTPServer [port [rootdir]]\n";
+				cout << USAGE;
 				return 0;
 			}
 	}
+	
+	/* Warm up before binding (or before telling the old process we are
+	   ready), so the first client is served from memory too */
+	TFTP_PRELOAD preload;
+	preload.revalidate_ms = storage_config.revalidate_ms;	// Copies are trusted as long as fds
+	if(manifest){
+		if(preload.load(rootdir, manifest, warmup_threads) < 0){
+			cerr << "TFTPServer: Could not read manifest \"" << manifest << "\"\n";
+			return 0;
+		}
+		cout << "TFTP Server - Warm-up: " << preload.count() << " files, "
+			<< preload.bytes << " bytes (" << preload.locked_bytes << " locked) in "
+			<< preload.load_ms << " ms";
+		if(preload.failed) cout << ", " << preload.failed << " failed";
+		cout << endl;
+	}
+	TFTP_PACK pack;
+	if(pack_file){
+		if(pack.open(pack_file) < 0){
+			cerr << "TFTPServer: Could not open pack \"" << pack_file << "\"\n";
+			return 0;
+		}
+		if(debug) cout << "TFTP Server - Main - Pack: " << pack.entries() << " files\n";
+	}
+	TFTP_STORAGE* storage = TFTP_STORAGE::create(storage_config, rootdir);
+	if(!storage){
+		cerr << "TFTPServer: Could not load \"" << rootdir << "\" into memory\n";
+		return 0;
+	}
+	if(storage_config.type == TFTP_STORAGE_RAM)
+		cout << "TFTP Server - Storage: in memory, " << ((TFTP_RAM_STORAGE*)storage)->count() << " files, "
+			<< ((TFTP_RAM_STORAGE*)storage)->bytes << " bytes\n";
+	/* Every session holds a socket (and maybe a file): allow as many as we may */
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE,&files) == 0 && files.rlim_cur < files.rlim_max){
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE,&files);
+	}
+	/* Outermost, so the trace holds what the server meant to send (before impairment);
+	   a restarted server adds to its predecessor's trace */
+	if(trace_file){
+		tracer = new TFTP_TRACE_TRANSPORT(transport ? transport : new TFTP_SOCKET_TRANSPORT());
+		if(tracer->open(trace_file, listen_fd >= 0) < 0){
+			cerr << "TFTPServer: Could not create trace \"" << trace_file << "\"\n";
+			return 0;
+		}
+		transport = tracer;
+	}
+	TFTP_VIRTUAL virtuals;
+	if(virtual_config){
+		if(virtuals.load(virtual_config) < 0){
+			cerr << "TFTPServer: Bad virtual file config \"" << virtual_config << "\"\n";
+			return 0;
+		}
+		if(debug) cout << "TFTP Server - Main - Virtual file providers: " << virtuals.count() << endl;
+	}
+	TFTP_NEGATIVE_CACHE negatives;
+	if(negatives.open(rootdir, negative, pack_file != NULL) < 0)
+		cerr << "TFTPServer: inotify not available, missing names are cached for at most "
+			<< TFTP_NEGATIVE_UNWATCHED_TTL << " ms\n";
 	try{
-		while(1){
-			server = new TFTP_SERVER(port, rootdir, debug);
-			server->run(MAX_CLIENTS);
+		while(!terminate_requested){
+			server = new TFTP_SERVER(port, rootdir, debug, transport, listen_fd);
+			if(terminate_requested) server->stop();		// Signalled while it was being built
+			listen_fd = -1;
+			server->setRateLimits(limits);
+			server->setAdmissionLimits(admission);
+			server->setSocketPool(socket_pool);
+			server->setCongestionControl(congestion);
+			server->setStorage(storage);
+			server->setUpstream(upstream);
+			server->setPreload(&preload);
+			if(pack_file) server->setPack(&pack);
+			if(virtual_config) server->setVirtualFiles(&virtuals);
+			if(negative.entries) server->setNegativeCache(&negatives);
+			server->setRestartArgv(argv);
+			if(handoff_channel >= 0){
+				tftp_handoff_ready(handoff_channel);
+				handoff_channel = -1;
+			}
+			int rv = server->run(MAX_CLIENTS);
+			if(debug && upstream.enabled())
+				cout << "TFTP Server - Edge - " << server->edge_hits << " cache hits, " << server->edge_fetches
+					<< " fetches, " << server->edge_coalesced << " coalesced, " << server->edge_current
+					<< " revalidated current, " << server->edge_stale << " stale served" << endl;
 			delete server;
+			server = NULL;
+			if(rv == RUN_HANDED_OFF) break;
 		}
 	}
 	catch(TFTPServerException e){
 		cout << "TFTPServerException Caught: " << e << endl;
 		delete server;
 	}
+	if(TFTP_SPANS::enabled){
+		int n = TFTP_SPANS::dump();
+		if(n < 0) cerr << "TFTPServer: Could not write spans \"" << spans.out << "\"\n";
+		else if(debug) cout << "TFTP Server - Spans - " << n << " written to " << spans.out << endl;
+	}
+	if(debug && impaired)
+		cout << "TFTP Server - Impairment - sent " << impaired->sent << ", dropped " << impaired->dropped
+			<< ", duplicated " << impaired->duplicated << ", reordered " << impaired->reordered << endl;
+	if(debug && negative.entries)
+		cout << "TFTP Server - Negative cache - " << negatives.hits << " hits, " << negatives.inserts
+			<< " inserts, " << negatives.invalidations << " invalidated, " << negatives.flushes << " flushes" << endl;
+	if(debug && tracer)
+		cout << "TFTP Server - Trace - " << tracer->records << " records, "
+			<< tracer->bytes << " bytes written" << endl;
+	if(debug && storage_config.type == TFTP_STORAGE_LOCAL){
+		TFTP_LOCAL_STORAGE* local = (TFTP_LOCAL_STORAGE*)storage;
+		cout << "TFTP Server - Storage - " << local->hits << " shared fd hits, " << local->opens
+			<< " opens, " << local->revalidations << " revalidations, " << local->retirements
+			<< " retired, " << local->evictions << " evicted, " << local->openFds() << " fds open" << endl;
+	}
+	delete storage;
+	if(transport) delete transport;
 }
@@ -0,0 +1,117 @@
+
+#include "tftp_admission.h"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+/*
+ *	Parse an admission spec, e.g. "sessions=64,files=128,rate=20,burst=40,busy=drop"
+ *
+ *	@param	spec	Comma separated key=value list
+ *	@param	out		Limits to fill in (untouched keys keep their value)
+ *	@return			0 | -1 on an unknown key or value
+ */
+int TFTP_ADMISSION_LIMITS::parse(const char* spec, TFTP_ADMISSION_LIMITS* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "sessions"))		out->max_sessions = atoi(val);
+		else if(!strcmp(tok, "files"))		out->max_open_files = atoi(val);
+		else if(!strcmp(tok, "rate"))		out->request_rate = atof(val);
+		else if(!strcmp(tok, "burst"))		out->request_burst = atof(val);
+		else if(!strcmp(tok, "busy")){
+			if(!strcmp(val, "error"))		out->busy = BUSY_ERROR;
+			else if(!strcmp(val, "drop"))	out->busy = BUSY_DROP;
+			else{ rv = -1; break; }
+		}
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->request_burst < 1) out->request_burst = 1;
+	return rv;
+}
+
+/*
+ *	Constructor
+ */
+TFTP_ADMISSION::TFTP_ADMISSION()
+{ memset(decisions, 0, sizeof(decisions)); }
+
+void TFTP_ADMISSION::setLimits(TFTP_ADMISSION_LIMITS _limits){
+	limits = _limits;
+	sources.clear();
+}
+
+TFTP_ADMISSION_LIMITS TFTP_ADMISSION::getLimits()
+{ return limits; }
+
+/*
+ *	Drops per-source buckets that have refilled.  If that leaves the map
+ *	at its bound (requests from many sources at once), the least recently
+ *	used half goes too, refilled or not.
+ */
+void TFTP_ADMISSION::prune(long now_us){
+	vector<pair<long, uint32_t> > used;		// Last request (us) -> source
+	for(map<uint32_t, TFTP_TOKEN_BUCKET>::iterator it = sources.begin(); it != sources.end();){
+		long last = it->second.last_us;
+		it->second.refill(now_us);
+		if(it->second.full()) sources.erase(it++);
+		else{
+			used.push_back(make_pair(last, it->first));
+			++it;
+		}
+	}
+	if(sources.size() < ADMIT_MAX_SOURCES) return;
+	size_t drop = sources.size() - ADMIT_MAX_SOURCES / 2;
+	nth_element(used.begin(), used.begin() + drop, used.end());
+	for(size_t i = 0; i < drop; ++i) sources.erase(used[i].second);
+}
+
+/*
+ *	Decide whether a new request may start a session
+ *
+ *	@param	source		Client address (network byte order)
+ *	@param	sessions	Sessions currently in use
+ *	@param	open_files	Files currently open
+ *	@return				ADMIT_OK | ADMIT_SESSIONS | ADMIT_FILES | ADMIT_RATE
+ */
+int TFTP_ADMISSION::check(uint32_t source, int sessions, int open_files){
+	int decision = ADMIT_OK;
+	if(limits.max_sessions > 0 && sessions >= limits.max_sessions)
+		decision = ADMIT_SESSIONS;
+	else if(limits.max_open_files > 0 && open_files >= limits.max_open_files)
+		decision = ADMIT_FILES;
+	else if(limits.request_rate > 0){	/* Last: a request shed for the other limits costs no token */
+		long now = tftp_now_us();
+		map<uint32_t, TFTP_TOKEN_BUCKET>::iterator it = sources.find(source);
+		if(it == sources.end()){
+			if(sources.size() >= ADMIT_MAX_SOURCES) prune(now);
+			TFTP_TOKEN_BUCKET& b = sources[source];
+			b.init(limits.request_rate, limits.request_burst, now);
+			it = sources.find(source);
+		}
+		if(it->second.delay(1, now) > 0) decision = ADMIT_RATE;
+		else it->second.take(1);
+	}
+	++decisions[decision];
+	return decision;
+}
+
+const char* TFTP_ADMISSION::reason(int decision){
+	switch(decision){
+		case ADMIT_OK:			return "admitted";
+		case ADMIT_SESSIONS:	return "too many sessions";
+		case ADMIT_FILES:		return "too many open files";
+		case ADMIT_RATE:		return "request rate exceeded";
+		case ADMIT_DUPLICATE:	return "duplicate request";
+	}
+	return "unknown";
+}
@@ -0,0 +1,63 @@
+#ifndef TFTP_ADMISSION_H
+#define TFTP_ADMISSION_H
+
+#include "tftp_scheduler.h"
+#include <stdint.h>
+#include <map>
+
+/*
+ *	Admission control for new RRQs/WRQs
+ *
+ *	Decides, before any socket is created or file opened, whether a
+ *	request gets a session.  Limits: concurrent sessions, open files and a
+ *	per-source request rate (token bucket per client address).
+ */
+
+#define ADMIT_OK			0
+#define ADMIT_SESSIONS		1	// Too many sessions
+#define ADMIT_FILES			2	// Too many open files
+#define ADMIT_RATE			3	// Source is over its request rate
+#define ADMIT_DUPLICATE		4	// Retransmitted request for a running session
+
+#define BUSY_ERROR			0	// Answer with an ERROR packet
+#define BUSY_DROP			1	// Drop silently
+
+#define ADMIT_MAX_SOURCES	4096	// Per-source buckets kept (refilled ones go first, then the least recently used)
+
+struct TFTP_ADMISSION_LIMITS{
+	int max_sessions;		// 0 = MAX_CLIENTS
+	int max_open_files;		// 0 = unlimited
+	double request_rate;	// Requests/s per source address, 0 = unlimited
+	double request_burst;
+	int busy;				// BUSY_ERROR | BUSY_DROP
+
+	TFTP_ADMISSION_LIMITS(){
+		max_sessions = max_open_files = 0;
+		request_rate = 0;
+		request_burst = 10;
+		busy = BUSY_ERROR;
+	}
+
+	static int parse(const char* spec, TFTP_ADMISSION_LIMITS* out);
+};
+
+class TFTP_ADMISSION{
+private:
+	TFTP_ADMISSION_LIMITS limits;
+	std::map<uint32_t, TFTP_TOKEN_BUCKET> sources;
+
+	void prune(long now_us);
+
+public:
+	/* Counters, indexed by ADMIT_* */
+	long decisions[5];
+
+	TFTP_ADMISSION();
+
+	void setLimits(TFTP_ADMISSION_LIMITS limits);
+	TFTP_ADMISSION_LIMITS getLimits();
+	int check(uint32_t source, int sessions, int open_files);
+	const char* reason(int decision);
+};
+
+#endif
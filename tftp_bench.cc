@@ -0,0 +1,248 @@
+
+#include "tftp_server.h"
+#include <time.h>
+#include <iomanip>
+
+/*
+ *	Micro-benchmarks for the hot kernels of the server
+ *
+ *	Usage: tftp_bench [min_ms_per_bench]
+ *	Prints one line per benchmark: name, iterations, ns/op
+ */
+
+using namespace std;
+
+#define BENCH_DIR_ENTRIES	40
+#define BENCH_FILE_SIZE		(1 << 20)
+#define BENCH_FLOWS			8		// Sessions with a window queued in the scheduler
+#define BENCH_RATE			20e6	// Bytes/s of its limit
+
+static volatile long sink = 0;	// Keeps the optimizer from dropping work
+
+static long now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *	Reaches into the server's private helpers
+ */
+class TFTP_BENCH{
+public:
+	static int getFileOffset(TFTP_SERVER* s, char* f)
+	{ return s->getFileOffset(f); }
+	static int ls(TFTP_SERVER* s, char* dir, char* buf)
+	{ return s->ls(dir, buf); }
+};
+
+/*
+ *	Swallows what the scheduler sends
+ */
+class NULL_TRANSPORT : public TFTP_TRANSPORT{
+public:
+	int openSocket()
+	{ return 0; }
+	int bindSocket(int fd, struct sockaddr_in* addr)
+	{ return 0; }
+	int closeSocket(int fd)
+	{ return 0; }
+	int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to)
+	{ sink = sink + len; return len; }
+	int sendSegments(int fd, const void* buf, int len, int segment, struct sockaddr_in* to)
+	{ sink = sink + len; return len; }
+	int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from)
+	{ return -1; }
+	int watch(int fd, void* tag)
+	{ return 0; }
+	int unwatch(int fd)
+	{ return 0; }
+	int wait(TFTP_EVENT* events, int max_events, int timeout_ms)
+	{ return 0; }
+};
+
+/*
+ *	Time that only moves when the bench says so, for the scheduler
+ */
+class BENCH_CLOCK : public TFTP_CLOCK{
+public:
+	uint64_t ns;
+
+	BENCH_CLOCK(){ ns = 1000000000ULL; }
+	uint64_t nowNs()
+	{ return ns; }
+};
+
+/*
+ *	Runs fn in growing batches until min_ms has elapsed
+ *
+ *	@param	name	Benchmark name
+ *	@param	min_ms	Minimum run time
+ *	@param	fn		Benchmark body, runs n iterations
+ */
+template<typename F>
+static void run(const char* name, long min_ms, F fn){
+	long iters = 1, elapsed = 0;
+	fn(16); // Warm-up
+	while(true){
+		long start = now_ns();
+		fn(iters);
+		elapsed = now_ns() - start;
+		if(elapsed >= min_ms * 1000000L) break;
+		iters = (elapsed < 1000) ? iters * 16 : iters * 2;
+	}
+	cout << left << setw(24) << name << right << setw(14) << iters << " iters "
+		<< fixed << setprecision(2) << setw(12) << (double)elapsed / iters << " ns/op\n";
+}
+
+int main(int argc, char* argv[]){
+	long min_ms = argc > 1 ? atol(argv[1]) : 300;
+
+	char dir[] = "/tmp/tftp_bench.XXXXXX";
+	if(!mkdtemp(dir)){
+		cerr << "tftp_bench: mkdtemp failed\n";
+		return 1;
+	}
+	string root = string(dir) + "/";
+
+	/* Fixtures: one large file for the block read path, a directory to list */
+	string big = root + "image.bin";
+	{
+		ofstream out(big.c_str(), ios::binary);
+		for(int i = 0; i < BENCH_FILE_SIZE; ++i) out.put((char)(i * 31));
+	}
+	string listdir = root + "pxelinux.cfg";
+	mkdir(listdir.c_str(), 0755);
+	for(int i = 0; i < BENCH_DIR_ENTRIES; ++i){
+		stringstream ss;
+		ss << listdir << "/host-" << setw(3) << setfill('0') << i << ".cfg";
+		ofstream out(ss.str().c_str());
+		out << "default linux\n";
+	}
+
+	TFTP_SERVER* server = new TFTP_SERVER(0, (char*)root.c_str(), 0);
+
+	TFTP_PACKET packet;
+	char payload[TFTP_PACKET_DATA_SIZE];
+	memset(payload, 'x', sizeof(payload));
+
+	run("createData", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i)
+			sink = sink + packet.createData((int)i, payload, TFTP_PACKET_DATA_SIZE);
+	});
+
+	run("createACK", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i)
+			sink = sink + packet.createACK((int)i);
+	});
+
+	packet.createData(4242, payload, TFTP_PACKET_DATA_SIZE);
+	run("getBlockNumber", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i)
+			sink = sink + packet.getBlockNumber();
+	});
+
+	uint32_t crc = 0;
+	run(tftp_crc32c_hardware() ? "crc32c (sse4.2)" : "crc32c (table)", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i)
+			crc = tftp_crc32c(crc, payload, TFTP_PACKET_DATA_SIZE);
+		sink = sink + crc;
+	});
+
+	char with_offset[] = "images/vmlinuz-5.10@1048576";
+	char without_offset[] = "pxelinux.cfg/01-aa-bb-cc-dd-ee-ff";
+	run("getFileOffset", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i){
+			sink = sink + TFTP_BENCH::getFileOffset(server, with_offset);
+			sink = sink + TFTP_BENCH::getFileOffset(server, without_offset);
+		}
+	});
+
+	Client* client = new Client();
+	client->buffers = new TFTP_SESSION_BUFFERS();
+	run("createDirPacket", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i){
+			do{
+				client->buffers->send_packet.clearPacket();
+				server->createDirPacket(client, (char*)"pxelinux.cfg");
+				sink = sink + client->buffers->send_packet.getSize();
+			} while(!client->disconnect_after_send);
+			client->read_mem = NULL;
+			client->block = 0;
+			client->disconnect_after_send = 0;
+		}
+	});
+
+	/* Full GSO windows (windowsize 64) of BENCH_FLOWS sessions through a
+	   scheduler with a global limit.  The waits dispatch() asks for pass on
+	   a fake clock, so ns/op is the scheduler's own cost per batch; the
+	   rate the windows got in that virtual time is printed apart */
+	BENCH_CLOCK clock;
+	tftp_set_clock(&clock);
+	NULL_TRANSPORT null;
+	TFTP_RATE_LIMITS limits;
+	limits.global_rate = BENCH_RATE;
+	TFTP_SCHEDULER scheduler(&null, limits);
+	int segment = TFTP_DATA_PKT_DATA_OFFSET + TFTP_PACKET_DATA_SIZE;
+	vector<char> window(TFTP_GSO_MAX_SEGMENTS * segment, 'x');
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	int flows[BENCH_FLOWS];
+	uint64_t rate_start_ns = clock.ns;
+	long rate_bytes = 0;
+	run("dispatch windows", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i){
+			for(int f = 0; f < BENCH_FLOWS; ++f)
+				scheduler.send(&flows[f], 0, &window[0], window.size(), &to, segment);
+			for(int ms; (ms = scheduler.dispatch()) >= 0;) clock.ns += ms * 1000000ULL;
+		}
+		rate_bytes += n * BENCH_FLOWS * (long)window.size();
+	});
+	double rate = rate_bytes / ((clock.ns - rate_start_ns) / 1e9);
+	tftp_set_clock(NULL);
+
+	char listing[DIRECTORY_LIST_SIZE];
+	run("ls", min_ms, [&](long n){
+		for(long i = 0; i < n; ++i)
+			sink = sink + TFTP_BENCH::ls(server, (char*)listdir.c_str(), listing);
+	});
+
+	/* Block reads from disk, then from memory (the network path without the disk) */
+	TFTP_LOCAL_STORAGE local;
+	TFTP_RAM_STORAGE ram;
+	ram.load(&local, root.c_str());
+	TFTP_STORAGE* backends[] = { &local, &ram };
+	const char* names[] = { "createReadPacket", "createReadPacket (ram)" };
+	for(int b = 0; b < 2; ++b){
+		server->setStorage(backends[b]);
+		client->read_handle = backends[b]->openRead(big.c_str(), NULL);
+		client->read_pos = 0;
+		run(names[b], min_ms, [&](long n){
+			for(long i = 0; i < n; ++i){
+				server->createReadPacket(client);
+				sink = sink + client->buffers->send_packet.getSize();
+				if(client->disconnect_after_send){
+					client->read_pos = 0;
+					client->disconnect_after_send = 0;
+					client->block = 0;
+				}
+			}
+		});
+		backends[b]->close(client->read_handle);
+		client->read_handle = -1;
+	}
+	delete client->buffers;
+	delete client;
+
+	cout << "\nrate limited, virtual time:\n" << left << setw(24) << "dispatch windows" << right
+		<< setw(14) << fixed << setprecision(2) << rate / 1e6 << " MB/s of "
+		<< BENCH_RATE / 1e6 << " MB/s\n";
+
+	server->closeServer();
+	delete server;
+
+	string cleanup = "rm -rf " + string(dir);
+	if(system(cleanup.c_str()) != 0)
+		cerr << "tftp_bench: could not remove " << dir << endl;
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include "tftp_checksum.h"
+#include <string.h>
+#include <stdlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY	0x82f63b78	// Reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+
+static void buildTable(){
+	for(uint32_t i = 0; i < 256; ++i){
+		uint32_t c = i;
+		for(int k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+		table[0][i] = c;
+	}
+	for(uint32_t i = 0; i < 256; ++i)
+		for(int t = 1; t < 8; ++t)
+			table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+}
+
+/*
+ *	Slicing-by-8: eight table lookups per 8 bytes
+ */
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* p, size_t len){
+	while(len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+			  table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+			  table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+			  table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while(len--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* p, size_t len){
+	uint64_t c = crc;
+	while(len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c;
+	while(len--) crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t, const unsigned char*, size_t);
+
+static Crc32cFn pick(){
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")) return crc32cHardware;
+#endif
+	buildTable();
+	return crc32cSoftware;
+}
+
+static Crc32cFn crc32c = pick();
+
+/*
+ *	@param	crc		CRC32C of everything before buf (0 to start)
+ *	@return			CRC32C of everything up to the end of buf
+ */
+uint32_t tftp_crc32c(uint32_t crc, const void* buf, size_t len)
+{ return ~crc32c(~crc, (const unsigned char*)buf, len); }
+
+/*
+ *	@return			1 if the crc32 instruction is used
+ */
+int tftp_crc32c_hardware(){
+#if defined(__x86_64__)
+	return crc32c == crc32cHardware;
+#else
+	return 0;
+#endif
+}
+
+/*
+ *	A CRC32C as a client writes it in an option: 1 to 8 hex digits
+ *
+ *	@return			0 | -1 if hex is anything else (crc untouched)
+ */
+int tftp_crc32c_parse(const char* hex, uint32_t* crc){
+	size_t len = strspn(hex, "0123456789abcdefABCDEF");
+	if(len == 0 || len > 8 || hex[len]) return -1;
+	*crc = strtoul(hex, NULL, 16);
+	return 0;
+}
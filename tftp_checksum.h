@@ -0,0 +1,24 @@
+#ifndef TFTP_CHECKSUM_H
+#define TFTP_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *	CRC32C (Castagnoli), computed incrementally over uploads
+ *
+ *	Uses the SSE4.2 crc32 instruction when the CPU has it, else a
+ *	slicing-by-8 table.  Start with 0 and feed every block in order:
+ *
+ *		uint32_t crc = 0;
+ *		crc = tftp_crc32c(crc, block, len);	...
+ */
+
+#define TFTP_CHECKSUM_SUFFIX	".crc32c"	// Sidecar written next to an upload
+#define TFTP_PART_SUFFIX		".part"		// Upload in progress, renamed when complete
+
+uint32_t tftp_crc32c(uint32_t crc, const void* buf, size_t len);
+int tftp_crc32c_hardware();
+int tftp_crc32c_parse(const char* hex, uint32_t* crc);
+
+#endif
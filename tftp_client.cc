@@ -0,0 +1,249 @@
+#include "tftp_packet.h"
+#include "tftp_transport.h"
+#include "tftp_checksum.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+
+/*
+ *	TFTP client for scripts (make check)
+ *
+ *	get fetches remote into local, put sends local as remote, one block
+ *	at a time (get: one window at a time with -w).  A remote name with
+ *	"@offset" is read from, or resumes an upload at, that offset: put then
+ *	sends local from offset on.  -o adds an option as is; -c adds crc32c
+ *	of the whole local file, and crc32c-prefix of its first offset bytes
+ *	when resuming.  -k stops a put with an ERROR once that many bytes have
+ *	been ACKed, leaving the upload cut short on the server.
+ *
+ *	Exits 0 once the transfer is complete (or stopped by -k), 1 when the
+ *	server answers with an ERROR (its message goes to stderr), 2 when it
+ *	stops answering.
+ *
+ *	Usage: tftp_client [-s host] [-p port] [-w window] [-o name=value]... [-c]
+ *	                   [-k bytes] [-t timeout_ms] [-r retries]
+ *	                   get remote local | put local remote
+ */
+
+using namespace std;
+
+#define CLIENT_DONE			0
+#define CLIENT_ERROR		1	// The server sent an ERROR
+#define CLIENT_TIMEOUT		2
+
+class CLIENT{
+public:
+	TFTP_TRANSPORT* transport;
+	int sock;
+	struct sockaddr_in peer;	// The server's port, then its TID
+	TFTP_PACKET last;			// Resent on timeout
+	int timeout_ms;
+	int retries;
+
+	/*
+	 *	Next packet for us, resending `last` on timeouts
+	 *
+	 *	@return			Its size | -1 once the retries are used up
+	 */
+	int receive(TFTP_PACKET* in, struct sockaddr_in* from){
+		for(int tries = 0; tries <= retries; ++tries){
+			TFTP_EVENT event;
+			while(transport->wait(&event, 1, timeout_ms) > 0){
+				int n = transport->recvFrom(sock, in->getData(0), TFTP_PACKET_MAX_SIZE, from);
+				if(n < 4) continue;
+				in->setSize(n);
+				return n;
+			}
+			send();
+		}
+		return -1;
+	}
+
+	void send()
+	{ transport->sendTo(sock, last.getData(0), last.getSize(), &peer); }
+
+	int error(TFTP_PACKET* in){
+		char msg[TFTP_PACKET_MAX_SIZE];
+		in->getString(4, msg, sizeof(msg));
+		cerr << "tftp_client: error " << in->getWord(2) << ": " << msg << endl;
+		return CLIENT_ERROR;
+	}
+
+	int get(const char* remote, const char* local, int window);
+	int put(const char* local, const char* remote, int crc, long kill);
+};
+
+static vector<pair<string, string> > options;
+
+static void addOptions(TFTP_PACKET* p){
+	for(size_t i = 0; i < options.size(); ++i)
+		p->addOption(options[i].first.c_str(), options[i].second.c_str());
+}
+
+/*
+ *	RRQ remote and write what arrives to local
+ */
+int CLIENT::get(const char* remote, const char* local, int window){
+	last.createRRQ((char*)remote);
+	if(window > 0) last.addOption("windowsize", to_string(window).c_str());
+	addOptions(&last);
+	send();
+	string data;
+	int block = 0, unacked = 0, gap_acked = -1, granted = 0;
+	TFTP_PACKET in;
+	struct sockaddr_in from;
+	for(;;){
+		int n = receive(&in, &from);
+		if(n < 0) return CLIENT_TIMEOUT;
+		if(in.isError()) return error(&in);
+		if(in.isOACK() && block == 0){
+			char w[8];
+			granted = in.getOption("windowsize", w, sizeof(w)) > 0 ? atoi(w) : 0;
+			peer = from;
+			last.createACK(0);
+			send();
+			continue;
+		}
+		if(!in.isData()) continue;
+		int b = in.getBlockNumber();
+		int end = n - TFTP_DATA_PKT_DATA_OFFSET < TFTP_PACKET_DATA_SIZE;
+		if(b == ((block + 1) & 0xffff)){
+			block = b;
+			peer = from;
+			data.append((const char*)in.getData(TFTP_DATA_PKT_DATA_OFFSET), n - TFTP_DATA_PKT_DATA_OFFSET);
+			if(granted > 0 && ++unacked < granted && !end) continue;
+		}
+		else if(granted > 0){
+			if(((b - block) & 0xffff) >= 0x8000 || b == block || gap_acked == block) continue;
+			gap_acked = b = block;	// Gap: ACK what arrived in order
+			end = 0;
+		}
+		else if(b != block) continue;
+		unacked = 0;
+		last.createACK(b);
+		send();
+		if(end && b == block) break;
+	}
+	ofstream out(local, ios::binary | ios::trunc);
+	out.write(data.data(), data.size());
+	return out ? CLIENT_DONE : CLIENT_ERROR;
+}
+
+/*
+ *	WRQ remote with the contents of local (from the remote's "@offset" on)
+ *
+ *	@param	crc		Send crc32c (and crc32c-prefix when resuming)
+ *	@param	kill	Stop once this many bytes are ACKed, -1 = send it all
+ */
+int CLIENT::put(const char* local, const char* remote, int crc, long kill){
+	ifstream in_file(local, ios::binary);
+	if(!in_file){
+		cerr << "tftp_client: cannot read " << local << endl;
+		return CLIENT_ERROR;
+	}
+	string data((istreambuf_iterator<char>(in_file)), istreambuf_iterator<char>());
+	const char* at = strchr(remote, '@');
+	size_t offset = at ? min((size_t)atol(at + 1), data.size()) : 0;
+	last.createWRQ((char*)remote);
+	if(crc){
+		char hex[16];
+		snprintf(hex, sizeof(hex), "%08x", tftp_crc32c(0, data.data(), data.size()));
+		last.addOption("crc32c", hex);
+		if(offset > 0){
+			snprintf(hex, sizeof(hex), "%08x", tftp_crc32c(0, data.data(), offset));
+			last.addOption("crc32c-prefix", hex);
+		}
+	}
+	addOptions(&last);
+	send();
+	TFTP_PACKET in;
+	struct sockaddr_in from;
+	int block = 0, len = TFTP_PACKET_DATA_SIZE;
+	for(;;){
+		int n = receive(&in, &from);
+		if(n < 0) return CLIENT_TIMEOUT;
+		if(in.isError()) return error(&in);
+		int acked = in.isACK() ? in.getBlockNumber() : in.isOACK() && block == 0 ? 0 : -1;
+		if(acked != (block & 0xffff)) continue;
+		peer = from;
+		if(len < TFTP_PACKET_DATA_SIZE) return CLIENT_DONE;		// The short last block is ACKed
+		size_t sent = (size_t)block * TFTP_PACKET_DATA_SIZE;
+		if(kill >= 0 && (long)sent >= kill){
+			last.createError(0, (char*)"Stopped");
+			send();
+			return CLIENT_DONE;
+		}
+		size_t pos = offset + sent;
+		len = min((size_t)TFTP_PACKET_DATA_SIZE, data.size() - pos);
+		last.createData(++block, (char*)data.data() + pos, len);
+		send();
+	}
+}
+
+static void usage(){
+	cerr << "tftp_client [-s host] [-p port] [-w window] [-o name=value]... [-c] [-k bytes]"
+		<< " [-t timeout_ms] [-r retries] get remote local | put local remote\n";
+}
+
+int main(int argc, char* argv[]){
+	const char* host = "127.0.0.1";
+	int port = 69;
+	int window = 0, crc = 0;
+	long kill = -1;
+	CLIENT client;
+	client.timeout_ms = 1000;
+	client.retries = 5;
+	int opt;
+	while((opt = getopt(argc, argv, "s:p:w:o:ck:t:r:")) != -1){
+		switch(opt){
+			case 's': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 'c': crc = 1; break;
+			case 'k': kill = atol(optarg); break;
+			case 't': client.timeout_ms = atoi(optarg); break;
+			case 'r': client.retries = atoi(optarg); break;
+			case 'o':{
+				const char* eq = strchr(optarg, '=');
+				if(!eq){ usage(); return CLIENT_ERROR; }
+				options.push_back(make_pair(string(optarg, eq - optarg), string(eq + 1)));
+				break;
+			}
+			default: usage(); return CLIENT_ERROR;
+		}
+	}
+	if(argc - optind != 3 || (strcmp(argv[optind], "get") && strcmp(argv[optind], "put"))){
+		usage();
+		return CLIENT_ERROR;
+	}
+
+	memset(&client.peer, 0, sizeof(client.peer));
+	client.peer.sin_family = AF_INET;
+	client.peer.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &client.peer.sin_addr) != 1){
+		cerr << "tftp_client: bad host " << host << endl;
+		return CLIENT_ERROR;
+	}
+	client.transport = new TFTP_SOCKET_TRANSPORT();
+	if((client.sock = client.transport->openSocket()) < 0){
+		cerr << "tftp_client: socket() failed: " << strerror(errno) << endl;
+		return CLIENT_ERROR;
+	}
+	client.transport->watch(client.sock, &client);
+	int rv = !strcmp(argv[optind], "get") ? client.get(argv[optind + 1], argv[optind + 2], window)
+										   : client.put(argv[optind + 1], argv[optind + 2], crc, kill);
+	if(rv == CLIENT_TIMEOUT) cerr << "tftp_client: no answer\n";
+	client.transport->closeSocket(client.sock);
+	delete client.transport;
+	return rv;
+}
@@ -0,0 +1,198 @@
+#include "tftp_congestion.h"
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ *	Parse "mode=fixed|aimd|ledbat,ack=N,max=N,target=MS"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_CONGESTION_CONFIG::parse(const char* spec, TFTP_CONGESTION_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "mode")){
+			if(!strcmp(val, "fixed"))		out->mode = TFTP_CC_FIXED;
+			else if(!strcmp(val, "aimd"))	out->mode = TFTP_CC_AIMD;
+			else if(!strcmp(val, "ledbat"))	out->mode = TFTP_CC_LEDBAT;
+			else{ rv = -1; break; }
+		}
+		else if(!strcmp(tok, "ack"))	out->ack_window = atoi(val);
+		else if(!strcmp(tok, "max"))	out->max_window = atoi(val);
+		else if(!strcmp(tok, "target"))	out->target_ms = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->ack_window < 1 || out->max_window < out->ack_window || out->max_window > 16384 ||
+	   out->target_ms < 1) rv = -1;
+	return rv;
+}
+
+/*
+ *	Controller for a session
+ *
+ *	@param	config		Mode and limits
+ *	@param	ack_window	windowsize granted to the client
+ *	@param	asked		windowsize the client asked for: never more in flight
+ *	@return				The controller (delete it with the session)
+ */
+TFTP_CONGESTION* TFTP_CONGESTION::create(const TFTP_CONGESTION_CONFIG& config, int ack_window, int asked){
+	int max_window = max(min(config.max_window, asked), ack_window);
+	switch(config.mode){
+		case TFTP_CC_AIMD:
+			return new TFTP_AIMD(ack_window, max_window);
+		case TFTP_CC_LEDBAT:
+			return new TFTP_LEDBAT(ack_window, max_window, config.target_ms);
+		default:
+			return new TFTP_FIXED_WINDOW(ack_window);
+	}
+}
+
+TFTP_CONGESTION::TFTP_CONGESTION(int ack_window, int _max_window){
+	min_window = ack_window;
+	max_window = _max_window;
+	cwnd = min_window;
+	unsigned size = 1;
+	while(size < (unsigned)max_window * 2) size <<= 1;
+	sent_us.assign(size, 0);
+	mask = size - 1;
+	highest = recover = 0;
+	srtt_us = rttvar_us = -1;
+	backoff = 0;
+	losses = timeouts = 0;
+}
+
+void TFTP_CONGESTION::clamp()
+{ cwnd = min(max(cwnd, (double)min_window), (double)max_window); }
+
+/*
+ *	Blocks that may be in flight
+ */
+int TFTP_CONGESTION::window()
+{ return (int)cwnd; }
+
+/*
+ *	Retransmit timeout in ms
+ */
+int TFTP_CONGESTION::rto(){
+	if(srtt_us < 0) return TFTP_CC_MAX_RTO_MS;
+	long ms = (srtt_us + 4 * rttvar_us) / 1000;
+	ms = max(ms, (long)TFTP_CC_MIN_RTO_MS) << min(backoff, 6);
+	return min(ms, (long)TFTP_CC_MAX_RTO_MS);
+}
+
+/*
+ *	Blocks first..last have been handed to the scheduler
+ */
+void TFTP_CONGESTION::sent(int first, int last, uint64_t now_us){
+	for(int b = first; b <= last; ++b) sent_us[b & mask] = now_us;
+	highest = max(highest, last);
+}
+
+/*
+ *	The client ACKed `block`, `blocks` of them new
+ */
+void TFTP_CONGESTION::acked(int block, int blocks, uint64_t now_us){
+	long rtt = -1;
+	if(block > recover && sent_us[block & mask]) rtt = now_us - sent_us[block & mask];
+	if(rtt >= 0){
+		if(srtt_us < 0){
+			srtt_us = rtt;
+			rttvar_us = rtt / 2;
+		}
+		else{
+			rttvar_us += (labs(srtt_us - rtt) - rttvar_us) / 4;
+			srtt_us += (rtt - srtt_us) / 8;
+		}
+		backoff = 0;
+	}
+	onAck(blocks, rtt);
+	clamp();
+}
+
+/*
+ *	The client reported a gap or repeated its ACK.  One loss per flight:
+ *	ACKs for blocks that were already out when it happened are its echoes.
+ */
+void TFTP_CONGESTION::lost(){
+	if(highest <= recover) return;
+	recover = highest;
+	++losses;
+	onLoss();
+	clamp();
+}
+
+/*
+ *	The retransmit timer fired
+ */
+void TFTP_CONGESTION::timedOut(){
+	recover = highest;
+	++timeouts;
+	++backoff;
+	onTimeout();
+	clamp();
+}
+
+void TFTP_CONGESTION::onTimeout()
+{ cwnd = min_window; }
+
+/*
+ *	AIMD (Reno-like, counted in blocks)
+ */
+TFTP_AIMD::TFTP_AIMD(int ack_window, int max_window)
+: TFTP_CONGESTION(ack_window, max_window) {
+	ssthresh = max_window;
+}
+
+void TFTP_AIMD::onAck(int blocks, long rtt_us){
+	if(cwnd < ssthresh) cwnd += blocks;			// Slow start: doubles per round trip
+	else cwnd += (double)blocks / cwnd;			// +1 block per round trip
+}
+
+void TFTP_AIMD::onLoss(){
+	ssthresh = max(cwnd / 2, (double)min_window);
+	cwnd = ssthresh;
+}
+
+void TFTP_AIMD::onTimeout(){
+	ssthresh = max(cwnd / 2, (double)min_window);
+	cwnd = min_window;
+}
+
+/*
+ *	LEDBAT over round-trip delay
+ */
+TFTP_LEDBAT::TFTP_LEDBAT(int ack_window, int max_window, int target_ms)
+: TFTP_CONGESTION(ack_window, max_window) {
+	target_us = target_ms * 1000L;
+	base_rtt_us = -1;
+	slow_start = 1;
+}
+
+void TFTP_LEDBAT::onAck(int blocks, long rtt_us){
+	if(rtt_us < 0) return;
+	if(base_rtt_us < 0 || rtt_us < base_rtt_us) base_rtt_us = rtt_us;
+	long queueing = rtt_us - base_rtt_us;
+	/* Slow start until the queue starts to build */
+	if(slow_start && queueing < target_us / 2){
+		cwnd += blocks;
+		return;
+	}
+	slow_start = 0;
+	double off_target = (double)(target_us - queueing) / target_us;
+	/* Never faster than AIMD's additive increase, shrink at most to the floor */
+	cwnd += min(TFTP_CC_LEDBAT_GAIN * off_target, 1.0) * blocks / cwnd;
+}
+
+void TFTP_LEDBAT::onLoss(){
+	slow_start = 0;
+	cwnd /= 2;
+}
@@ -0,0 +1,147 @@
+#ifndef TFTP_CONGESTION_H
+#define TFTP_CONGESTION_H
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ *	Congestion control for windowed RRQs (RFC 7440)
+ *
+ *	The client ACKs every `windowsize` blocks (its ACK cadence), or the
+ *	last block it has in order when it sees a gap.  A controller decides
+ *	how many blocks may be in flight (cwnd); the server keeps sending while
+ *	it is below that, so with cwnd above the windowsize several windows are
+ *	on the wire at once.  With a controller the server grants a small
+ *	windowsize (`ack`, frequent feedback) and cwnd moves between that and
+ *	the windowsize the client asked for (what it said it can take), capped
+ *	by `max`.  cwnd never drops below the granted windowsize: the client
+ *	only ACKs once it has a whole window.
+ *
+ *	Signals: blocks newly ACKed with a round-trip time (from the send time
+ *	of the block the ACK names, Karn's rule: not for resent blocks), a gap
+ *	or a repeated ACK (loss, acted on once per flight), and the retransmit
+ *	timer.  The round-trip times also set the retransmit timeout (RFC 6298,
+ *	doubled per timeout): a burst whose tail is lost leaves the client
+ *	nothing to report a gap with, only the timer recovers it.
+ *
+ *	Controllers:
+ *		fixed	cwnd = windowsize, one window per ACK
+ *		aimd	slow start, then +1 block per round trip; halved on loss
+ *		ledbat	delay based (RFC 6817 with round-trip delay): grows while the
+ *				queueing delay over the lowest RTT seen is below `target`,
+ *				shrinks above it, so it yields to other traffic
+ */
+
+#define TFTP_CC_FIXED		0
+#define TFTP_CC_AIMD		1
+#define TFTP_CC_LEDBAT		2
+
+#define TFTP_CC_ACK_WINDOW	16		// windowsize granted with a controller (blocks per ACK)
+#define TFTP_CC_MAX_WINDOW	256		// Blocks in flight at most
+#define TFTP_CC_TARGET_MS	25		// LEDBAT queueing delay target
+#define TFTP_CC_LEDBAT_GAIN	1.0
+#define TFTP_CC_MIN_RTO_MS	20
+#define TFTP_CC_MAX_RTO_MS	1000	// Also the timeout before any RTT sample
+
+struct TFTP_CONGESTION_CONFIG{
+	int mode;			// TFTP_CC_*
+	int ack_window;		// Largest windowsize granted (aimd, ledbat)
+	int max_window;		// Blocks in flight at most
+	int target_ms;		// LEDBAT target queueing delay
+
+	TFTP_CONGESTION_CONFIG(){
+		mode = TFTP_CC_FIXED;
+		ack_window = TFTP_CC_ACK_WINDOW;
+		max_window = TFTP_CC_MAX_WINDOW;
+		target_ms = TFTP_CC_TARGET_MS;
+	}
+
+	static int parse(const char* spec, TFTP_CONGESTION_CONFIG* out);
+};
+
+/*
+ *	One session's controller: the bookkeeping is here, the window policy
+ *	in the subclasses' onAck()/onLoss()/onTimeout()
+ */
+class TFTP_CONGESTION{
+private:
+	std::vector<uint64_t> sent_us;	// Send time by block & mask
+	unsigned mask;
+	int highest;			// Highest block sent
+	int recover;			// Blocks up to here were in flight at the last loss
+	long srtt_us;			// Smoothed RTT, -1 = no sample yet
+	long rttvar_us;
+	int backoff;			// Timeouts since the last RTT sample
+
+protected:
+	double cwnd;			// Blocks
+	int min_window;
+	int max_window;
+
+	void clamp();
+
+	virtual void onAck(int blocks, long rtt_us) = 0;
+	virtual void onLoss() = 0;
+	virtual void onTimeout();
+
+public:
+	/* Counters */
+	long losses;
+	long timeouts;
+
+	TFTP_CONGESTION(int ack_window, int max_window);
+
+	static TFTP_CONGESTION* create(const TFTP_CONGESTION_CONFIG& config, int ack_window, int asked);
+
+	int window();
+	virtual int rto();
+	void sent(int first, int last, uint64_t now_us);
+	void acked(int block, int blocks, uint64_t now_us);
+	void lost();
+	void timedOut();
+
+	virtual ~TFTP_CONGESTION(){}
+};
+
+class TFTP_FIXED_WINDOW : public TFTP_CONGESTION{
+protected:
+	void onAck(int blocks, long rtt_us){}
+	void onLoss(){}
+	void onTimeout(){}
+
+public:
+	TFTP_FIXED_WINDOW(int ack_window)
+	: TFTP_CONGESTION(ack_window, ack_window) {}
+
+	int rto()
+	{ return TFTP_CC_MAX_RTO_MS; }
+};
+
+class TFTP_AIMD : public TFTP_CONGESTION{
+private:
+	double ssthresh;
+
+protected:
+	void onAck(int blocks, long rtt_us);
+	void onLoss();
+	void onTimeout();
+
+public:
+	TFTP_AIMD(int ack_window, int max_window);
+};
+
+class TFTP_LEDBAT : public TFTP_CONGESTION{
+private:
+	long target_us;
+	long base_rtt_us;		// Lowest RTT seen, -1 = none yet
+	int slow_start;
+
+protected:
+	void onAck(int blocks, long rtt_us);
+	void onLoss();
+
+public:
+	TFTP_LEDBAT(int ack_window, int max_window, int target_ms);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "tftp_server.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ *	Embedding the server (libtftp.a)
+ *
+ *	A program with its own event loop: the server's fd is polled next to
+ *	stdin, pollOnce(0) runs when it is readable or its timers are due.
+ *	The handler refuses uploads (unless -w) and names with "..", serves
+ *	"hello.txt" from memory and logs every finished request.  Type "q"
+ *	(or send SIGINT) to stop.
+ *
+ *	Usage: tftp_embed [-d] [-w] [port [rootdir]]
+ */
+
+using namespace std;
+
+class EMBED_HANDLER : public TFTP_HANDLER{
+public:
+	int uploads;
+	long served;
+
+	EMBED_HANDLER(int _uploads){
+		uploads = _uploads;
+		served = 0;
+	}
+
+	int authorize(const TFTP_REQUEST& request, int* error, string* message){
+		if(strstr(request.filename,"..")) return -1;
+		if(request.type == REQUEST_WRITE && !uploads){
+			*message = "Read-only";
+			return -1;
+		}
+		return 0;
+	}
+
+	int open(const TFTP_REQUEST& request, string* content){
+		if(strcmp(request.filename,"hello.txt")) return 0;
+		*content = "Hello ";
+		*content += inet_ntoa(request.peer->sin_addr);
+		*content += ", request " + to_string(++served) + "\n";
+		return 1;
+	}
+
+	void complete(const TFTP_REQUEST& request, int status){
+		cout << (request.type == REQUEST_READ ? "RRQ " : "WRQ ") << request.filename << " from "
+			<< inet_ntoa(request.peer->sin_addr) << ": ";
+		if(status == 0) cout << request.bytes << " bytes\n";
+		else cout << "failed\n";
+	}
+};
+
+TFTP_SERVER* server;
+
+void stopServer(int signum){
+	if(server) server->stop();
+}
+
+int main(int argc, char* argv[]){
+	int port = TFTP_DEFAULT_PORT;
+	char* rootdir = (char*)"./";
+	int debug = 0, uploads = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "dw")) != -1){
+		switch(opt){
+			case 'd': debug = 1; break;
+			case 'w': uploads = 1; break;
+			default:
+				cerr << "tftp_embed [-d] [-w] [port [rootdir]]\n";
+				return 1;
+		}
+	}
+	if(optind < argc) port = atoi(argv[optind++]);
+	if(optind < argc) rootdir = argv[optind++];
+	signal(SIGINT,stopServer);
+
+	EMBED_HANDLER handler(uploads);
+	try{
+		server = new TFTP_SERVER(port, rootdir, debug);
+	}
+	catch(TFTPServerException e){
+		cerr << e << endl;
+		return 1;
+	}
+	server->setHandler(&handler);
+	server->start(MAX_CLIENTS);
+	cout << "tftp_embed: serving " << rootdir << " on port " << port << "\n";
+
+	/* The host's loop: its own fds, plus the server's */
+	struct pollfd fds[2];
+	fds[0].fd = 0;
+	fds[0].events = POLLIN;
+	fds[1].fd = server->pollFd();
+	fds[1].events = POLLIN;
+	int rv = RUN_CONTINUE;
+	while(rv == RUN_CONTINUE){
+		int n = poll(fds, fds[1].fd >= 0 ? 2 : 1, server->nextTimeout());
+		if(n > 0 && (fds[0].revents & (POLLIN | POLLHUP))){
+			char line[64];
+			if(!fgets(line, sizeof(line), stdin) || line[0] == 'q') server->stop();
+		}
+		rv = server->pollOnce(0);
+	}
+	delete server;
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TFTP_HANDLER_H
+#define TFTP_HANDLER_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ *	Callbacks of a program embedding the server (see setHandler())
+ *
+ *	authorize() sees every new RRQ/WRQ before admission control, the
+ *	negative cache or the file system; a refused request is answered from
+ *	the listening socket and never gets a session.  open() can serve an
+ *	RRQ from memory the program fills, ahead of virtual files, the pack,
+ *	the preload and rootdir.  complete() is called once per authorized
+ *	request, however it ends: when its session ends, or at once with -1
+ *	if it is answered from the negative cache or shed by admission
+ *	control and never gets a session.
+ *
+ *	Callbacks run on the thread calling pollOnce()/run(), between packets:
+ *	they hold up every transfer while they run.
+ */
+
+struct TFTP_REQUEST{
+	int type;					// REQUEST_READ | REQUEST_WRITE
+	const char* filename;		// As requested, without an "@offset"
+	const struct sockaddr_in* peer;
+	int64_t bytes;				// complete(): bytes transferred, -1 = did not finish
+};
+
+class TFTP_HANDLER{
+public:
+	/*
+	 *	@param	error		TFTP error code sent on refusal (preset: access violation)
+	 *	@param	message		Its message (preset: "Access violation")
+	 *	@return				0 -> Go ahead | -1 -> Refuse
+	 */
+	virtual int authorize(const TFTP_REQUEST& request, int* error, std::string* message)
+	{ return 0; }
+
+	/*
+	 *	RRQs only ("?dir" listings excepted)
+	 *
+	 *	@param	content		Filled with the file to serve
+	 *	@return				1 -> Serve content | 0 -> Look the name up as usual
+	 *						-1 -> File not found
+	 */
+	virtual int open(const TFTP_REQUEST& request, std::string* content)
+	{ return 0; }
+
+	/*
+	 *	@param	status		0 -> Transferred (request.bytes) | -1 -> Failed or aborted
+	 */
+	virtual void complete(const TFTP_REQUEST& request, int status){}
+
+	virtual ~TFTP_HANDLER(){}
+};
+
+#endif
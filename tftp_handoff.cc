@@ -0,0 +1,134 @@
+
+#include "tftp_handoff.h"
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ *	Start the new server process and pass it the listening socket
+ *
+ *	@param	argv		Arguments to exec the new process with; argv[0] is looked
+ *						up again, so a newly installed binary is picked up
+ *	@param	listen_fd	Listening socket to hand over
+ *	@param	child		Set to the new process' pid
+ *	@return				Channel fd to wait on for readiness | -1 on error
+ */
+int tftp_handoff_spawn(char* const argv[], int listen_fd, pid_t* child){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+	pid_t pid = fork();
+	if(pid < 0){
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if(pid == 0){
+		/* New process: keep only stdio and the channel */
+		if(dup2(sv[1], TFTP_HANDOFF_FD) < 0) _exit(127);
+		fcntl(TFTP_HANDOFF_FD, F_SETFD, 0);	// dup2() onto itself keeps CLOEXEC
+#ifdef SYS_close_range
+		if(syscall(SYS_close_range, TFTP_HANDOFF_FD + 1, ~0U, 0) < 0)
+#endif
+			for(int fd = TFTP_HANDOFF_FD + 1; fd < sysconf(_SC_OPEN_MAX); ++fd) close(fd);
+		char num[16];
+		snprintf(num, sizeof(num), "%d", TFTP_HANDOFF_FD);
+		setenv(TFTP_HANDOFF_ENV, num, 1);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	close(sv[1]);
+
+	char tag = 'L';
+	struct iovec iov;
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &listen_fd, sizeof(int));
+	if(sendmsg(sv[0], &msg, 0) < 0){
+		close(sv[0]);
+		return -1;
+	}
+	*child = pid;
+	return sv[0];
+}
+
+/*
+ *	In the new process: pick up the listening socket, if we were started
+ *	by a handoff
+ *
+ *	@param	channel		Set to the channel fd (for tftp_handoff_ready())
+ *	@return				Listening socket | -1 if not started by a handoff
+ */
+int tftp_handoff_receive(int* channel){
+	const char* env = getenv(TFTP_HANDOFF_ENV);
+	if(!env) return -1;
+	int ch = atoi(env);
+	unsetenv(TFTP_HANDOFF_ENV);
+	fcntl(ch, F_SETFD, FD_CLOEXEC);
+
+	char tag;
+	struct iovec iov;
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(recvmsg(ch, &msg, MSG_CMSG_CLOEXEC) <= 0){
+		close(ch);
+		return -1;
+	}
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	if(!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS){
+		close(ch);
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	*channel = ch;
+	return fd;
+}
+
+/*
+ *	In the new process: tell the old one we are serving
+ *
+ *	@return			0 | -1 on error
+ */
+int tftp_handoff_ready(int channel){
+	char ok = 'R';
+	int rv = write(channel, &ok, 1) == 1 ? 0 : -1;
+	close(channel);
+	return rv;
+}
+
+/*
+ *	In the old process: read the new process' answer (channel is readable)
+ *
+ *	@return			1 - Ready | 0 - New process went away | -1 - Nothing yet
+ */
+int tftp_handoff_wait(int channel){
+	char ok;
+	int n = read(channel, &ok, 1);
+	if(n == 1) return ok == 'R';
+	if(n < 0 && (errno == EAGAIN || errno == EINTR)) return -1;
+	return 0;
+}
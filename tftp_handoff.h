@@ -0,0 +1,25 @@
+#ifndef TFTP_HANDOFF_H
+#define TFTP_HANDOFF_H
+
+#include <sys/types.h>
+
+/*
+ *	Listener handoff for zero-downtime restarts
+ *
+ *	The running server forks and execs a new copy of itself, passes its
+ *	listening socket over a unix socketpair (SCM_RIGHTS) and keeps serving
+ *	until the new process reports it is ready.  The old process then stops
+ *	reading the listener and exits once its transfers have drained.
+ *
+ *	The channel's fd number reaches the new process in TFTP_HANDOFF_ENV.
+ */
+
+#define TFTP_HANDOFF_ENV	"TFTP_HANDOFF_FD"
+#define TFTP_HANDOFF_FD		3	// Channel fd in the new process
+
+int tftp_handoff_spawn(char* const argv[], int listen_fd, pid_t* child);
+int tftp_handoff_receive(int* channel);
+int tftp_handoff_ready(int channel);
+int tftp_handoff_wait(int channel);
+
+#endif
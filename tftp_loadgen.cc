@@ -0,0 +1,258 @@
+
+#include "tftp_packet.h"
+#include "tftp_transport.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+/*
+ *	TFTP load generator
+ *
+ *	Keeps `concurrency` RRQs in flight against a server until `requests`
+ *	transfers have finished, then reports throughput and latency.
+ *	Behaves like an RFC 1350 client: ACKs go to the TID the DATA came from,
+ *	and the last packet is retransmitted on timeout.
+ *
+ *	With -i the client's own sends go through TFTP_IMPAIRED_TRANSPORT; run
+ *	the server with the same option to impair the other direction too.
+ *	Stalls (timeouts) are counted and timed until the next new block arrives.
+ *
+ *	With -w the RRQ asks for a windowsize (RFC 7440): once the server OACKs
+ *	it (with the size it grants), only the last block of each window (or the last in-order block,
+ *	after a gap) is ACKed.
+ *
+ *	Usage: tftp_loadgen [-s host] [-p port] [-c concurrency] [-n requests]
+ *	                    [-t timeout_ms] [-r retries] [-i impairment] [-w window]
+ *	                    file [file...]
+ */
+
+using namespace std;
+
+#define LOADGEN_IDLE		0
+#define LOADGEN_ACTIVE		1
+
+struct Transfer{
+	int state;
+	int sock;
+	const char* file;
+	int block;				// Last block received
+	long bytes;
+	long start_ns;
+	long last_send_ns;
+	int retries;
+	int unacked;			// In-order blocks received since the last ACK (windowed)
+	int gap_acked;			// Block last ACKed for a gap, so a gap is reported once
+	int window;				// windowsize the server granted, 0 = lock-step
+	long stall_ns;			// When the current stall began, 0 if none
+	struct sockaddr_in peer;	// Server's TID once the first DATA arrives
+	TFTP_PACKET last;		// Last packet sent, for retransmission
+
+	Transfer(){ state = LOADGEN_IDLE; sock = -1; }
+};
+
+static long now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void usage(){
+	cout << "tftp_loadgen [-s host] [-p port] [-c concurrency] [-n requests]"
+		<< " [-t timeout_ms] [-r retries] [-i impairment] [-w window] file [file...]\n";
+}
+
+int main(int argc, char* argv[]){
+	const char* host = "127.0.0.1";
+	int port = 49999;
+	int concurrency = 8;
+	long requests = 1000;
+	int timeout_ms = 1000;
+	int max_retries = 5;
+	int window = 0;
+	TFTP_IMPAIRMENT impairment;
+	TFTP_IMPAIRED_TRANSPORT* impaired = NULL;
+	TFTP_TRANSPORT* transport = new TFTP_SOCKET_TRANSPORT();
+
+	int opt;
+	while((opt = getopt(argc, argv, "s:p:c:n:t:r:i:w:")) != -1){
+		switch(opt){
+			case 's': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': concurrency = atoi(optarg); break;
+			case 'n': requests = atol(optarg); break;
+			case 't': timeout_ms = atoi(optarg); break;
+			case 'r': max_retries = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 'i':
+				if(TFTP_IMPAIRMENT::parse(optarg, &impairment) < 0){ usage(); return 1; }
+				if(!impaired) transport = impaired = new TFTP_IMPAIRED_TRANSPORT(transport, impairment);
+				break;
+			default: usage(); return 1;
+		}
+	}
+	vector<const char*> files(argv + optind, argv + argc);
+	if(files.empty() || concurrency < 1){ usage(); return 1; }
+
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &server.sin_addr) != 1){
+		cerr << "tftp_loadgen: bad host " << host << endl;
+		return 1;
+	}
+
+	vector<Transfer> slots(concurrency);
+	vector<TFTP_EVENT> events(concurrency);
+	vector<long> latencies;
+	long issued = 0, completed = 0, errors = 0, failed = 0, bytes = 0;
+	long retransmits = 0, stalls = 0, stall_total_ns = 0;
+	long timeout_ns = (long)timeout_ms * 1000000L;
+	long begin = now_ns();
+
+	while(completed + errors + failed < requests){
+		long now = now_ns();
+		/* Fill idle slots with new requests, recheck timeouts on the active ones */
+		for(int i = 0; i < concurrency; ++i){
+			Transfer& t = slots[i];
+			if(t.state == LOADGEN_IDLE && issued < requests){
+				if((t.sock = transport->openSocket()) < 0){
+					cerr << "tftp_loadgen: socket() failed: " << strerror(errno) << endl;
+					return 1;
+				}
+				fcntl(t.sock, F_SETFL, O_NONBLOCK);
+				transport->watch(t.sock, &t);
+				t.file = files[issued % files.size()];
+				t.block = 0;
+				t.bytes = 0;
+				t.retries = 0;
+				t.unacked = 0;
+				t.gap_acked = -1;
+				t.window = 0;
+				t.stall_ns = 0;
+				t.peer = server;
+				t.last.createRRQ((char*)t.file);
+				if(window > 0){
+					char w[8];
+					snprintf(w, sizeof(w), "%d", window);
+					t.last.addOption("windowsize", w);
+				}
+				t.start_ns = t.last_send_ns = now;
+				transport->sendTo(t.sock, t.last.getData(0), t.last.getSize(), &t.peer);
+				t.state = LOADGEN_ACTIVE;
+				++issued;
+			}
+			else if(t.state == LOADGEN_ACTIVE && now - t.last_send_ns > timeout_ns){
+				if(++t.retries > max_retries){
+					++failed;
+					transport->closeSocket(t.sock);
+					t.state = LOADGEN_IDLE;
+					continue;
+				}
+				if(!t.stall_ns){
+					t.stall_ns = t.last_send_ns;
+					++stalls;
+				}
+				++retransmits;
+				t.last_send_ns = now;
+				transport->sendTo(t.sock, t.last.getData(0), t.last.getSize(), &t.peer);
+			}
+		}
+
+		int ready = transport->wait(&events[0], concurrency, 10);
+		for(int e = 0; e < ready; ++e){
+			Transfer& t = *(Transfer*)events[e].tag;
+			if(t.state != LOADGEN_ACTIVE) continue;
+			TFTP_PACKET in;
+			struct sockaddr_in from;
+			int n = transport->recvFrom(t.sock, in.getData(0), TFTP_PACKET_MAX_SIZE, &from);
+			if(n < 4) continue;
+			in.setSize(n);
+			if(in.isError()){
+				++errors;
+				transport->closeSocket(t.sock);
+				t.state = LOADGEN_IDLE;
+				continue;
+			}
+			if(in.isOACK() && t.block == 0){
+				/* The server may grant less than was asked for */
+				char w[8];
+				t.window = in.getOption("windowsize", w, sizeof(w)) > 0 ? atoi(w) : 0;
+				t.peer = from;
+				t.last.createACK(0);
+				t.last_send_ns = now_ns();
+				transport->sendTo(t.sock, t.last.getData(0), t.last.getSize(), &from);
+				continue;
+			}
+			if(!in.isData()) continue;
+			int block = in.getBlockNumber();
+			int last = n - TFTP_DATA_PKT_DATA_OFFSET < TFTP_PACKET_DATA_SIZE;
+			if(block == ((t.block + 1) & 0xffff)){
+				t.block = block;
+				t.bytes += n - TFTP_DATA_PKT_DATA_OFFSET;
+				t.peer = from;
+				t.retries = 0;
+				if(t.stall_ns){
+					stall_total_ns += now_ns() - t.stall_ns;
+					t.stall_ns = 0;
+				}
+				if(t.window > 0 && ++t.unacked < t.window && !last){
+					t.last_send_ns = now_ns();	// Progress, don't time out mid-window
+					continue;
+				}
+			}
+			else if(t.window > 0){
+				if(((block - t.block) & 0xffff) >= 0x8000 || block == t.block) continue;	// Old or duplicate
+				if(t.gap_acked == t.block) continue;
+				t.gap_acked = block = t.block;	// Gap: ACK what arrived in order, the server goes back
+				last = 0;
+			}
+			else if(block != t.block) continue;	// Stale, not a duplicate of the last block
+			t.unacked = 0;
+			t.last.createACK(block);
+			t.last_send_ns = now_ns();
+			transport->sendTo(t.sock, t.last.getData(0), t.last.getSize(), &from);
+			if(last && block == t.block){
+				++completed;
+				bytes += t.bytes;
+				latencies.push_back(t.last_send_ns - t.start_ns);
+				transport->closeSocket(t.sock);
+				t.state = LOADGEN_IDLE;
+			}
+		}
+	}
+
+	double secs = (now_ns() - begin) / 1e9;
+	sort(latencies.begin(), latencies.end());
+	cout << "requests:   " << requests << "\n"
+		<< "completed:  " << completed << "\n"
+		<< "errors:     " << errors << "\n"
+		<< "failed:     " << failed << "\n"
+		<< "elapsed:    " << secs << " s\n"
+		<< "rate:       " << completed / secs << " transfers/s\n"
+		<< "goodput:    " << bytes / secs / 1e6 << " MB/s\n"
+		<< "retransmit: " << retransmits << " (" << stalls << " stalls";
+	if(stalls) cout << ", mean recovery " << stall_total_ns / stalls / 1000 << " us";
+	cout << ")\n";
+	if(impaired)
+		cout << "impairment: sent " << impaired->sent << ", dropped " << impaired->dropped
+			<< ", duplicated " << impaired->duplicated << ", reordered " << impaired->reordered
+			<< ", delayed " << impaired->delayed << "\n";
+	if(!latencies.empty()){
+		size_t n = latencies.size();
+		cout << "latency:    p50 " << latencies[n / 2] / 1000 << " us, p90 "
+			<< latencies[n * 9 / 10] / 1000 << " us, p99 "
+			<< latencies[n * 99 / 100] / 1000 << " us, max "
+			<< latencies[n - 1] / 1000 << " us\n";
+	}
+	delete transport;
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,27 @@
+#include "tftp_pack.h"
+#include <iostream>
+
+/*
+ *	Builds a packed archive of a TFTP root (see tftp_pack.h)
+ *
+ *	Usage: tftp_mkpack rootdir pack
+ *
+ *	The pack is written next to its final name and renamed into place, so
+ *	a server can be restarted onto it while the old one is still mapped.
+ */
+
+using namespace std;
+
+int main(int argc, char* argv[]){
+	if(argc != 3){
+		cerr << "Usage: tftp_mkpack rootdir pack\n";
+		return 1;
+	}
+	int n = TFTP_PACK::build(argv[1], argv[2]);
+	if(n < 0){
+		cerr << "tftp_mkpack: Could not pack \"" << argv[1] << "\" into \"" << argv[2] << "\"\n";
+		return 1;
+	}
+	cout << "tftp_mkpack: " << n << " files\n";
+	return 0;
+}
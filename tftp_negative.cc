@@ -0,0 +1,239 @@
+#include "tftp_negative.h"
+#include "tftp_transport.h"
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+#define NEGATIVE_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/*
+ *	Parse "entries=N,ttl=MS,watch=0|1"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_NEGATIVE_CONFIG::parse(const char* spec, TFTP_NEGATIVE_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "entries"))		out->entries = atoi(val);
+		else if(!strcmp(tok, "ttl"))	out->ttl = atoi(val);
+		else if(!strcmp(tok, "watch"))	out->watch = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->entries < 0 || out->ttl < 1) rv = -1;
+	return rv;
+}
+
+/*
+ *	Constructor, the cache is off until open()
+ */
+TFTP_NEGATIVE_CACHE::TFTP_NEGATIVE_CACHE(){
+	config.entries = 0;
+	inotify_fd = -1;
+	fixed = 0;
+	next = 0;
+	hits = inserts = invalidations = flushes = 0;
+}
+
+/*
+ *	Set the cache up for a root directory
+ *
+ *	@param	rootdir			Server's root directory (with its trailing '/')
+ *	@param	config			Size, TTL and whether to watch
+ *	@param	fixed			1 when RRQs are not served from rootdir (a pack)
+ *	@return					0 | -1 if inotify was asked for but is not available
+ *							(entries then live TFTP_NEGATIVE_UNWATCHED_TTL)
+ */
+int TFTP_NEGATIVE_CACHE::open(const char* rootdir, TFTP_NEGATIVE_CONFIG _config, int _fixed){
+	config = _config;
+	fixed = _fixed;
+	root = rootdir;
+	order.assign(config.entries, string());
+	names.clear();
+	names.reserve(config.entries);
+	next = 0;
+	if(!config.entries || !config.watch || fixed) return 0;
+	if((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return -1;
+	return 0;
+}
+
+/*
+ *	inotify descriptor to watch for readability (then call drain())
+ *
+ *	@return			fd | -1 if nothing is watched
+ */
+int TFTP_NEGATIVE_CACHE::fd()
+{ return inotify_fd; }
+
+/*
+ *	Cache key of a requested name: the file part (up to any "@offset",
+ *	so "foo@10" is missing exactly when "foo" is and inotify on "foo"
+ *	clears both), with leading and doubled slashes removed
+ *
+ *	@return			0 | -1 if the name is not cacheable
+ */
+int TFTP_NEGATIVE_CACHE::key(const char* name, string* out){
+	out->clear();
+	const char* end = name + strcspn(name, "@");
+	const char* p = name;
+	while(p < end){
+		while(p < end && *p == '/') ++p;
+		if(p == end) break;
+		const char* slash = (const char*)memchr(p, '/', end - p);
+		size_t len = (slash ? slash : end) - p;
+		if((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) return -1;
+		if(!out->empty()) *out += '/';
+		out->append(p, len);
+		p += len;
+	}
+	if(out->empty() || (*out)[0] == '?') return -1;
+	return 0;
+}
+
+/*
+ *	Is the name known to be missing?
+ *
+ *	@param	name	Requested name (relative to the root)
+ *	@return			1 | 0
+ */
+int TFTP_NEGATIVE_CACHE::find(const char* name){
+	if(names.empty()) return 0;
+	string k;
+	if(key(name, &k) < 0) return 0;
+	unordered_map<string, long>::iterator i = names.find(k);
+	if(i == names.end()) return 0;
+	if(tftp_now_ms() >= i->second){
+		names.erase(i);
+		return 0;
+	}
+	++hits;
+	return 1;
+}
+
+/*
+ *	Remember a name that was looked up and not found
+ */
+void TFTP_NEGATIVE_CACHE::insert(const char* name){
+	if(order.empty()) return;
+	string k;
+	if(key(name, &k) < 0) return;
+	size_t slash = k.rfind('/');
+	int watched = fixed || watchDir(slash == string::npos ? string() : k.substr(0, slash)) >= 0;
+	long expires = tftp_now_ms() + (watched ? config.ttl : min(config.ttl, TFTP_NEGATIVE_UNWATCHED_TTL));
+	unordered_map<string, long>::iterator i = names.find(k);
+	if(i != names.end()){
+		i->second = expires;
+		return;
+	}
+	string& slot = order[next++ % order.size()];
+	if(!slot.empty()) names.erase(slot);
+	slot = k;
+	names[k] = expires;
+	++inserts;
+}
+
+/*
+ *	Forget a name (it has just been created)
+ */
+void TFTP_NEGATIVE_CACHE::erase(const char* name){
+	string k;
+	if(key(name, &k) == 0 && names.erase(k)) ++invalidations;
+}
+
+/*
+ *	Forget every name (a directory appeared, went away or the kernel
+ *	dropped events); the watches stay
+ */
+void TFTP_NEGATIVE_CACHE::clear(){
+	names.clear();
+	dirs.clear();
+	++flushes;
+}
+
+/*
+ *	Watch the directory a missing name was looked up in, or its nearest
+ *	parent that exists (whose IN_CREATE then tells us the rest of the path
+ *	may have appeared)
+ *
+ *	@param	dir		Directory key ("" = the root)
+ *	@return			Watch descriptor | -1 if not watched
+ */
+int TFTP_NEGATIVE_CACHE::watchDir(const string& dir){
+	if(inotify_fd < 0) return -1;
+	unordered_map<string, int>::iterator i = dirs.find(dir);
+	if(i != dirs.end()) return i->second;
+	if(watches.size() >= TFTP_NEGATIVE_MAX_WATCHES) return -1;
+	string d = dir;
+	for(;;){
+		int wd = inotify_add_watch(inotify_fd, (root + d).c_str(), NEGATIVE_WATCH_MASK);
+		if(wd >= 0){
+			unordered_map<int, string>::iterator w = watches.find(wd);
+			if(w != watches.end() && w->second != d) return -1;	// Same directory under another name
+			watches[wd] = d;
+			dirs[dir] = wd;
+			return wd;
+		}
+		if((errno != ENOENT && errno != ENOTDIR) || d.empty()) return -1;
+		size_t slash = d.rfind('/');
+		d = (slash == string::npos) ? string() : d.substr(0, slash);
+	}
+}
+
+/*
+ *	Apply what inotify reports: a name created (or made readable) in a
+ *	watched directory is forgotten; a directory created, moved in or gone
+ *	forgets everything, as names below it may now exist
+ *
+ *	@return			Events read
+ */
+int TFTP_NEGATIVE_CACHE::drain(){
+	if(inotify_fd < 0) return 0;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int events = 0;
+	ssize_t n;
+	while((n = read(inotify_fd, buf, sizeof(buf))) > 0){
+		for(char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len){
+			struct inotify_event* e = (struct inotify_event*)p;
+			++events;
+			if(e->mask & IN_Q_OVERFLOW){
+				clear();
+				continue;
+			}
+			unordered_map<int, string>::iterator w = watches.find(e->wd);
+			if(w == watches.end()) continue;
+			if(e->mask & IN_IGNORED){
+				watches.erase(w);
+				clear();
+				continue;
+			}
+			if(!e->len || (e->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF))){
+				clear();
+				continue;
+			}
+			string name = w->second.empty() ? string(e->name) : w->second + "/" + e->name;
+			if(names.erase(name)) ++invalidations;
+		}
+	}
+	return events;
+}
+
+size_t TFTP_NEGATIVE_CACHE::size()
+{ return names.size(); }
+
+/*
+ *	Destructor
+ */
+TFTP_NEGATIVE_CACHE::~TFTP_NEGATIVE_CACHE(){
+	if(inotify_fd >= 0) close(inotify_fd);
+}
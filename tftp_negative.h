@@ -0,0 +1,85 @@
+#ifndef TFTP_NEGATIVE_H
+#define TFTP_NEGATIVE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ *	Negative lookup cache
+ *
+ *	PXE clients probe a long list of config names (pxelinux.cfg/01-<mac>,
+ *	then the UUID, then shorter and shorter hex IPs...) and nearly all of
+ *	them are missing.  An RRQ for a name that was just found missing is
+ *	answered FILE_NOT_FOUND straight from the listening socket: no
+ *	session, no socket, no open().
+ *
+ *	Entries are dropped when the directory they were looked up in changes
+ *	(inotify on it, or on its nearest existing parent), and otherwise live
+ *	`ttl` ms.  Where no watch could be set up (inotify off or out of
+ *	watches) entries live at most TFTP_NEGATIVE_UNWATCHED_TTL.  A pack
+ *	never changes: its misses live `ttl`.  The cache holds `entries`
+ *	names, the oldest insert is evicted first.
+ *
+ *	Names with "." or ".." components are never cached, so a name always
+ *	has exactly one key.  A miss through a symlinked directory whose target
+ *	changes is only noticed when the entry expires.
+ */
+
+#define TFTP_NEGATIVE_ENTRIES			65536	// Names kept
+#define TFTP_NEGATIVE_TTL				60000	// ms, entry in a watched directory
+#define TFTP_NEGATIVE_UNWATCHED_TTL		1000	// ms, entry without a watch
+#define TFTP_NEGATIVE_MAX_WATCHES		4096	// Directories watched
+
+struct TFTP_NEGATIVE_CONFIG{
+	int entries;		// 0 = cache off
+	int ttl;			// ms
+	int watch;			// Use inotify
+
+	TFTP_NEGATIVE_CONFIG(){
+		entries = TFTP_NEGATIVE_ENTRIES;
+		ttl = TFTP_NEGATIVE_TTL;
+		watch = 1;
+	}
+
+	static int parse(const char* spec, TFTP_NEGATIVE_CONFIG* out);
+};
+
+class TFTP_NEGATIVE_CACHE{
+private:
+	TFTP_NEGATIVE_CONFIG config;
+	std::string root;
+	int inotify_fd;
+	int fixed;			// Nothing to watch, the namespace cannot change
+	std::unordered_map<std::string, long> names;	// Key -> expiry (tftp_now_ms())
+	std::vector<std::string> order;					// Insert ring, order[next % size] is evicted next
+	size_t next;
+	std::unordered_map<std::string, int> dirs;		// Directory key -> wd watching it (or a parent)
+	std::unordered_map<int, std::string> watches;	// wd -> directory key it watches
+
+	static int key(const char* name, std::string* out);
+	int watchDir(const std::string& dir);
+
+public:
+	/* Counters */
+	long hits;
+	long inserts;
+	long invalidations;
+	long flushes;
+
+	TFTP_NEGATIVE_CACHE();
+
+	int open(const char* rootdir, TFTP_NEGATIVE_CONFIG config, int fixed = 0);
+	int fd();
+	int find(const char* name);
+	void insert(const char* name);
+	void erase(const char* name);
+	void clear();
+	int drain();
+	size_t size();
+
+	~TFTP_NEGATIVE_CACHE();
+};
+
+#endif
@@ -0,0 +1,312 @@
+
+#include "tftp_pack.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+/*
+ *	Strips leading "/" and "./" so "/boot/x", "./boot/x" and "boot/x" match
+ */
+static const char* packName(const char* name){
+	for(;;){
+		if(name[0] == '/') ++name;
+		else if(name[0] == '.' && name[1] == '/') name += 2;
+		else return name;
+	}
+}
+
+static long nowMs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int64_t mtimeNs(const struct stat& st)
+{ return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec; }
+
+/*
+ *	Constructor
+ */
+TFTP_PACK::TFTP_PACK(){
+	base = NULL;
+	length = 0;
+	index = NULL;
+	names = NULL;
+	count = 0;
+	inode = 0;
+	mtime_ns = 0;
+	checked_ms = 0;
+	stale = 0;
+	reloads = 0;
+}
+
+/*
+ *	Map a pack and check its index (in place of the one mapped so far, if
+ *	it is valid)
+ *
+ *	@param	path	Pack file
+ *	@return			0 | -1 if it can't be mapped or is not a valid pack
+ */
+int TFTP_PACK::open(const char* _path){
+	int fd = ::open(_path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TFTP_PACK_HEADER)){
+		close(fd);
+		return -1;
+	}
+	void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return -1;
+	const TFTP_PACK_HEADER* h = (const TFTP_PACK_HEADER*)p;
+	size_t len = st.st_size;
+	int ok = !memcmp(h->magic, TFTP_PACK_MAGIC, 8) &&
+			 h->index_off <= len && h->count <= (len - h->index_off) / sizeof(TFTP_PACK_ENTRY) &&
+			 h->names_off <= len;
+	const TFTP_PACK_ENTRY* e = (const TFTP_PACK_ENTRY*)((const char*)p + h->index_off);
+	for(uint32_t i = 0; ok && i < h->count; ++i)
+		ok = e[i].name_off <= len - h->names_off && e[i].name_len <= len - h->names_off - e[i].name_off &&
+			 e[i].data_off <= len && e[i].size <= len - e[i].data_off;
+	if(!ok){
+		munmap(p, st.st_size);
+		return -1;
+	}
+	mapping = shared_ptr<const void>(p, [len](const void* q){ munmap((void*)q, len); });
+	base = (const char*)p;
+	length = len;
+	index = e;
+	names = base + h->names_off;
+	count = h->count;
+	path = _path;
+	inode = st.st_ino;
+	mtime_ns = mtimeNs(st);
+	checked_ms = nowMs();
+	stale = 0;
+	return 0;
+}
+
+/*
+ *	Look at the pack's path (at most once per TFTP_PACK_REVALIDATE ms) and
+ *	map a new version found there
+ *
+ *	@return			0 = unchanged | 1 = a new version is mapped | -1 = the
+ *					file changed but is not a valid pack (refused until it is)
+ */
+int TFTP_PACK::check(){
+	long now = nowMs();
+	if(path.empty() || now - checked_ms < TFTP_PACK_REVALIDATE) return stale ? -1 : 0;
+	checked_ms = now;
+	struct stat st;
+	if(::stat(path.c_str(), &st) == 0 && st.st_ino == inode && (size_t)st.st_size == length &&
+	   mtimeNs(st) == mtime_ns) return stale ? -1 : 0;
+	if(open(path.c_str()) < 0){
+		/* Changed in place and not (yet) a valid pack: the mapped pages are
+		   being rewritten.  Removed or renamed over, the mapped file is intact */
+		if(::stat(path.c_str(), &st) == 0 && st.st_ino == inode) stale = 1;
+		return stale ? -1 : 0;
+	}
+	++reloads;
+	return 1;
+}
+
+/*
+ *	@return			Keeps the current mapping (and what find() returned from it)
+ *					alive while held
+ */
+shared_ptr<const void> TFTP_PACK::owner()
+{ return mapping; }
+
+/*
+ *	Bytewise order of an entry's name against name
+ */
+int TFTP_PACK::compare(const TFTP_PACK_ENTRY* e, const char* name, size_t len){
+	int c = memcmp(names + e->name_off, name, min((size_t)e->name_len, len));
+	if(c) return c;
+	return (e->name_len > len) - (e->name_len < len);
+}
+
+/*
+ *	@return			First entry not less than name
+ */
+uint32_t TFTP_PACK::lowerBound(const char* name, size_t len){
+	uint32_t lo = 0, hi = count;
+	while(lo < hi){
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(compare(&index[mid], name, len) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ *	Look up a file
+ *
+ *	@param	name	Path relative to the pack root
+ *	@param	data	Set to the file's bytes (inside the mapping)
+ *	@param	size	Set to the file's size
+ *	@return			0 | -1 if not in the pack (ESTALE: the pack is refused, see check())
+ */
+int TFTP_PACK::find(const char* name, const char** data, size_t* size){
+	if(stale){
+		errno = ESTALE;
+		return -1;
+	}
+	errno = ENOENT;
+	name = packName(name);
+	size_t len = strlen(name);
+	uint32_t i = lowerBound(name, len);
+	if(i == count || compare(&index[i], name, len) != 0) return -1;
+	*data = base + index[i].data_off;
+	*size = index[i].size;
+	return 0;
+}
+
+/*
+ *	Directory listing in the format of TFTP_SERVER::ls(): "name|size\n"
+ *	for files, "name/\n" for subdirectories
+ *
+ *	@param	dir		Directory relative to the pack root ("." = root)
+ *	@param	out		Listing is appended here
+ *	@return			0 | -1 if nothing lives under dir (ESTALE: the pack is refused)
+ */
+int TFTP_PACK::list(const char* dir, string* out){
+	if(stale){
+		errno = ESTALE;
+		return -1;
+	}
+	string prefix = packName(dir);
+	if(prefix == ".") prefix = "";
+	if(!prefix.empty() && prefix[prefix.size() - 1] != '/') prefix += "/";
+	uint32_t i = lowerBound(prefix.c_str(), prefix.size());
+	string last_dir;
+	int found = 0;
+	for(; i < count; ++i){
+		const char* name = names + index[i].name_off;
+		if(index[i].name_len < prefix.size() || memcmp(name, prefix.c_str(), prefix.size())) break;
+		found = 1;
+		string rest(name + prefix.size(), index[i].name_len - prefix.size());
+		if(rest[0] == '.') continue;		// Hidden, as in ls()
+		size_t slash = rest.find('/');
+		if(slash != string::npos){
+			rest.erase(slash);
+			if(rest == last_dir) continue;	// Entries under a subdirectory are contiguous
+			last_dir = rest;
+			*out += rest + "/\n";
+			continue;
+		}
+		char size[24];
+		snprintf(size, sizeof(size), "%llu", (unsigned long long)index[i].size);
+		*out += rest + "|" + size + "\n";
+	}
+	return found || prefix.empty() ? 0 : -1;
+}
+
+uint32_t TFTP_PACK::entries()
+{ return count; }
+
+/*
+ *	Collects the regular files under dir (names relative to the root)
+ */
+static void walk(const string& root, const string& dir, vector<string>* files){
+	DIR* d = opendir((root + dir).c_str());
+	if(!d) return;
+	struct dirent* e;
+	while((e = readdir(d))){
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+		string name = dir + e->d_name;
+		struct stat st;
+		if(stat((root + name).c_str(), &st) < 0) continue;
+		if(S_ISDIR(st.st_mode)) walk(root, name + "/", files);
+		else if(S_ISREG(st.st_mode)) files->push_back(name);
+	}
+	closedir(d);
+}
+
+/*
+ *	Write a pack of every regular file under rootdir
+ *
+ *	@param	rootdir		Directory to pack
+ *	@param	path		Pack file to write
+ *	@return				# of files packed | -1 on error
+ */
+int TFTP_PACK::build(const char* rootdir, const char* path){
+	string root = rootdir;
+	if(root.empty() || root[root.size() - 1] != '/') root += "/";
+	vector<string> files;
+	walk(root, "", &files);
+	sort(files.begin(), files.end());
+
+	TFTP_PACK_HEADER h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TFTP_PACK_MAGIC, 8);
+	h.count = files.size();
+	h.index_off = sizeof(h);
+	h.names_off = h.index_off + files.size() * sizeof(TFTP_PACK_ENTRY);
+
+	vector<TFTP_PACK_ENTRY> index(files.size());
+	string blob;
+	for(size_t i = 0; i < files.size(); ++i){
+		memset(&index[i], 0, sizeof(TFTP_PACK_ENTRY));
+		index[i].name_off = blob.size();
+		index[i].name_len = files[i].size();
+		blob += files[i];
+	}
+	uint64_t off = h.names_off + blob.size();
+	for(size_t i = 0; i < files.size(); ++i){
+		struct stat st;
+		if(stat((root + files[i]).c_str(), &st) < 0) return -1;
+		off = (off + TFTP_PACK_ALIGN - 1) / TFTP_PACK_ALIGN * TFTP_PACK_ALIGN;
+		index[i].data_off = off;
+		index[i].size = st.st_size;
+		off += st.st_size;
+	}
+
+	string tmp = string(path) + ".tmp";
+	ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+	if(!out.is_open()) return -1;
+	out.write((const char*)&h, sizeof(h));
+	if(!index.empty()) out.write((const char*)&index[0], index.size() * sizeof(TFTP_PACK_ENTRY));
+	out.write(blob.data(), blob.size());
+	uint64_t pos = h.names_off + blob.size();
+	char buf[65536];
+	for(size_t i = 0; i < files.size() && out.good(); ++i){
+		static const char zeros[TFTP_PACK_ALIGN] = {0};
+		out.write(zeros, index[i].data_off - pos);
+		ifstream in((root + files[i]).c_str(), ios::binary);
+		uint64_t left = index[i].size;
+		while(left > 0 && in.good()){
+			in.read(buf, min((uint64_t)sizeof(buf), left));
+			if(in.gcount() <= 0) break;
+			out.write(buf, in.gcount());
+			left -= in.gcount();
+		}
+		if(left > 0){	// File shrank while packing
+			out.close();
+			unlink(tmp.c_str());
+			return -1;
+		}
+		pos = index[i].data_off + index[i].size;
+	}
+	out.close();
+	if(out.fail() || rename(tmp.c_str(), path) < 0){
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return files.size();
+}
+
+/*
+ *	Destructor
+ */
+TFTP_PACK::~TFTP_PACK(){}
@@ -0,0 +1,87 @@
+#ifndef TFTP_PACK_H
+#define TFTP_PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+/*
+ *	Packed archive root
+ *
+ *	A whole TFTP root in one read-only file, mmapped once.  Lookups are a
+ *	binary search of the sorted index and reads are slices of the mapping,
+ *	so serving from a pack costs no filesystem syscalls per request.
+ *
+ *	Replace a pack by renaming a new one over it, as tftp_mkpack does.
+ *	The mapping is shared with the file, so overwriting or truncating the
+ *	pack in place (`cp new.pack root.pack`) changes or removes pages under
+ *	transfers that are reading them, and a read past the new end raises
+ *	SIGBUS.  check() looks at the path once per TFTP_PACK_REVALIDATE ms: a
+ *	new file there is mapped in its place (transfers holding owner() of
+ *	the old mapping finish on it), and a pack changed in place is refused
+ *	(find() and list() fail with ESTALE) until it is valid again.
+ *
+ *	Layout (host byte order, built by tftp_mkpack):
+ *		TFTP_PACK_HEADER
+ *		TFTP_PACK_ENTRY[count]	sorted by name (bytewise)
+ *		names					not NUL terminated
+ *		file data				each file aligned to TFTP_PACK_ALIGN
+ */
+
+#define TFTP_PACK_MAGIC	"TFTPPAK1"
+#define TFTP_PACK_ALIGN	8
+#define TFTP_PACK_REVALIDATE	1000	// ms between checks of the pack's path
+
+struct TFTP_PACK_HEADER{
+	char magic[8];
+	uint32_t count;			// Entries in the index
+	uint32_t reserved;
+	uint64_t index_off;
+	uint64_t names_off;
+};
+
+struct TFTP_PACK_ENTRY{
+	uint64_t name_off;		// From names_off
+	uint32_t name_len;
+	uint32_t reserved;
+	uint64_t data_off;		// From the start of the pack
+	uint64_t size;
+};
+
+class TFTP_PACK{
+private:
+	const char* base;
+	size_t length;
+	const TFTP_PACK_ENTRY* index;
+	const char* names;
+	uint32_t count;
+	std::shared_ptr<const void> mapping;	// Unmaps base with the last holder
+	std::string path;
+	uint64_t inode;		// Of the file mapped
+	int64_t mtime_ns;
+	long checked_ms;
+	int stale;			// The file changed in place and is not a valid pack
+
+	int compare(const TFTP_PACK_ENTRY* e, const char* name, size_t len);
+	uint32_t lowerBound(const char* name, size_t len);
+
+public:
+	TFTP_PACK();
+
+	/* Counters */
+	long reloads;		// New versions mapped by check()
+
+	int open(const char* path);
+	int check();
+	std::shared_ptr<const void> owner();
+	int find(const char* name, const char** data, size_t* size);
+	int list(const char* dir, std::string* out);
+	uint32_t entries();
+
+	static int build(const char* rootdir, const char* path);
+
+	~TFTP_PACK();
+};
+
+#endif
@@ -104,14 +104,12 @@ int TFTP_PACKET::addString(char* _s){
 	int i = 0;// = strlen(_s);
 	for(; _s[i]; ++i)
 		if(addByte(_s[i]) < 0) return i;
-	packet_size += i;
 	return i;
 }
 int TFTP_PACKET::addString(const char* _s){
 	int i = 0;
 	for(; _s[i]; ++i)
 		if(addByte(_s[i]) < 0) return i;
-	packet_size += i;
 	return i;
 }
 
@@ -327,6 +325,54 @@ int TFTP_PACKET::createError(int _error_code, char* _msg){
 	return _error_code;
 }
 
+/*
+ *	Creates an Option Acknowledgment (RFC 2347), options are added with addOption()
+ */
+int TFTP_PACKET::createOACK(){
+	clearPacket();
+	if(addWord(TFTP_OPCODE_OACK) < 0) return -1;
+	return 0;
+}
+
+/*
+ *	Appends an option name/value pair (RRQ/WRQ/OACK)
+ *
+ *	@return			0 | -1 if the packet is full
+ */
+int TFTP_PACKET::addOption(const char* _name, const char* _value){
+	if(addString(_name) < strlen(_name) || addByte(0) < 0) return -1;
+	if(addString(_value) < strlen(_value) || addByte(0) < 0) return -1;
+	return 0;
+}
+
+/*
+ *	Finds an option (RFC 2347) following the filename and mode of a RRQ/WRQ,
+ *	or in an OACK
+ *
+ *	@param	name	Option name (case insensitive)
+ *	@param	buf		Value is copied here
+ *	@param	len		Size of buf
+ *	@return			Length of the value | -1 if not present
+ */
+int TFTP_PACKET::getOption(const char* _name, char* _buf, int _len){
+	int off = 2;
+	int fields = isOACK() ? 2 : 0;		// An OACK has no filename and mode
+	char* opt = NULL;
+	while(off < packet_size){
+		char* s = (char*)&(data[off]);
+		int n = strnlen(s, packet_size - off);
+		if(off + n >= packet_size) return -1;	// Not NUL terminated
+		off += n + 1;
+		if(++fields <= 2) continue;				// Filename, mode
+		if(fields % 2){ opt = s; continue; }
+		if(strcasecmp(opt, _name)) continue;
+		if(n >= _len) return -1;
+		strcpy(_buf, s);
+		return n;
+	}
+	return -1;
+}
+
 /*
  *	Returns if Packet is a Read Request Packet
  */
@@ -357,6 +403,12 @@ bool TFTP_PACKET::isData()
 bool TFTP_PACKET::isError()
 { return getOpcode() == TFTP_OPCODE_ERROR; }
 
+/*
+ *	Returns if Packet is an Option Acknowledgment Packet
+ */
+bool TFTP_PACKET::isOACK()
+{ return getOpcode() == TFTP_OPCODE_OACK; }
+
 /*
  *	Destructor
  */
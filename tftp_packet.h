@@ -1,6 +1,10 @@
-include <stdint.h>
+#ifndef TFTP_PACKET_H
+#define TFTP_PACKET_H
+
+#include <stdint.h>
 #include <iostream>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fstream>
 #include <sstream>
@@ -11,6 +15,7 @@ include <stdint.h>
 #define		TFTP_OPCODE_DATA	3
 #define		TFTP_OPCODE_ACK		4
 #define		TFTP_OPCODE_ERROR	5
+#define		TFTP_OPCODE_OACK	6	// RFC 2347
 
 #define		TFTP_DEFAULT_TRANSFER_MODE		"octet"
 #define		TFTP_TRANSFER_MODE_NETASCII		"netascii"
@@ -50,6 +55,12 @@ typedef uint16_t WORD;
 -----------------------------------------
 | Opcode | ErrorCode |  ErrMsg  |   0   |
 -----------------------------------------
+
+[OACK Packet] (RFC 2347; RRQ/WRQ carry the same pairs after the mode)
+2 bytes    string   1 byte   string   1 byte
+---------------------------------------------------
+| Opcode |  Option  |  0  |  Value   |  0  | ...
+---------------------------------------------------
 */
 
 class TFTP_PACKET{
@@ -86,6 +97,9 @@ public:
 	int createACK(int packet_num);
 	int createData(int block, char* data, int data_size);
 	int createError(int error_code, char* msg);
+	int createOACK();
+	int addOption(const char* name, const char* value);
+	int getOption(const char* name, char* buf, int len);
 	
 	int sendPacket(TFTP_PACKET*);
 	
@@ -94,6 +108,7 @@ public:
 	bool isACK();
 	bool isData();
 	bool isError();
+	bool isOACK();
 
 	friend std::ostream& operator<< (std::ostream &out, TFTP_PACKET &p){
 		out << (int)p.data[0] << (int)p.data[1];
@@ -118,3 +133,5 @@ public:
 	
 	~TFTP_PACKET();
 };
+
+#endif
@@ -0,0 +1,237 @@
+
+#include "tftp_preload.h"
+#include "tftp_transport.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <string.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <fstream>
+
+using namespace std;
+
+/*
+ *	Strips leading "/" and "./" so "/boot/x", "./boot/x" and "boot/x" match
+ */
+static const char* relativeName(const char* name){
+	for(;;){
+		if(name[0] == '/') ++name;
+		else if(name[0] == '.' && name[1] == '/') name += 2;
+		else return name;
+	}
+}
+
+/*
+ *	Constructor
+ */
+TFTP_PRELOAD::TFTP_PRELOAD(){
+	load_ms = 0;
+	bytes = locked_bytes = 0;
+	failed = 0;
+	dropped = 0;
+	revalidate_ms = TFTP_PRELOAD_REVALIDATE;
+}
+
+/*
+ *	Read the manifest and expand its globs under rootdir
+ *
+ *	@param	paths		Filled with the paths to open
+ *	@param	keys		Filled with the matching names relative to rootdir
+ *	@return				0 | -1 if the manifest can't be read
+ */
+int TFTP_PRELOAD::expand(const char* rootdir, const char* manifest,
+						 vector<string>* paths, vector<string>* keys){
+	ifstream in(manifest);
+	if(!in.is_open()) return -1;
+	string root = rootdir;
+	if(root.empty() || root[root.size() - 1] != '/') root += "/";
+	string line;
+	while(getline(in, line)){
+		size_t hash = line.find('#');
+		if(hash != string::npos) line.erase(hash);
+		size_t b = line.find_first_not_of(" \t\r");
+		if(b == string::npos) continue;
+		line = line.substr(b, line.find_last_not_of(" \t\r") - b + 1);
+		if(line.find("..") != string::npos) continue;	// Stay under the root
+		string pattern = root + relativeName(line.c_str());
+		glob_t g;
+		if(glob(pattern.c_str(), 0, NULL, &g) == 0){
+			for(size_t i = 0; i < g.gl_pathc; ++i){
+				struct stat st;
+				if(stat(g.gl_pathv[i], &st) < 0 || !S_ISREG(st.st_mode)) continue;
+				paths->push_back(g.gl_pathv[i]);
+				keys->push_back(relativeName(g.gl_pathv[i] + root.size()));
+			}
+		}
+		globfree(&g);
+	}
+	return 0;
+}
+
+/*
+ *	Copy a file into anonymous memory and try to lock it
+ *
+ *	@return			0 | -1 on error (or if the file changed size while read)
+ */
+int TFTP_PRELOAD::map(const char* path, TFTP_PRELOAD_FILE* out){
+	out->data = NULL;
+	out->size = 0;
+	out->locked = 0;
+	out->path = path;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat st;
+	if(fstat(fd, &st) < 0){
+		close(fd);
+		return -1;
+	}
+	out->inode = st.st_ino;
+	out->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	out->checked_ms = tftp_now_ms();
+	if(st.st_size == 0){
+		close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(p == MAP_FAILED){
+		close(fd);
+		return -1;
+	}
+	size_t got = 0;
+	while(got < size){
+		ssize_t n = pread(fd, (char*)p + got, size - got, got);
+		if(n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	if(got < size){
+		munmap(p, size);
+		return -1;
+	}
+	mprotect(p, size, PROT_READ);
+	out->locked = (mlock(p, size) == 0);
+	out->data = (const char*)p;
+	out->size = size;
+	out->owner = shared_ptr<const void>(p, [size](const void* q){ munmap((void*)q, size); });
+	return 0;
+}
+
+/*
+ *	@return			1 if f is still what its file holds (or has no file, or was
+ *					checked less than revalidate_ms ago), else 0
+ */
+int TFTP_PRELOAD::current(TFTP_PRELOAD_FILE& f){
+	if(f.path.empty()) return 1;
+	long now = tftp_now_ms();
+	if(now - f.checked_ms < revalidate_ms) return 1;
+	f.checked_ms = now;
+	struct stat st;
+	if(stat(f.path.c_str(), &st) < 0) return 0;
+	return st.st_ino == f.inode && (size_t)st.st_size == f.size &&
+		   (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec == f.mtime_ns;
+}
+
+/*
+ *	Warm up every file named in the manifest
+ *
+ *	@param	rootdir		Server root; manifest entries are relative to it
+ *	@param	manifest	Path of the manifest file
+ *	@param	threads		Loader threads (0 = one per CPU)
+ *	@return				# of files loaded | -1 if the manifest can't be read
+ */
+int TFTP_PRELOAD::load(const char* rootdir, const char* manifest, int threads){
+	long start = tftp_now_ms();
+	vector<string> paths, keys;
+	if(expand(rootdir, manifest, &paths, &keys) < 0) return -1;
+
+	if(threads <= 0) threads = thread::hardware_concurrency();
+	if(threads <= 0) threads = 1;
+	if(threads > TFTP_PRELOAD_MAX_THREADS) threads = TFTP_PRELOAD_MAX_THREADS;
+	if((size_t)threads > paths.size()) threads = paths.size() ? paths.size() : 1;
+
+	vector<TFTP_PRELOAD_FILE> loaded(paths.size());
+	vector<int> status(paths.size(), -1);
+	atomic<size_t> next(0);
+	vector<thread> pool;
+	for(int t = 0; t < threads; ++t)
+		pool.push_back(thread([&](){
+			for(size_t i; (i = next++) < paths.size();)
+				status[i] = map(paths[i].c_str(), &loaded[i]);
+		}));
+	for(size_t t = 0; t < pool.size(); ++t) pool[t].join();
+
+	for(size_t i = 0; i < paths.size(); ++i){
+		if(status[i] < 0){
+			++failed;
+			continue;
+		}
+		std::map<string, TFTP_PRELOAD_FILE>::iterator it = files.find(keys[i]);
+		if(it != files.end()) continue;	// Matched by more than one line
+		files[keys[i]] = loaded[i];
+		bytes += loaded[i].size;
+		if(loaded[i].locked) locked_bytes += loaded[i].size;
+	}
+	load_ms = tftp_now_ms() - start;
+	return files.size();
+}
+
+/*
+ *	Serve memory the caller keeps (and frees after the server is gone)
+ *	as a file, e.g. the simulator's
+ *
+ *	@param	name	Path relative to the root
+ *	@return			0 | -1 if the name is already loaded
+ */
+int TFTP_PRELOAD::add(const char* name, const char* data, size_t size){
+	string key = relativeName(name);
+	if(files.count(key)) return -1;
+	TFTP_PRELOAD_FILE f;
+	f.data = size ? data : NULL;
+	f.size = size;
+	f.locked = 0;
+	f.inode = 0;
+	f.mtime_ns = 0;
+	f.checked_ms = 0;
+	files[key] = f;
+	bytes += size;
+	return 0;
+}
+
+/*
+ *	@param	name	Requested file name (relative to the root)
+ *	@return			The preloaded file | NULL (also once its file changed: the
+ *					copy is dropped and the file is served from disk)
+ */
+const TFTP_PRELOAD_FILE* TFTP_PRELOAD::find(const char* name){
+	std::map<string, TFTP_PRELOAD_FILE>::iterator it = files.find(relativeName(name));
+	if(it == files.end()) return NULL;
+	if(!current(it->second)){
+		drop(name);
+		return NULL;
+	}
+	return &it->second;
+}
+
+/*
+ *	Forget a file the server replaced (readers of the copy finish on it)
+ *
+ *	@param	name	Path relative to the root
+ *	@return			0 | -1 if it was not loaded
+ */
+int TFTP_PRELOAD::drop(const char* name){
+	std::map<string, TFTP_PRELOAD_FILE>::iterator it = files.find(relativeName(name));
+	if(it == files.end()) return -1;
+	bytes -= it->second.size;
+	if(it->second.locked) locked_bytes -= it->second.size;
+	files.erase(it);
+	++dropped;
+	return 0;
+}
+
+int TFTP_PRELOAD::count()
+{ return files.size(); }
@@ -0,0 +1,69 @@
+#ifndef TFTP_PRELOAD_H
+#define TFTP_PRELOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ *	Startup warm-up
+ *
+ *	Files named in a manifest (one path or glob per line, relative to the
+ *	root directory, '#' starts a comment) are copied into locked anonymous
+ *	memory by a pool of threads before the server starts answering.  RRQs
+ *	for those files are then served straight from memory.
+ *
+ *	The copy is ours, so a file truncated or rewritten on disk cannot pull
+ *	pages from under a transfer (a shared file mapping would SIGBUS).
+ *	find() checks the file's inode, mtime and size with a stat() and drops
+ *	the copy once the file changed, at most once per revalidate_ms like
+ *	the local storage's fd cache, so a hot file costs no stat() per RRQ;
+ *	drop() is for uploads the server stores itself.  A dropped copy stays alive for the readers holding it
+ *	(see owner).
+ */
+
+#define TFTP_PRELOAD_MAX_THREADS 32
+#define TFTP_PRELOAD_REVALIDATE	1000	// ms a copy is trusted without a stat() (as TFTP_FD_CACHE_REVALIDATE)
+
+struct TFTP_PRELOAD_FILE{
+	const char* data;	// NULL for an empty file
+	size_t size;
+	int locked;			// mlock() succeeded
+	std::shared_ptr<const void> owner;	// Unmaps data with the last holder, NULL = the caller's (add())
+	std::string path;	// File copied, "" = not checked (add())
+	uint64_t inode;		// Of the file when it was copied
+	int64_t mtime_ns;
+	long checked_ms;	// tftp_now_ms() of the last check against the file
+};
+
+class TFTP_PRELOAD{
+private:
+	std::map<std::string, TFTP_PRELOAD_FILE> files;	// Keyed by path relative to the root
+
+	static int expand(const char* rootdir, const char* manifest,
+					  std::vector<std::string>* paths, std::vector<std::string>* keys);
+	static int map(const char* path, TFTP_PRELOAD_FILE* out);
+	int current(TFTP_PRELOAD_FILE& f);
+
+public:
+	/* Last load() */
+	long load_ms;
+	size_t bytes;
+	size_t locked_bytes;
+	int failed;
+	long dropped;		// Copies dropped because their file changed
+	int revalidate_ms;	// How stale a copy may be (0 = stat() on every find())
+
+	TFTP_PRELOAD();
+
+	int load(const char* rootdir, const char* manifest, int threads);
+	int add(const char* name, const char* data, size_t size);
+	const TFTP_PRELOAD_FILE* find(const char* name);
+	int drop(const char* name);
+	int count();
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include "tftp_packet.h"
+#include "tftp_transport.h"
+#include "tftp_trace.h"
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+
+/*
+ *	TFTP trace replay
+ *
+ *	Re-drives a server from a trace captured with `tftpserver -c`.  Every
+ *	client of the trace gets its own socket here, and what the clients
+ *	sent goes out again, in trace order: requests to the server's port,
+ *	the rest to the TID the server answers that client from this time.
+ *
+ *	Before a client sends, the answers the original server had given it
+ *	by then are waited for (at most -t ms), so the replay keeps each
+ *	transfer's cause and effect even when the server is faster or slower
+ *	than the original.  By default sends also keep the trace's timing
+ *	(scaled by -x); with -f they go out as fast as the server answers.
+ *	Answers are compared with the original ones, in order per client
+ *	(DATA by size and header, the trace does not keep its contents).
+ *
+ *	With -l the trace is listed instead.
+ *
+ *	Usage: tftp_replay [-s host] [-p port] [-f] [-x speed] [-t timeout_ms] [-l] trace
+ */
+
+using namespace std;
+
+struct Peer{
+	int sock;
+	struct sockaddr_in tid;		// Where the server answers from, once it has
+	int has_tid;
+	int done;					// Sent its last datagram
+	long expected;				// Answers the original server had sent by now
+	long received;
+	size_t last_in;				// Index of the client's last datagram in the trace
+	vector<const TFTP_TRACE_ENTRY*> answers;	// Original answers, in order
+
+	Peer(){ sock = -1; has_tid = done = 0; expected = received = 0; last_in = 0; }
+};
+
+static long now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static uint64_t peerKey(const TFTP_TRACE_RECORD& r)
+{ return ((uint64_t)r.peer_addr << 16) | r.peer_port; }
+
+static void usage(){
+	cout << "tftp_replay [-s host] [-p port] [-f] [-x speed] [-t timeout_ms] [-l] trace\n";
+}
+
+static const char* opcodeName(const TFTP_TRACE_ENTRY& e){
+	static const char* names[] = { "?", "RRQ", "WRQ", "DATA", "ACK", "ERROR", "OACK" };
+	if(e.r.length < 2) return "?";
+	int op = ((unsigned char)e.payload[0] << 8) | (unsigned char)e.payload[1];
+	return op >= 1 && op <= 6 ? names[op] : "?";
+}
+
+/*
+ *	One line per record: time, direction, server port, client, packet
+ */
+static void list(TFTP_TRACE& trace){
+	uint64_t base = trace.entries.empty() ? 0 : trace.entries[0].r.time_us;
+	for(size_t i = 0; i < trace.entries.size(); ++i){
+		const TFTP_TRACE_ENTRY& e = trace.entries[i];
+		char line[160];
+		struct in_addr a;
+		a.s_addr = e.r.peer_addr;
+		if(e.r.direction == TFTP_TRACE_BIND){
+			snprintf(line, sizeof(line), "%12.6f bind  :%u\n", (e.r.time_us - base) / 1e6, e.r.local_port);
+			cout << line;
+			continue;
+		}
+		const char* op = opcodeName(e);
+		snprintf(line, sizeof(line), "%12.6f %s :%-5u %s %15s:%-5u %-5s", (e.r.time_us - base) / 1e6,
+				 e.r.direction == TFTP_TRACE_IN ? "in " : "out", e.r.local_port,
+				 e.r.direction == TFTP_TRACE_IN ? "<-" : "->",
+				 inet_ntoa(a), ntohs(e.r.peer_port), op);
+		cout << line;
+		if(e.r.length >= 4 && (op[0] == 'D' || op[0] == 'A'))
+			cout << " " << (((unsigned char)e.payload[2] << 8) | (unsigned char)e.payload[3]);
+		else if(e.r.length > 2 && op[0] != '?'){
+			string s(e.payload + 2, e.r.length - 2);
+			replace(s.begin(), s.end(), '\0', ' ');
+			cout << " " << s;
+		}
+		cout << " (" << e.r.wire_length << " bytes)\n";
+	}
+}
+
+int main(int argc, char* argv[]){
+	const char* host = "127.0.0.1";
+	int port = 49999;
+	int fast = 0;
+	double speed = 1;
+	int timeout_ms = 200;
+	int listing = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "s:p:fx:t:l")) != -1){
+		switch(opt){
+			case 's': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'f': fast = 1; break;
+			case 'x': speed = atof(optarg); break;
+			case 't': timeout_ms = atoi(optarg); break;
+			case 'l': listing = 1; break;
+			default: usage(); return 1;
+		}
+	}
+	if(optind != argc - 1 || speed <= 0){ usage(); return 1; }
+
+	TFTP_TRACE trace;
+	if(trace.open(argv[optind]) < 0){
+		cerr << "tftp_replay: " << argv[optind] << " is not a trace\n";
+		return 1;
+	}
+	if(listing){
+		list(trace);
+		return 0;
+	}
+
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &server.sin_addr) != 1){
+		cerr << "tftp_replay: bad host " << host << endl;
+		return 1;
+	}
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max){
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	/* The server's listening port(s) in the trace: bound ones, and
+	   wherever requests arrived (a restarted server never binds) */
+	set<uint16_t> listeners;
+	unordered_map<uint64_t, Peer> peers;
+	long to_send = 0;
+	for(size_t i = 0; i < trace.entries.size(); ++i){
+		const TFTP_TRACE_ENTRY& e = trace.entries[i];
+		if(e.r.direction == TFTP_TRACE_BIND){
+			listeners.insert(e.r.local_port);
+			continue;
+		}
+		Peer& p = peers[peerKey(e.r)];
+		if(e.r.direction == TFTP_TRACE_OUT){
+			p.answers.push_back(&e);
+			continue;
+		}
+		const char* op = opcodeName(e);
+		if(op[0] == 'R' || op[0] == 'W') listeners.insert(e.r.local_port);
+		p.last_in = i;
+		++to_send;
+	}
+
+	TFTP_SOCKET_TRANSPORT transport;
+	vector<TFTP_EVENT> events(TFTP_TRANSPORT_MAX_EVENTS);
+	TFTP_PACKET in;
+	long sent = 0, identical = 0, differ = 0, unexpected = 0, waits = 0;
+
+	/* A client that has sent everything and got every answer is closed */
+	auto finished = [&](Peer& p){
+		if(!p.done || p.received < (long)p.answers.size()) return;
+		transport.closeSocket(p.sock);
+		p.sock = -1;
+	};
+	/* Read every answer that has arrived (waiting up to wait_us for the first) */
+	auto drain = [&](long wait_us){
+		int n = transport.wait(&events[0], events.size(), wait_us > 0 ? (int)((wait_us + 999) / 1000) : 0);
+		for(int i = 0; i < n; ++i){
+			Peer& p = *(Peer*)events[i].tag;
+			struct sockaddr_in from;
+			int len;
+			while(p.sock >= 0 && (len = transport.recvFrom(p.sock, in.getData(0), TFTP_PACKET_MAX_SIZE, &from)) >= 0){
+				p.tid = from;
+				p.has_tid = 1;
+				if((size_t)p.received < p.answers.size()){
+					const TFTP_TRACE_ENTRY* a = p.answers[p.received];
+					if(a->r.wire_length == len && memcmp(a->payload, in.getData(0), a->r.length) == 0) ++identical;
+					else ++differ;
+				}
+				else ++unexpected;
+				++p.received;
+			}
+			if(p.sock >= 0) finished(p);
+		}
+	};
+
+	long begin = now_us();
+	uint64_t base = trace.entries.empty() ? 0 : trace.entries[0].r.time_us;
+	for(size_t i = 0; i < trace.entries.size(); ++i){
+		const TFTP_TRACE_ENTRY& e = trace.entries[i];
+		if(e.r.direction == TFTP_TRACE_BIND) continue;
+		Peer& p = peers[peerKey(e.r)];
+		if(e.r.direction == TFTP_TRACE_OUT){
+			++p.expected;
+			continue;
+		}
+		/* Causality: what the client had seen before it sent this */
+		long deadline = now_us() + timeout_ms * 1000L;
+		while(p.received < p.expected){
+			long left = deadline - now_us();
+			if(left <= 0){
+				++waits;
+				break;
+			}
+			drain(left);
+		}
+		if(!fast){
+			long due = begin + (long)((e.r.time_us - base) / speed);
+			for(long left; (left = due - now_us()) > 0;) drain(left);
+		}
+		drain(0);
+		if(p.sock < 0){
+			if((p.sock = transport.openSocket()) < 0){
+				cerr << "tftp_replay: socket() failed: " << strerror(errno) << endl;
+				return 1;
+			}
+			fcntl(p.sock, F_SETFL, O_NONBLOCK);
+			transport.watch(p.sock, &p);
+		}
+		struct sockaddr_in* to = &server;
+		if(!listeners.count(e.r.local_port) && p.has_tid) to = &p.tid;
+		transport.sendTo(p.sock, e.payload, e.r.length, to);
+		++sent;
+		if(i == p.last_in){
+			p.done = 1;
+			finished(p);
+		}
+	}
+	/* Last answers */
+	long deadline = now_us() + timeout_ms * 1000L;
+	for(long left; (left = deadline - now_us()) > 0;){
+		long missing = 0;
+		for(unordered_map<uint64_t, Peer>::iterator i = peers.begin(); i != peers.end(); ++i)
+			if(i->second.sock >= 0 && i->second.received < i->second.expected) ++missing;
+		if(!missing) break;
+		drain(left);
+	}
+	double secs = (now_us() - begin) / 1e6;
+	long expected = 0, received = 0;
+	for(unordered_map<uint64_t, Peer>::iterator i = peers.begin(); i != peers.end(); ++i){
+		expected += i->second.answers.size();
+		received += min((long)i->second.answers.size(), i->second.received);
+		if(i->second.sock >= 0) transport.closeSocket(i->second.sock);
+	}
+
+	cout << "trace:      " << trace.entries.size() << " records, " << peers.size() << " clients\n"
+		<< "sent:       " << sent << " of " << to_send << " datagrams in " << secs << " s ("
+		<< sent / secs << "/s, " << (fast ? "fast" : "timed") << ")\n"
+		<< "answers:    " << received << " of " << expected << " (" << identical << " identical, "
+		<< differ << " differ, " << unexpected << " extra)\n"
+		<< "waits:      " << waits << " timed out\n";
+	return (differ || received < expected) ? 2 : 0;
+}
@@ -0,0 +1,308 @@
+
+#include "tftp_scheduler.h"
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ *	Monotonic clock in microseconds
+ */
+long tftp_now_us()
+{ return tftp_now_ns() / 1000ULL; }
+
+/*
+ *	Parses a size/rate with an optional K, M or G suffix (powers of 1000)
+ */
+static double parseRate(const char* s){
+	char* end = NULL;
+	double v = strtod(s, &end);
+	switch(end ? *end : 0){
+		case 'k': case 'K': return v * 1e3;
+		case 'm': case 'M': return v * 1e6;
+		case 'g': case 'G': return v * 1e9;
+	}
+	return v;
+}
+
+/*
+ *	Parse a rate limit spec, e.g. "global=100M,subnet=40M,client=10M,burst=64K,prefix=24,txtime=1"
+ *
+ *	@param	spec	Comma separated key=value list, rates in bytes/s
+ *	@param	out		Limits to fill in (untouched keys keep their value)
+ *	@return			0 | -1 on an unknown key
+ */
+int TFTP_RATE_LIMITS::parse(const char* spec, TFTP_RATE_LIMITS* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "global"))			out->global_rate = parseRate(val);
+		else if(!strcmp(tok, "subnet"))		out->subnet_rate = parseRate(val);
+		else if(!strcmp(tok, "client"))		out->client_rate = parseRate(val);
+		else if(!strcmp(tok, "burst"))		out->burst = parseRate(val);
+		else if(!strcmp(tok, "prefix"))		out->subnet_prefix = atoi(val);
+		else if(!strcmp(tok, "quantum"))	out->quantum = atoi(val);
+		else if(!strcmp(tok, "txtime"))		out->txtime = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->subnet_prefix < 0 || out->subnet_prefix > 32 || out->quantum <= 0) rv = -1;
+	return rv;
+}
+
+/*
+ *	Token bucket
+ */
+TFTP_TOKEN_BUCKET::TFTP_TOKEN_BUCKET()
+{ rate = burst = tokens = 0; last_us = 0; }
+
+void TFTP_TOKEN_BUCKET::init(double _rate, double _burst, long now_us){
+	rate = _rate;
+	burst = _burst;
+	tokens = _burst;
+	last_us = now_us;
+}
+
+void TFTP_TOKEN_BUCKET::refill(long now_us){
+	if(now_us <= last_us) return;
+	tokens = min(burst, tokens + rate * (now_us - last_us) / 1e6);
+	last_us = now_us;
+}
+
+/*
+ *	@return			us until `bytes` tokens are available (0 = now)
+ */
+long TFTP_TOKEN_BUCKET::delay(int bytes, long now_us){
+	if(rate <= 0) return 0;
+	refill(now_us);
+	if(bytes > burst) bytes = burst;	// Bigger than the bucket: wait for a full one
+	if(tokens >= bytes) return 0;
+	return (long)((bytes - tokens) * 1e6 / rate) + 1;
+}
+
+/*
+ *	May go negative when a departure time is handed to the kernel early
+ */
+void TFTP_TOKEN_BUCKET::take(int bytes)
+{ if(rate > 0) tokens -= bytes; }
+
+bool TFTP_TOKEN_BUCKET::full()
+{ return tokens >= burst; }
+
+/*
+ *	Constructor
+ *
+ *	@param	t		Transport the datagrams go out on
+ *	@param	limits	Rate limits
+ */
+TFTP_SCHEDULER::TFTP_SCHEDULER(TFTP_TRANSPORT* t, TFTP_RATE_LIMITS _limits){
+	transport = t;
+	cursor = 0;
+	sent_packets = sent_bytes = throttled = 0;
+	setLimits(_limits);
+}
+
+void TFTP_SCHEDULER::setLimits(TFTP_RATE_LIMITS _limits){
+	limits = _limits;
+	quantum = limits.quantum;
+	subnet_mask = limits.subnet_prefix ? 0xffffffffu << (32 - limits.subnet_prefix) : 0;
+	global.init(limits.global_rate, limits.burst, tftp_now_us());
+	subnets.clear();
+	clients.clear();
+}
+
+/*
+ *	@return			Non-zero if any limit is configured
+ */
+int TFTP_SCHEDULER::enabled()
+{ return limits.global_rate > 0 || limits.subnet_rate > 0 || limits.client_rate > 0; }
+
+/*
+ *	Finds (or creates) the bucket for key in m
+ */
+TFTP_TOKEN_BUCKET* TFTP_SCHEDULER::bucket(map<uint32_t, TFTP_TOKEN_BUCKET>& m, uint32_t key,
+										  double rate, long now_us){
+	map<uint32_t, TFTP_TOKEN_BUCKET>::iterator it = m.find(key);
+	if(it != m.end()) return &it->second;
+	if(m.size() >= TFTP_SCHED_MAX_BUCKETS) prune();
+	TFTP_TOKEN_BUCKET& b = m[key];
+	b.init(rate, limits.burst, now_us);
+	return &b;
+}
+
+/*
+ *	Drops buckets that are full again; they hold no state worth keeping
+ */
+void TFTP_SCHEDULER::prune(){
+	long now = tftp_now_us();
+	map<uint32_t, TFTP_TOKEN_BUCKET>* maps[] = { &subnets, &clients };
+	for(int i = 0; i < 2; ++i)
+		for(map<uint32_t, TFTP_TOKEN_BUCKET>::iterator it = maps[i]->begin(); it != maps[i]->end();){
+			it->second.refill(now);
+			if(it->second.full()) maps[i]->erase(it++);
+			else ++it;
+		}
+}
+
+/*
+ *	@return			us until all buckets of f have room for bytes (0 = now)
+ */
+long TFTP_SCHEDULER::admit(Flow* f, int bytes, long now_us){
+	long d = global.delay(bytes, now_us);
+	if(limits.subnet_rate > 0)
+		d = max(d, bucket(subnets, f->ip & subnet_mask, limits.subnet_rate, now_us)->delay(bytes, now_us));
+	if(limits.client_rate > 0)
+		d = max(d, bucket(clients, f->ip, limits.client_rate, now_us)->delay(bytes, now_us));
+	return d;
+}
+
+/*
+ *	Sends the datagram at the head of f and charges its buckets
+ *
+ *	@param	depart_us	Departure time handed to the kernel (0 = now)
+ */
+int TFTP_SCHEDULER::transmit(Flow* f, long now_us, long depart_us){
+	Datagram& d = f->queue.front();
+	int len = d.data.size();
+	int n;
+	if(d.segment > 0)
+		n = transport->sendSegments(d.fd, &d.data[0], len, d.segment, &d.to);
+	else if(depart_us > 0)
+		n = transport->sendToAt(d.fd, &d.data[0], len, &d.to, depart_us * 1000L);
+	else
+		n = transport->sendTo(d.fd, &d.data[0], len, &d.to);
+	if(n < 0 && depart_us > 0){
+		limits.txtime = 0;	// Kernel refused the departure time, pace in userspace from now on
+		n = transport->sendTo(d.fd, &d.data[0], len, &d.to);
+	}
+	global.take(len);
+	if(limits.subnet_rate > 0) bucket(subnets, f->ip & subnet_mask, limits.subnet_rate, now_us)->take(len);
+	if(limits.client_rate > 0) bucket(clients, f->ip, limits.client_rate, now_us)->take(len);
+	sent_packets += d.segment > 0 ? (len + d.segment - 1) / d.segment : 1;
+	f->queue.pop_front();
+	sent_bytes += len;
+	return n;
+}
+
+/*
+ *	Queue a datagram on a flow, sending it right away when nothing is waiting
+ *
+ *	@param	flow	Flow key (the session)
+ *	@param	fd		Socket to send from
+ *	@param	buf		Datagram
+ *	@param	len		Datagram length
+ *	@param	to		Destination
+ *	@param	segment	> 0: buf holds several datagrams of this size (the last
+ *					may be shorter), sent with one GSO call
+ *	@return			len
+ */
+int TFTP_SCHEDULER::send(void* flow, int fd, const void* buf, int len, struct sockaddr_in* to,
+						 int segment){
+	map<void*, Flow>::iterator it = flows.find(flow);
+	if(it == flows.end()){
+		Flow& f = flows[flow];
+		f.key = flow;
+		f.ip = ntohl(to->sin_addr.s_addr);
+		f.deficit = 0;
+		f.active = 0;
+		if(limits.txtime && transport->setTxTime(fd) < 0) limits.txtime = 0;
+		it = flows.find(flow);
+	}
+	Flow* f = &it->second;
+	f->queue.push_back(Datagram());
+	Datagram& d = f->queue.back();
+	d.fd = fd;
+	d.to = *to;
+	d.segment = segment;
+	d.data.assign((const char*)buf, (const char*)buf + len);
+	if(len > quantum) quantum = len;
+
+	long now = tftp_now_us();
+	if(ring.empty() && f->queue.size() == 1 && admit(f, len, now) == 0){
+		transmit(f, now, 0);
+		return len;
+	}
+	if(!f->active){
+		f->active = 1;
+		ring.push_back(f);
+	}
+	return len;
+}
+
+/*
+ *	Serve the active flows with deficit round robin, as far as the buckets allow
+ *
+ *	@return			ms until dispatch() should run again | -1 if nothing is queued
+ */
+int TFTP_SCHEDULER::dispatch(){
+	long now = tftp_now_us();
+	long wait_us = -1;
+	int progress = 1;
+	while(!ring.empty() && progress){
+		progress = 0;
+		wait_us = -1;
+		size_t rounds = ring.size();
+		for(size_t i = 0; i < rounds && !ring.empty(); ++i){
+			if(cursor >= ring.size()) cursor = 0;
+			Flow* f = ring[cursor];
+			f->deficit += quantum;
+			while(!f->queue.empty() && (int)f->queue.front().data.size() <= f->deficit){
+				int len = f->queue.front().data.size();
+				long d = admit(f, len, now);
+				int early = limits.txtime && d <= TFTP_SCHED_TXTIME_HORIZON && !f->queue.front().segment;
+				if(d > 0 && !early){
+					++throttled;
+					f->deficit = min(f->deficit, quantum);
+					if(wait_us < 0 || d < wait_us) wait_us = d;
+					break;
+				}
+				transmit(f, now, d > 0 ? now + d : 0);
+				f->deficit -= len;
+				progress = 1;
+			}
+			if(f->queue.empty()){
+				f->deficit = 0;
+				f->active = 0;
+				ring.erase(ring.begin() + cursor);
+			}
+			else ++cursor;
+		}
+	}
+	if(ring.empty()) return -1;
+	return wait_us < 1000 ? 1 : (int)((wait_us + 999) / 1000);
+}
+
+/*
+ *	@return			# of datagrams still queued on flow
+ */
+int TFTP_SCHEDULER::pending(void* flow){
+	map<void*, Flow>::iterator it = flows.find(flow);
+	return it == flows.end() ? 0 : it->second.queue.size();
+}
+
+/*
+ *	Forget a flow and anything still queued on it
+ */
+void TFTP_SCHEDULER::remove(void* flow){
+	map<void*, Flow>::iterator it = flows.find(flow);
+	if(it == flows.end()) return;
+	vector<Flow*>::iterator r = find(ring.begin(), ring.end(), &it->second);
+	if(r != ring.end()){
+		if((size_t)(r - ring.begin()) < cursor) --cursor;
+		ring.erase(r);
+	}
+	flows.erase(it);
+}
+
+/*
+ *	Destructor
+ */
+TFTP_SCHEDULER::~TFTP_SCHEDULER(){}
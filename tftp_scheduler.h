@@ -0,0 +1,121 @@
+#ifndef TFTP_SCHEDULER_H
+#define TFTP_SCHEDULER_H
+
+#include "tftp_transport.h"
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+/*
+ *	Egress scheduler for DATA packets
+ *
+ *	Every session is a flow.  Flows with queued datagrams are served with
+ *	deficit round robin, and a datagram only leaves once the global, the
+ *	per-subnet and the per-client token buckets all have room for it.
+ *	A rate of 0 means unlimited.
+ *
+ *	A queued entry may be a GSO super-buffer: several equal-size datagrams
+ *	(a TFTP window) that go out with one sendSegments() call.  The DRR
+ *	quantum is raised to the largest entry queued so far, so every flow
+ *	that has tokens sends a whole entry per round: flows stay byte-fair,
+ *	and a window is neither split nor held back for many rounds.
+ */
+
+#define TFTP_SCHED_DEFAULT_QUANTUM	1500
+#define TFTP_SCHED_DEFAULT_BURST	(64 * 1024)
+#define TFTP_SCHED_DEFAULT_PREFIX	24
+#define TFTP_SCHED_TXTIME_HORIZON	2000	// us a packet may be handed to the kernel early
+#define TFTP_SCHED_MAX_BUCKETS		4096	// Idle buckets are pruned past this
+
+struct TFTP_RATE_LIMITS{
+	double global_rate;		// Bytes/s, 0 = unlimited
+	double subnet_rate;
+	double client_rate;
+	double burst;			// Bucket depth in bytes
+	int subnet_prefix;		// Subnet = client address / prefix
+	int quantum;			// DRR quantum in bytes
+	int txtime;				// Use SO_TXTIME departure times when available
+
+	TFTP_RATE_LIMITS(){
+		global_rate = subnet_rate = client_rate = 0;
+		burst = TFTP_SCHED_DEFAULT_BURST;
+		subnet_prefix = TFTP_SCHED_DEFAULT_PREFIX;
+		quantum = TFTP_SCHED_DEFAULT_QUANTUM;
+		txtime = 0;
+	}
+
+	static int parse(const char* spec, TFTP_RATE_LIMITS* out);
+};
+
+class TFTP_TOKEN_BUCKET{
+public:
+	double rate;	// Bytes/s
+	double burst;
+	double tokens;
+	long last_us;
+
+	TFTP_TOKEN_BUCKET();
+	void init(double rate, double burst, long now_us);
+	void refill(long now_us);
+	long delay(int bytes, long now_us);	// us until bytes fit, 0 = now
+	void take(int bytes);
+	bool full();
+};
+
+class TFTP_SCHEDULER{
+private:
+	struct Datagram{
+		int fd;
+		struct sockaddr_in to;
+		int segment;				// > 0: data holds datagrams of this size
+		std::vector<char> data;
+	};
+	struct Flow{
+		void* key;
+		uint32_t ip;				// Host byte order
+		std::deque<Datagram> queue;
+		int deficit;
+		int active;					// In the round robin ring
+	};
+
+	TFTP_TRANSPORT* transport;
+	TFTP_RATE_LIMITS limits;
+	uint32_t subnet_mask;
+	int quantum;					// limits.quantum, or the largest entry queued if bigger
+
+	TFTP_TOKEN_BUCKET global;
+	std::map<uint32_t, TFTP_TOKEN_BUCKET> subnets;
+	std::map<uint32_t, TFTP_TOKEN_BUCKET> clients;
+
+	std::map<void*, Flow> flows;
+	std::vector<Flow*> ring;		// Active flows, served in order
+	size_t cursor;
+
+	TFTP_TOKEN_BUCKET* bucket(std::map<uint32_t, TFTP_TOKEN_BUCKET>& m, uint32_t key,
+							  double rate, long now_us);
+	long admit(Flow* f, int bytes, long now_us);
+	int transmit(Flow* f, long now_us, long depart_us);
+	void prune();
+
+public:
+	/* Counters */
+	long sent_packets;
+	long sent_bytes;
+	long throttled;		// Times a flow had to wait for tokens
+
+	TFTP_SCHEDULER(TFTP_TRANSPORT* t, TFTP_RATE_LIMITS limits);
+
+	int send(void* flow, int fd, const void* buf, int len, struct sockaddr_in* to, int segment = 0);
+	int dispatch();
+	int pending(void* flow);
+	void remove(void* flow);
+	void setLimits(TFTP_RATE_LIMITS limits);
+	int enabled();
+
+	~TFTP_SCHEDULER();
+};
+
+long tftp_now_us();
+
+#endif
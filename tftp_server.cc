@@ -7,16 +7,60 @@
  *	@param	port	Port Number
  *	@param	dir		Server's (Root) Directory Location
  *	@param	db		Debugging (0 = no | !0 = yes)
+ *	@param	t		Datagram transport (NULL = kernel sockets, owned by the server)
+ *	@param	fd		Already bound listening socket to adopt (-1 = bind a new one)
  *	@action			Server is established and ready to accept clients
  */
 
-TFTP_SERVER::TFTP_SERVER(int _port, char* _dir, int _db = 0){
+TFTP_SERVER::TFTP_SERVER(int _port, char* _dir, int _db = 0, TFTP_TRANSPORT* _t, int _fd){
 	DEBUG = _db;
+	running = 1;
 	server_port = _port;
 	strcpy(rootdir,_dir);
 	
-	if((server_socketfd = socket(AF_INET, SOCK_DGRAM,0)) < 0){
+	own_transport = (_t == NULL);
+	transport = own_transport ? new TFTP_SOCKET_TRANSPORT() : _t;
+	scheduler = new TFTP_SCHEDULER(transport, TFTP_RATE_LIMITS());
+	admission = new TFTP_ADMISSION();
+	sockets = new TFTP_SOCKET_POOL(transport);
+	storage = new TFTP_LOCAL_STORAGE();
+	own_storage = 1;
+	active_sessions = 0;
+	open_files = 0;
+	preload = NULL;
+	pack = NULL;
+	virtuals = NULL;
+	negatives = NULL;
+	handler = NULL;
+	duplicates = retransmits = 0;
+	edge_hits = edge_fetches = edge_coalesced = edge_current = edge_stale = 0;
+	next_reap = 0;
+	reap_timer = -1;
+	listener_drained = 0;
+	timer_due = -1;
+	events_handled = 0;
+	busy_packet.createError(ERROR_NOT_DEFINED,(char*)"Server busy");
+	missing_packet.createError(ERROR_FILE_NOT_FOUND,(char*)"File Not Found");
+	restart_argv = NULL;
+	restart_requested = 0;
+	handoff_channel = -1;
+	handoff_child = -1;
+	draining = 0;
+	
+	if(_fd >= 0){
+		if(DEBUG) cout << "TFTP_SERVER::TFTP_SERVER() - Adopting listener (fd " << _fd << ")...\n";
+		server_socketfd = _fd;
+		transport->watch(server_socketfd,&server_socketfd);
+		return;
+	}
+	
+	if((server_socketfd = transport->openSocket()) < 0){
 		if(DEBUG) cerr << "[Error] TFTP_SERVER::TFTP_SERVER() - socket()\n";
+		delete scheduler;
+		delete admission;
+		delete sockets;
+		delete storage;
+		if(own_transport) delete transport;
 		throw TFTPServerException((char*)"Socket Error");
 	}
 	
@@ -26,221 +70,959 @@ TFTP_SERVER::TFTP_SERVER(int _port, char* _dir, int _db = 0){
 	server_addr.sin_addr.s_addr = INADDR_ANY;	// auto-fill with my IP
 	memset(&(server_addr.sin_zero),0,8);		// zero the rest of the struct
 	
-	if(bind(server_socketfd,(struct sockaddr*)&server_addr,sizeof(struct sockaddr)) < 0){
+	if(transport->bindSocket(server_socketfd,&server_addr) < 0){
 		if(DEBUG) cerr << "[Error] TFTP_SERVER::TFTP_SERVER() - bind()\n";
-		close(server_socketfd);
+		transport->closeSocket(server_socketfd);
+		delete scheduler;
+		delete admission;
+		delete sockets;
+		delete storage;
+		if(own_transport) delete transport;
 		throw TFTPServerException((char*)"Bind Error"); }
 	
 	if(DEBUG) cout << "TFTP_SERVER::TFTP_SERVER() - bind() is OK...\n";
+	transport->setReceiveBuffer(server_socketfd,TFTP_LISTEN_BUFFER);
+	transport->watch(server_socketfd,&server_socketfd);
 }
 
 /*
+ *	Serve requests until stop() is called
  *
+ *	The listening socket takes new RRQs/WRQs, every transfer then talks
+ *	to the client from its own socket (its TID).  DATA packets leave
+ *	through the egress scheduler.
  *
+ *	@param	max_clients		Concurrent transfers (at most MAX_CLIENTS)
+ *	@return					RUN_STOPPED | RUN_HANDED_OFF
  */
 int TFTP_SERVER::run(int max_clients){
 	if(DEBUG) cout << "TFTP_SERVER::run() - TFTP Server is running...\n";
-	while(true){
-		int n = receivePacket(&(clients[0]));
-		if(n == -1){
-			cerr << "[Error] TFTP_Server::run() - Poll returned with error\n";
-			closeServer();
-			return 0;
+	start(max_clients);
+	while(running){
+		int rv = pollOnce(TFTP_POLL_INTERVAL);
+		if(rv != RUN_CONTINUE) return rv;
+	}
+	return RUN_STOPPED;
+}
+
+/*
+ *	Set the session slots up, for a program driving pollOnce() from its
+ *	own event loop instead of run()
+ *
+ *	@param	max_clients		Concurrent transfers (at most MAX_CLIENTS)
+ *	@return					0
+ */
+int TFTP_SERVER::start(int max_clients){
+	if(max_clients > MAX_CLIENTS || max_clients < 1) max_clients = MAX_CLIENTS;
+	if(clients.empty()){
+		clients.resize(max_clients);
+		for(int i = max_clients - 1; i >= 0; --i) free_clients.push_back(&clients[i]);
+	}
+	return 0;
+}
+
+/*
+ *	One pass of the event loop: due timers and paced DATA, then whatever
+ *	packets arrive within timeout_ms
+ *
+ *	@param	timeout_ms		Longest wait for packets (0 = don't block, -1 = no
+ *							limit); cut short by the next timer
+ *	@return					RUN_CONTINUE | RUN_STOPPED | RUN_HANDED_OFF
+ */
+int TFTP_SERVER::pollOnce(int timeout_ms){
+	TFTP_EVENT events[TFTP_TRANSPORT_MAX_EVENTS];
+	if(!running) return RUN_STOPPED;
+	if(TFTP_SPANS::dump_requested) TFTP_SPANS::dump();
+	if(restart_requested){
+		restart_requested = 0;
+		beginHandoff();
+	}
+	if(draining && active_sessions == 0){
+		if(DEBUG) cout << "TFTP_SERVER::pollOnce() - Drained, exiting\n";
+		return RUN_HANDED_OFF;
+	}
+	/* Slots freed during the last batch may still have events in it */
+	free_clients.insert(free_clients.end(),released_clients.begin(),released_clients.end());
+	released_clients.clear();
+	int timeout = scheduler->dispatch();
+	int timer = reapClients();
+	if(timer >= 0 && (timeout < 0 || timer < timeout)) timeout = timer;
+	timer_due = timeout < 0 ? -1 : tftp_now_ms() + timeout;
+	if(timeout_ms >= 0 && (timeout < 0 || timeout > timeout_ms)) timeout = timeout_ms;
+	int n = transport->wait(events,TFTP_TRANSPORT_MAX_EVENTS,timeout);
+	events_handled = n > 0;
+	if(n == 0) sockets->refill();		// Idle: spares for the next burst
+	if(n < 0 && (!running || errno == EINTR)) return running ? RUN_CONTINUE : RUN_STOPPED;	// Interrupted (stop() or a signal)
+	if(n < 0){
+		cerr << "[Error] TFTP_Server::pollOnce() - Poll returned with error\n";
+		closeServer();
+		return RUN_STOPPED;
+	}
+	for(int i = 0; i < n; ++i){
+		if(events[i].tag == &handoff_channel){
+			finishHandoff();
+			continue;
 		}
-		else if(n < -1){
-			cerr << "[Error] TFTP_Server::run() - recvfrom returned with error\n";
-			return 0;
+		if(negatives && events[i].tag == negatives){
+			negatives->drain();
+			continue;
+		}
+		/* Drain the listener in batches, or new requests wait behind every busy session */
+		int batch = (events[i].tag == &server_socketfd) ? TFTP_REQUEST_BATCH : 1;
+		listener_drained = 0;
+		for(int b = 0; b < batch && !listener_drained; ++b){
+			Client* client;
+			uint64_t received = TFTP_SPANS::enabled ? TFTP_SPANS::now() : 0;
+			if(events[i].tag == &server_socketfd){
+				if(!(client = receiveRequest())) continue;
+			}
+			else{
+				client = (Client*)events[i].tag;
+				if(receivePacket(client) <= 0) continue;
+			}
+			if(client->span) TFTP_SPANS::record(TFTP_SPAN_RECV,client->span,received);
+			int waiting;
+			if(events[i].tag == &server_socketfd && !client->session)
+				waiting = startSession(client);
+			else
+				waiting = resumeSession(client,TFTP_WAKE_PACKET);
+			if(!waiting){
+				if(DEBUG) cout << "TFTP_SERVER::pollOnce() - Disconnecting Client: "
+								<< client->ip << endl;
+				finishClient(client);
+			}
+		}
+	}
+	return running ? RUN_CONTINUE : RUN_STOPPED;
+}
+
+/*
+ *	fd to watch for readability in a host event loop (epoll's, so one fd
+ *	covers the listener and every transfer socket)
+ *
+ *	@return				The fd | -1 if the transport has none: call
+ *						pollOnce() on nextTimeout() alone
+ */
+int TFTP_SERVER::pollFd()
+{ return transport->pollFd(); }
+
+/*
+ *	How long a host event loop may sleep before calling pollOnce() again,
+ *	if pollFd() stays quiet
+ *
+ *	@return				ms (at most TFTP_POLL_INTERVAL, for housekeeping)
+ */
+int TFTP_SERVER::nextTimeout(){
+	if(!running || events_handled) return 0;
+	if(timer_due < 0) return TFTP_POLL_INTERVAL;
+	long left = timer_due - tftp_now_ms();
+	return (int)max(0L,min(left,(long)TFTP_POLL_INTERVAL));
+}
+
+/*
+ *	Asks run() to return, pollOnce() returns RUN_STOPPED from then on
+ *	(safe to call from a signal handler)
+ */
+void TFTP_SERVER::stop()
+{ running = 0; }
+
+/*
+ *	Asks run() to hand the listener to a new process and drain
+ *	(safe to call from a signal handler)
+ */
+void TFTP_SERVER::restart()
+{ restart_requested = 1; }
+
+/*
+ *	Arguments the new process is started with on restart()
+ */
+void TFTP_SERVER::setRestartArgv(char** argv)
+{ restart_argv = argv; }
+
+/*
+ *	Start the new process and pass it the listener; we keep serving until
+ *	it answers on handoff_channel (see finishHandoff())
+ */
+void TFTP_SERVER::beginHandoff(){
+	if(draining || handoff_channel >= 0 || !restart_argv || server_socketfd < 0){
+		if(DEBUG) cout << "TFTP_SERVER::beginHandoff() - Restart already in progress or not possible\n";
+		return;
+	}
+	if((handoff_channel = tftp_handoff_spawn(restart_argv,server_socketfd,&handoff_child)) < 0){
+		cerr << "[Error] TFTP_SERVER::beginHandoff() - Could not start new process: "
+			<< strerror(errno) << endl;
+		return;
+	}
+	if(DEBUG) cout << "TFTP_SERVER::beginHandoff() - Started pid " << handoff_child
+					<< ", waiting for it to become ready...\n";
+	transport->watch(handoff_channel,&handoff_channel);
+}
+
+/*
+ *	The new process answered: stop taking requests and drain, or carry on
+ *	serving if it went away
+ */
+void TFTP_SERVER::finishHandoff(){
+	int ready = tftp_handoff_wait(handoff_channel);
+	if(ready < 0) return;
+	transport->unwatch(handoff_channel);
+	close(handoff_channel);
+	handoff_channel = -1;
+	if(!ready){
+		cerr << "[Error] TFTP_SERVER::finishHandoff() - New process (pid " << handoff_child
+			<< ") failed, still serving\n";
+		waitpid(handoff_child,NULL,WNOHANG);
+		return;
+	}
+	if(DEBUG) cout << "TFTP_SERVER::finishHandoff() - pid " << handoff_child
+					<< " is serving, draining " << active_sessions << " session(s)...\n";
+	transport->unwatch(server_socketfd);
+	closeServer();
+	draining = 1;
+}
+
+/*
+ *	Sets the egress rate limits for DATA packets
+ */
+void TFTP_SERVER::setRateLimits(TFTP_RATE_LIMITS limits)
+{ scheduler->setLimits(limits); }
+
+/*
+ *	Sets the admission limits for new requests
+ */
+void TFTP_SERVER::setAdmissionLimits(TFTP_ADMISSION_LIMITS limits)
+{ admission->setLimits(limits); }
+
+/*
+ *	Sets the congestion controller of windowed RRQs
+ */
+void TFTP_SERVER::setCongestionControl(TFTP_CONGESTION_CONFIG config)
+{ congestion = config; }
+
+/*
+ *	Sets the transfer socket pool up and fills it
+ */
+void TFTP_SERVER::setSocketPool(TFTP_SOCKET_POOL_CONFIG config){
+	sockets->setConfig(config);
+	while(sockets->refill() > 0);
+}
+
+/*
+ *	Files in the preload are served from memory
+ */
+void TFTP_SERVER::setPreload(TFTP_PRELOAD* _preload)
+{ preload = _preload; }
+
+/*
+ *	Serve the whole namespace (RRQs and listings) out of a packed
+ *	archive instead of rootdir; WRQs are refused
+ */
+void TFTP_SERVER::setPack(TFTP_PACK* _pack)
+{ pack = _pack; }
+
+/*
+ *	RRQs matching a virtual file provider are rendered per request
+ */
+void TFTP_SERVER::setVirtualFiles(TFTP_VIRTUAL* _virtuals)
+{ virtuals = _virtuals; }
+
+/*
+ *	RRQs for names the cache knows to be missing are answered from the
+ *	listening socket without a session (see answerMissing())
+ */
+void TFTP_SERVER::setNegativeCache(TFTP_NEGATIVE_CACHE* _negatives){
+	negatives = _negatives;
+	if(negatives && negatives->fd() >= 0) transport->watch(negatives->fd(),negatives);
+}
+
+/*
+ *	Callbacks of an embedding program (see tftp_handler.h)
+ */
+void TFTP_SERVER::setHandler(TFTP_HANDLER* _handler)
+{ handler = _handler; }
+
+/*
+ *	Serve and store files through another backend (not owned; set it
+ *	before serving)
+ */
+void TFTP_SERVER::setStorage(TFTP_STORAGE* _storage){
+	if(own_storage) delete storage;
+	storage = _storage;
+	own_storage = 0;
+}
+
+/*
+ *	Edge mode: rootdir caches the upstream's files (see tftp_upstream.h);
+ *	uploads are refused
+ */
+void TFTP_SERVER::setUpstream(TFTP_UPSTREAM_CONFIG config)
+{ upstream = config; }
+
+/*
+ *	Find the session talking to the given address
+ *
+ *	@param	from		Client address and port
+ *	@return				The session | NULL
+ */
+Client* TFTP_SERVER::findClient(struct sockaddr_in* from){
+	unordered_map<uint64_t, Client*>::iterator i = peers.find(peerKey(from));
+	if(i == peers.end() || i->second->connection != CONNECTED) return NULL;
+	return i->second;
+}
+
+/*
+ *	Take a free session slot and its buffers for a new request
+ *
+ *	@param	from		Client address and port
+ *	@return				The session | NULL if every slot is in use
+ */
+Client* TFTP_SERVER::acquireClient(struct sockaddr_in* from){
+	if(free_clients.empty()) return NULL;
+	Client* client = free_clients.back();
+	free_clients.pop_back();
+	if(buffer_pool.empty()) client->buffers = new TFTP_SESSION_BUFFERS();
+	else{
+		client->buffers = buffer_pool.back();
+		buffer_pool.pop_back();
+	}
+	client->buffers->send_packet.clearPacket();
+	client->buffers->transferred = -1;
+	client->buffers->size = -1;
+	client->slot = active_clients.size();
+	active_clients.push_back(client);
+	client->address = *from;
+	peers[peerKey(from)] = client;
+	return client;
+}
+
+/*
+ *	Give a session slot and its buffers back (see disconnect())
+ */
+void TFTP_SERVER::releaseClient(Client* client){
+	if(client->slot < 0) return;
+	unordered_map<uint64_t, Client*>::iterator i = peers.find(peerKey(&(client->address)));
+	if(i != peers.end() && i->second == client) peers.erase(i);
+	Client* last = active_clients.back();
+	active_clients[client->slot] = last;
+	last->slot = client->slot;
+	active_clients.pop_back();
+	client->slot = -1;
+	client->buffers->rendered.clear();
+	client->buffers->preloaded.reset();
+	delete client->buffers->congestion;
+	client->buffers->congestion = NULL;
+	if(client->buffers->rendered.capacity() > DIRECTORY_LIST_SIZE) string().swap(client->buffers->rendered);
+	buffer_pool.push_back(client->buffers);
+	client->buffers = NULL;
+	released_clients.push_back(client);
+}
+
+/*
+ *	Read a packet off the listening socket
+ *
+ *	New requests go through admission control and get a free session.
+ *	Anything else is matched to the session of the same address, for
+ *	clients that keep talking to the server's port instead of the TID.
+ *
+ *	@return					Client to process | NULL if dropped
+ */
+Client* TFTP_SERVER::receiveRequest(){
+	Client* client = NULL;
+	TFTP_PACKET* packet = &receive_packet;
+	struct sockaddr_in from;
+	packet->clearPacket();
+	int bytes_recv = transport->recvFrom(server_socketfd,packet->getData(0),
+										 TFTP_PACKET_MAX_SIZE,&from);
+	if(bytes_recv < 4){
+		if(DEBUG) cout << "TFTP_SERVER::receiveRequest() - recvfrom returned " << bytes_recv << endl;
+		if(bytes_recv < 0) listener_drained = 1;
+		return NULL;
+	}
+	packet->setSize(bytes_recv);
+	if(DEBUG){
+		cout << "TFTP_SERVER::receiveRequest() - Packet Received ("
+			<< bytes_recv << " Bytes) from "
+			<< inet_ntoa(from.sin_addr) << "...\n";
+		cout << "TFTP_SERVER::receiveRequest() - Packet Type: \""
+			<< (int)packet->getOpcode() << "\"...\n";
+	}
+	
+	if(!packet->isRRQ() && !packet->isWRQ()){
+		if(!(client = findClient(&from))) return NULL;
+	}
+	else{
+		/* Shed before any socket or file is touched */
+		int decision;
+		uint32_t hash = requestHash(packet);
+		Client* owner = findClient(&from);
+		if(owner && !(owner->request_hash == hash && answerDuplicate(owner))){
+			/* The client has moved on and reuses its port for a new transfer */
+			disconnect(owner);
+			owner = NULL;
+		}
+		string name;
+		if(!owner && handler && authorizeRequest(&from,&name) < 0) return NULL;
+		if(!owner && packet->isRRQ() && answerMissing(&from)){
+			if(handler) completeUnserved(&from,name);
+			return NULL;
 		}
-		if(n == 0) continue;
-		if(processClient(&(clients[0])) == 0){
-			if(DEBUG) cout << "TFTP_SERVER::run() - Disconnecting Client: "
-							<< clients[0].ip << endl;
-			disconnect(&clients[0]);
+		if(owner){
+			decision = ADMIT_DUPLICATE;	// Retransmitted request, the session is already answering
+			++admission->decisions[decision];
 		}
+		else if(free_clients.empty()){
+			decision = ADMIT_SESSIONS;
+			++admission->decisions[decision];
+		}
+		else
+			decision = admission->check(from.sin_addr.s_addr,active_sessions,open_files);
+		if(decision != ADMIT_OK){
+			if(DEBUG) cout << "TFTP_SERVER::receiveRequest() - Rejected request from "
+							<< inet_ntoa(from.sin_addr) << ": " << admission->reason(decision) << endl;
+			if(decision != ADMIT_DUPLICATE){
+				rejectRequest(&from);
+				if(handler) completeUnserved(&from,name);
+			}
+			return NULL;
+		}
+		client = acquireClient(&from);
+		if(handler) client->buffers->name.swap(name);
+		client->request_hash = hash;
+		client->span = TFTP_SPANS::sample();
 	}
+	client->last_active = tftp_now_ms();
+	return client;
+}
+
+/*
+ *	Answer a shed request from the listening socket with the prebuilt
+ *	"Server busy" ERROR (or nothing, if configured to drop)
+ *
+ *	@param	to			Client address
+ *	@return				0
+ */
+int TFTP_SERVER::rejectRequest(struct sockaddr_in* to){
+	if(admission->getLimits().busy == BUSY_DROP) return 0;
+	transport->sendTo(server_socketfd,busy_packet.getData(0),busy_packet.getSize(),to);
+	return 0;
+}
+
+/*
+ *	Pick up a pack replaced on disk (see TFTP_PACK::check()); misses
+ *	cached against the old one are forgotten
+ */
+void TFTP_SERVER::checkPack(){
+	if(pack->check() > 0){
+		if(DEBUG) cout << "TFTP_SERVER::checkPack() - New pack mapped, " << pack->entries() << " files\n";
+		if(negatives) negatives->clear();
+	}
+}
+
+/*
+ *	Answer an RRQ for a name known to be missing with the prebuilt
+ *	"File Not Found" ERROR, from the listening socket; the file system is
+ *	not touched
+ *
+ *	@param	to			Client address
+ *	@return				1 if answered | 0 if the request needs a session
+ */
+int TFTP_SERVER::answerMissing(struct sockaddr_in* to){
+	if(!negatives) return 0;
+	if(pack) checkPack();
+	char name[MAX_PATH_LENGTH];
+	if(receive_packet.getString(2,name,MAX_PATH_LENGTH) == 0 || !negatives->find(name)) return 0;
+	if(DEBUG) cout << "TFTP_SERVER::answerMissing() - " << inet_ntoa(to->sin_addr)
+					<< " - Known missing: " << name << endl;
+	transport->sendTo(server_socketfd,missing_packet.getData(0),missing_packet.getSize(),to);
+	return 1;
+}
+
+/*
+ *	Ask the handler whether a new request may go ahead; a refusal is
+ *	answered from the listening socket
+ *
+ *	@param	from		Client address
+ *	@param	name		Set to the requested file (without "@offset")
+ *	@return				0 | -1 if refused
+ */
+int TFTP_SERVER::authorizeRequest(struct sockaddr_in* from, string* name){
+	char requested[MAX_PATH_LENGTH];
+	if(receive_packet.getString(2,requested,MAX_PATH_LENGTH) == 0) requested[0] = 0;
+	name->assign(requested,strcspn(requested,"@"));
+	TFTP_REQUEST request;
+	request.type = receive_packet.isRRQ() ? REQUEST_READ : REQUEST_WRITE;
+	request.filename = name->c_str();
+	request.peer = from;
+	request.bytes = -1;
+	int error = ERROR_ACCESS_VIOLATION;
+	string message = "Access violation";
+	if(handler->authorize(request,&error,&message) == 0) return 0;
+	if(DEBUG) cout << "TFTP_SERVER::authorizeRequest() - " << inet_ntoa(from->sin_addr)
+					<< " - Refused: " << *name << endl;
+	TFTP_PACKET error_packet;
+	error_packet.createError(error,(char*)message.c_str());
+	transport->sendTo(server_socketfd,error_packet.getData(0),error_packet.getSize(),from);
+	return -1;
+}
+
+/*
+ *	Report an authorized request that never got a session (answered from
+ *	the negative cache, or shed) to the handler as failed
+ *
+ *	@param	from		Client address
+ *	@param	name		The requested file, as authorizeRequest() set it
+ */
+void TFTP_SERVER::completeUnserved(struct sockaddr_in* from, const string& name){
+	TFTP_REQUEST request;
+	request.type = receive_packet.isRRQ() ? REQUEST_READ : REQUEST_WRITE;
+	request.filename = name.c_str();
+	request.peer = from;
+	request.bytes = -1;
+	handler->complete(request,-1);
 }
 
 /*
- *	Receive packet from one client
+ *	Receive packet from one client (on its transfer socket)
  *
  *	@param	client		A client
- *	@return				-1 - Error | 0 - Timeout | >0 - # of bytes received
+ *	@return				-1 - Error | >0 - # of bytes received
  */
 int TFTP_SERVER::receivePacket(Client* client){
-	int bytes_recv = 0;
-	struct pollfd ufd;
-	ufd.fd = server_socketfd;
-	ufd.events = POLLIN;
-	int rv = poll(&ufd,1,4000); // 4 second timeout
-	if(rv < 0){
-		if(DEBUG) cerr << "[Error] TFTP_SERVER::receivePacket() - poll()\n";
+	receive_packet.clearPacket();
+	struct sockaddr_in from;
+	int bytes_recv = transport->recvFrom(client->client_socket,			//Socket fd
+										 receive_packet.getData(0),//buffer
+										 TFTP_PACKET_MAX_SIZE,				//Size of buffer
+										 &from);
+	if(bytes_recv < 0){
+		if(DEBUG)
+			cout << "TFTP_SERVER::receivePacket() - recvfrom error: " << errno << endl;
 		return -1;
-		/* Throw Exception */ }
-	else if(rv == 0){
-		if(DEBUG) cout << "TFTP_SERVER::receivePacket() - Poll Timeout...\n";
+	}
+	receive_packet.setSize(bytes_recv);
+	/* The upstream answers our RRQ from the port (TID) of the transfer */
+	if(client->request_type == REQUEST_FETCH && client->address.sin_port == upstream.address.sin_port &&
+	   from.sin_addr.s_addr == client->address.sin_addr.s_addr)
+		client->address = from;
+	if(from.sin_addr.s_addr != client->address.sin_addr.s_addr ||
+	   from.sin_port != client->address.sin_port){
+		/* Not our peer (RFC 1350 TID check): tell the sender, leave the session alone */
+		if(DEBUG) cout << "TFTP_SERVER::receivePacket() - Unknown TID "
+						<< inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port) << endl;
+		TFTP_PACKET error_packet;
+		error_packet.createError(ERROR_UNKNOWN_TID,(char*)"Unknown transfer ID");
+		transport->sendTo(client->client_socket,error_packet.getData(0),error_packet.getSize(),&from);
 		return 0;
-		/* Timeout */ }
-	else{// Or client->client_socket
-		client->receive_packet.clearPacket();
-		client->send_packet.clearPacket();
-		socklen_t len = sizeof(client->address);
-		//char buffer[512];
-		bytes_recv = recvfrom(server_socketfd,					//Socket fd
-							  client->receive_packet.getData(0),//buffer
-							  //&buffer,
-							  //512,
-							  TFTP_PACKET_MAX_SIZE,				//Size of buffer
-							  0,
-							  (struct sockaddr*)&(client->address),
-							  &len);
-		client->receive_packet.setSize(bytes_recv);
-		if(bytes_recv < 0){
-			if(DEBUG)
-				cout << "TFTP_SERVER::receivePacket() - recvfrom error: " << errno << endl;
-			return -2;
+	}
+	client->last_active = tftp_now_ms();
+	if(DEBUG){
+		cout << "TFTP_SERVER::receivePacket() - Packet Received ("
+			<< bytes_recv << " Bytes) from "
+			<< inet_ntoa(client->address.sin_addr) << "...\n";
+		cout << "TFTP_SERVER::receivePacket() - Packet Type: \""
+			<< (int)*(receive_packet.getData(1)) << "\"...\n";
+	}
+	return bytes_recv;
+}
+
+/*
+ *	End a session; if DATA is still queued in the scheduler the socket
+ *	stays open until it has gone out (see reapClients())
+ */
+void TFTP_SERVER::finishClient(Client* client){
+	client->state = SESSION_CLOSING;
+	if(scheduler->pending(client)) client->connection = CLOSING;
+	else disconnect(client);
+}
+
+/*
+ *	Disconnect sessions that have drained or gone quiet, and run the
+ *	retransmit timers.  Only sessions in use are visited, at most every
+ *	TFTP_REAP_INTERVAL ms.
+ *
+ *	@return			ms until the next retransmit is due | -1 if none is armed
+ */
+int TFTP_SERVER::reapClients(){
+	long now = tftp_now_ms();
+	if(now < next_reap) return reap_timer < 0 ? -1 : next_reap - now;
+	long next = -1;
+	for(size_t i = active_clients.size(); i-- > 0;){	// disconnect() moves the last slot to i
+		if(i >= active_clients.size()) continue;	// An upstream fetch ended, taking its followers
+		Client* client = active_clients[i];
+		if(client->connection == NOT_CONNECTED)		// Request failed before it connected
+			disconnect(client);
+		else if(client->connection == CLOSING && !scheduler->pending(client))
+			disconnect(client);
+		else if(client->connection == CONNECTED && client->state != SESSION_FETCH_WAIT &&
+				now - client->last_active > TFTP_SESSION_TIMEOUT){
+			if(DEBUG) cout << "TFTP_SERVER::reapClients() - Session timed out\n";
+			disconnect(client);
 		}
-		if(DEBUG){
-			cout << "TFTP_SERVER::receivePacket() - Packet Received ("
-				<< bytes_recv << " Bytes) from "
-				<< inet_ntoa(client->address.sin_addr) << "...\n";
-			cout << "TFTP_SERVER::receivePacket() - Packet Type: \""
-				<< (int)*(client->receive_packet.getData(1)) << "\"...\n";
+		else if(client->connection == CONNECTED && client->state != SESSION_IDLE &&
+				client->state != SESSION_FETCH_WAIT && !scheduler->pending(client)){
+			long due = client->last_send + retransmitTimeout(client);
+			if(due <= now){
+				if(!resumeSession(client,TFTP_WAKE_TIMEOUT)){
+					finishClient(client);
+					continue;
+				}
+				due = client->last_send + retransmitTimeout(client);
+			}
+			if(next < 0 || due - now < next) next = due - now;
 		}
-		return bytes_recv;
+		else if(client->connection == CLOSING)
+			next = TFTP_REAP_INTERVAL;		// Check again once it has drained
 	}
-	return 0;
+	reap_timer = next;
+	next_reap = now + (next > TFTP_REAP_INTERVAL || next < 0 ? TFTP_REAP_INTERVAL : next);
+	return next;
 }
 
 /*
- *	Received Packet, process it accordingly
+ *	A client repeated its request: if the session has not heard from it
+ *	since, resend the first answer (OACK, DATA 1 or ACK 0) from memory
+ *
+ *	@return			1 - Duplicate (possibly delayed, dropped) | 0 - The session has sent
+ *					its last DATA, so this is a new transfer from a reused port
+ */
+int TFTP_SERVER::answerDuplicate(Client* client){
+	int first = (client->state == SESSION_OACK_WAIT) ||
+				(client->state == SESSION_RECEIVING && client->block == 0) ||
+				(!client->window && client->block == 1 &&
+				 (client->state == SESSION_SENDING || client->state == SESSION_FINAL_ACK));
+	if(!first) return client->state != SESSION_FINAL_ACK;	// Only after the last DATA may the client have moved on
+	if(scheduler->pending(client)) return 1;
+	++duplicates;
+	retransmit(client);
+	return 1;
+}
+
+/*
+ *	FNV-1a of a request, to tell a retransmitted RRQ/WRQ from a new one
+ */
+uint32_t TFTP_SERVER::requestHash(TFTP_PACKET* packet){
+	uint32_t h = 2166136261u;
+	for(int i = 0; i < packet->getSize(); ++i)
+		h = (h ^ *(unsigned char*)packet->getData(i)) * 16777619u;
+	return h;
+}
+
+/*
+ *	Start the session for the request in receive_packet and run it up to
+ *	its first wait
+ *
  *	@param	client		The Client
- *	@return				0		-> If disconnecting after sending ACK|DATA
- *						else	-> Packet Type received
+ *	@return				0 -> Session over already (refused or failed), disconnect
+ *						1 -> Waiting for the peer
  */
-int TFTP_SERVER::processClient(Client* client){
+int TFTP_SERVER::startSession(Client* client){
 	client->ip = (char *)inet_ntoa(client->address.sin_addr);
-	if(DEBUG) cout << "TFTP_SERVER::processClient() - Client IP: "
+	if(DEBUG) cout << "TFTP_SERVER::startSession() - Client IP: "
 				<< client->ip << endl;
-	switch(client->receive_packet.getOpcode()){
-		case TFTP_OPCODE_RRQ:{
-			/* Find the read file and create a Read Packet to send back */
-			if(DEBUG) cout << "TFTP_SERVER::processClient() - RRQ Received from "
-							<< client->ip << "...\n";
-			client->request_type = REQUEST_READ;
-			if((client->client_socket = socket(AF_INET, SOCK_DGRAM,0)) < 0){
-				if(DEBUG) cerr << "[Error] TFTP_SERVER::processClient() - RRQ socket()\n";
-				return -1; // Throw Exception
-			}
-			/* Determine if a dir request or file request */
-			char RRQ_filename[MAX_PATH_LENGTH];
-			if(client->receive_packet.getString(2,RRQ_filename,MAX_PATH_LENGTH) == 0){
-				if(DEBUG)
-					cout << "[Error] TFTP_SERVER::processClient()-TFTP_PACKET::getString() - returned 0\n";
-					return 0;
-			}
-			cout << "RRQ_FILENAME[0] = " << RRQ_filename[0] << endl;
-			if(RRQ_filename[0] == '?'){
-				if(strlen(RRQ_filename) > 1){
-					if(createDirPacket(client,&(RRQ_filename[1])) < 0){
-						cout << "TFTP_SERVER::processClient() - Error finding Directory\n";
-						return 0;
-					}
-				}
-				else
-					if(createDirPacket(client,(char*)".") < 0){
-						if(DEBUG) cout << "TFTP_SERVER::processClient() - Error Openning Directory";
-						return 0;
-					}
-			} else{
-				if(getReadFile(client) < 0){
-					if(DEBUG) cerr << "[Error] TFTP_SERVER::processClient() - Error Getting Read File\n";
-					return 0;
-				}
-				createReadPacket(client);
-			}
-			if(sendPacket(&(client->send_packet), client) < 0){
-				if(DEBUG) cout << "TFTP_SERVER::sendPacket() - RRQ - sendto returned error ("
-					<< errno << ")\n";
-			}
-			
-			if(client->disconnect_after_send)
-			{ disconnect(client); return 0; }
-			
-			return TFTP_OPCODE_RRQ;
-		}
-		case TFTP_OPCODE_WRQ:{
-			/* Create the write file and an ACK Packet to send back */
-			if(DEBUG) cout << "TFTP_SERVER::processClient() - WRQ Received from "
-							<< client->ip << "...\n";
-			client->request_type = REQUEST_WRITE;
-			if((client->client_socket = socket(AF_INET, SOCK_DGRAM,0)) < 0){
-				if(DEBUG) cerr << "[Error] TFTP_SERVER::processClient() - WRQ socket()\n";
-				return 0; // Throw Exception
-			}
-			createWriteFile(client); // << CHANGE THIS LATER
-			
-			/* Send ACK Back */
-			TFTP_PACKET* ack_packet_WRQ = new TFTP_PACKET();
-			ack_packet_WRQ->createACK(client->block);
-			if(sendPacket(ack_packet_WRQ, client) < 0){
-				if(DEBUG) cout << "TFTP_SERVER::sendPacket() - WRQ - sendto returned error ("
-					<< errno << ")\n";
-			}
-			delete ack_packet_WRQ;
-			/* ~~~~~~~~~~~~~ */
-			
-			return TFTP_OPCODE_WRQ;
-		}
-		case TFTP_OPCODE_DATA:{
-			/* Write Packet data to file */
-			if(DEBUG) cout << "TFTP_SERVER::processClient() - DATA Received from "
-							<< client->ip << "...\n";
-			writeData(client);
-			
-			/* Send ACK Back */
-			TFTP_PACKET* ack_packet_DATA = new TFTP_PACKET();
-			ack_packet_DATA->createACK(client->block);
-			if(sendPacket(ack_packet_DATA, client) < 0){
-				if(DEBUG) cout << "TFTP_SERVER::sendPacket() - DATA - sendto returned error ("
-					<< errno << ")\n";
+	TFTP_TASK task = receive_packet.isRRQ() ? readSession(client) : writeSession(client);
+	client->session = task.handle;
+	return !client->session.done();
+}
+
+/*
+ *	Resume a waiting session
+ *
+ *	@param	client		The Client
+ *	@param	wake		TFTP_WAKE_PACKET (in receive_packet) | TFTP_WAKE_TIMEOUT
+ *	@return				0 -> Session over, disconnect | 1 -> Waiting again
+ */
+int TFTP_SERVER::resumeSession(Client* client, int wake){
+	if(!client->session || client->session.done()) return 0;
+	client->wake = wake;
+	client->session.resume();
+	return !client->session.done();
+}
+
+/*
+ *	The retransmit timer of a session expired: resend its last packet
+ *
+ *	@return				0 | -1 -> Too many retransmits, give up
+ */
+int TFTP_SERVER::timedOut(Client* client){
+	/* Adaptive timeouts retry sooner, but give up no earlier than fixed ones */
+	if(++client->retries > TFTP_MAX_RETRIES &&
+	   tftp_now_ms() - client->last_active >= TFTP_MAX_RETRIES * TFTP_RETRANSMIT_TIMEOUT){
+		if(DEBUG) cout << "TFTP_SERVER::timedOut() - Too many retransmits\n";
+		return -1;
+	}
+	retransmit(client);
+	return 0;
+}
+
+/*
+ *	RRQ session (file or "?dir" listing)
+ *
+ *	Lock-step sends one DATA per ACK.  With windowsize (RFC 7440) every
+ *	ACK gets the next window; an ACK short of the window's end makes it go
+ *	back.  Options are OACKed first, the client's ACK 0 starts the
+ *	transfer.  Duplicate and delayed ACKs are dropped without touching the
+ *	file.  In edge mode a session served from a fetch under way also
+ *	wakes up when more of the file is in (TFTP_WAKE_FETCH).
+ */
+TFTP_TASK TFTP_SERVER::readSession(Client* client){
+	TFTP_SPAN_SCOPE session(TFTP_SPAN_SESSION,client->span);
+	if(openRead(client) < 0) co_return;
+	TFTP_WAIT wait(&(client->wake),client->span);
+	if(client->state == SESSION_OACK_WAIT){
+		for(;;){
+			int wake = co_await wait;
+			if(wake == TFTP_WAKE_TIMEOUT){
+				if(timedOut(client) < 0) co_return;
+				continue;
 			}
-			delete ack_packet_DATA;
-			/* ~~~~~~~~~~~~~ */
-			
-			if(client->disconnect_after_send){
-				cout << "TFTP::processClient() - DATA - Disconnecting...\n" << endl;
-				/*disconnect(client);*/ return 0; }
-			
-			return TFTP_OPCODE_DATA;
-		}
-		case TFTP_OPCODE_ACK:{
-			/* Prepare to send next Read Packet */
-			if(DEBUG) cout << "TFTP_SERVER::processClient() - ACK Received from "
+			if(wake == TFTP_WAKE_FETCH) continue;
+			if(receive_packet.isError()) co_return;
+			if(receive_packet.isACK() && receive_packet.getBlockNumber() == 0) break;
+		}
+		client->retries = 0;
+	}
+	if(client->window) sendWindow(client);
+	else if(sendBlock(client) < 0){
+		if(DEBUG) cout << "TFTP_SERVER::readSession() - sendto returned error ("
+						<< errno << ")\n";
+	}
+	for(;;){
+		int wake = co_await wait;
+		if(wake == TFTP_WAKE_TIMEOUT){
+			if(timedOut(client) < 0) co_return;
+			continue;
+		}
+		if(wake == TFTP_WAKE_FETCH){
+			sendFetched(client);
+			continue;
+		}
+		if(receive_packet.isError()){
+			if(DEBUG) cout << "TFTP_SERVER::readSession() - ERROR Received from "
 							<< client->ip << "...\n";
-			createReadPacket(client);
-			if(sendPacket(&(client->send_packet),client) < 0){
-				if(DEBUG) cout << "TFTP_SERVER::sendPacket() - ACK - sendto returned error ("
-								<< errno << ")\n";
+			co_return;
+		}
+		if(!receive_packet.isACK()) continue;
+		int ack = receive_packet.getBlockNumber();
+		
+		/* Full block number of the ACK, at most the last block sent */
+		int acked = client->block - ((client->block - ack) & 0xffff);
+		/* A windowed client repeats its last ACK when it times out on a
+		 * lost block (RFC 7440): honour that once the window has left */
+		int stale = client->window ? (acked < client->acked_block ||
+									  (acked == client->acked_block && scheduler->pending(client)))
+								   : acked != client->block;
+		if(stale){
+			/* Duplicate or delayed: resending on it is the Sorcerer's Apprentice bug */
+			if(DEBUG) cout << "TFTP_SERVER::readSession() - Duplicate ACK (" << ack << ") dropped\n";
+			++duplicates;
+			continue;
+		}
+		int fresh = acked - client->acked_block;
+		client->acked_block = acked;
+		client->retries = 0;
+		if(client->state == SESSION_FINAL_ACK && (!client->window || acked == client->last_block)){
+			if(DEBUG) cout << "TFTP_SERVER::readSession() - Last ACK, disconnecting...\n";
+			client->buffers->transferred = (int64_t)(client->block - 1) * TFTP_PACKET_DATA_SIZE +
+				client->buffers->send_packet.getSize() - TFTP_DATA_PKT_DATA_OFFSET;
+			co_return;
+		}
+		if(client->window){
+			/* Whole windows are ACKed as they arrive, more may be in flight;
+			 * anything else reports a gap */
+			TFTP_CONGESTION* cc = client->buffers->congestion;
+			if(!fresh || fresh % client->window){
+				if(cc) cc->lost();
+				seekBlock(client,acked);
 			}
-			
-			if(client->disconnect_after_send){
-				cout << "TFTP::processClient() - ACK - Disconnecting...\n" << endl;
-				/*disconnect(client);*/ return 0; }
-			
-			return TFTP_OPCODE_ACK;
-		}
-		case TFTP_OPCODE_ERROR:{
-			/* Something went wrong, quit */
-			if(DEBUG) cout << "TFTP_SERVER::processClient() - ERROR Received from "
+			else if(cc) cc->acked(acked,fresh,tftp_now_us());
+			sendWindow(client);
+		}
+		else if(sendBlock(client) < 0){
+			if(DEBUG) cout << "TFTP_SERVER::readSession() - sendto returned error ("
+							<< errno << ")\n";
+		}
+	}
+}
+
+/*
+ *	WRQ session: ACK every DATA in order, answer a repeated block with the
+ *	ACK already sent
+ */
+TFTP_TASK TFTP_SERVER::writeSession(Client* client){
+	TFTP_SPAN_SCOPE session(TFTP_SPAN_SESSION,client->span);
+	if(openWrite(client) < 0) co_return;
+	TFTP_WAIT wait(&(client->wake),client->span);
+	for(;;){
+		if(co_await wait == TFTP_WAKE_TIMEOUT){
+			if(timedOut(client) < 0) co_return;
+			continue;
+		}
+		if(receive_packet.isError()){
+			if(DEBUG) cout << "TFTP_SERVER::writeSession() - ERROR Received from "
 							<< client->ip << "...\n";
-			return TFTP_OPCODE_ERROR;
+			co_return;
+		}
+		if(!receive_packet.isData()) continue;
+		int block = receive_packet.getBlockNumber();
+		if(block == (client->block & 0xffff)){
+			/* Our ACK was lost: answer again, the data is already written */
+			if(DEBUG) cout << "TFTP_SERVER::writeSession() - Duplicate DATA (" << block << ")\n";
+			++duplicates;
+			sendPacket(&(client->buffers->send_packet),client);
+			continue;
+		}
+		int written = writeData(client);
+		if(written == -2) co_return;
+		if(written < 0){
+			++duplicates;	// Out of order, the client will resend
+			continue;
 		}
-		default:{
-			/* Unknown Packet received, send back Error packet */
+		if(client->disconnect_after_send && finishUpload(client) < 0) co_return;
+		
+		/* Send ACK Back */
+		client->buffers->send_packet.createACK(client->block);
+		client->retries = 0;
+		client->last_send = tftp_now_ms();
+		if(sendPacket(&(client->buffers->send_packet), client) < 0){
+			if(DEBUG) cout << "TFTP_SERVER::writeSession() - sendto returned error ("
+							<< errno << ")\n";
+		}
+		if(client->disconnect_after_send){
+			if(DEBUG) cout << "TFTP_SERVER::writeSession() - Last DATA, disconnecting...\n";
+			client->buffers->transferred = (int64_t)(client->block - 1) * TFTP_PACKET_DATA_SIZE +
+				receive_packet.getSize() - TFTP_DATA_PKT_DATA_OFFSET;
+			co_return;
+		}
+	}
+}
+
+/*
+ *	Open the file or listing of an RRQ and its transfer socket; with
+ *	windowsize the OACK is sent here
+ *
+ *	@param	client		The Client
+ *	@return				0 | -1 -> Failed (error sent)
+ */
+int TFTP_SERVER::openRead(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_REQUEST,client->span);
+	if(DEBUG) cout << "TFTP_SERVER::openRead() - RRQ Received from "
+					<< client->ip << "...\n";
+	client->request_type = REQUEST_READ;
+	if((client->client_socket = sockets->acquire(&(client->address))) < 0){
+		if(DEBUG) cerr << "[Error] TFTP_SERVER::openRead() - RRQ socket()\n";
+		return -1;
+	}
+	client->connection = CONNECTED;
+	++active_sessions;
+	transport->watch(client->client_socket,client);
+	/* Determine if a dir request or file request */
+	char RRQ_filename[MAX_PATH_LENGTH];
+	if(receive_packet.getString(2,RRQ_filename,MAX_PATH_LENGTH) == 0){
+		if(DEBUG)
+			cout << "[Error] TFTP_SERVER::openRead()-TFTP_PACKET::getString() - returned 0\n";
+		return -1;
+	}
+	if(DEBUG) cout << "RRQ_FILENAME[0] = " << RRQ_filename[0] << endl;
+	if(RRQ_filename[0] == '?'){
+		if(openListing(client,strlen(RRQ_filename) > 1 ? &(RRQ_filename[1]) : (char*)".") < 0){
+			if(DEBUG) cout << "TFTP_SERVER::openRead() - Error finding Directory\n";
 			return -1;
 		}
 	}
-	return -1;
+	else if(getReadFile(client) < 0){
+		if(DEBUG) cerr << "[Error] TFTP_SERVER::openRead() - Error Getting Read File\n";
+		return -1;
+	}
+	if(client->read_mem) client->buffers->size = client->read_len - client->read_pos;
+	
+	/* Options (RFC 2347) are OACKed, the client's ACK 0 starts the transfer:
+	   windowsize (RFC 7440) and tsize (RFC 2349, the bytes it carries) */
+	TFTP_PACKET& oack = client->buffers->send_packet;
+	int options = 0;
+	char window[8];
+	if(receive_packet.getOption("windowsize",window,sizeof(window)) > 0 &&
+	   atoi(window) > 0){
+		int asked = atoi(window);
+		client->window = min(asked,TFTP_MAX_WINDOW);
+		/* With a controller the window only sets the ACK cadence: a small one
+		 * gives it feedback often, cwnd decides what is in flight (never more
+		 * than the client asked for, all it said it can take) */
+		if(congestion.mode != TFTP_CC_FIXED) client->window = min(client->window,congestion.ack_window);
+		client->buffers->congestion = TFTP_CONGESTION::create(congestion,client->window,asked);
+		snprintf(window,sizeof(window),"%d",client->window);
+		oack.createOACK();
+		oack.addOption("windowsize",window);
+		++options;
+		if(DEBUG) cout << "TFTP_SERVER::openRead() - windowsize " << client->window << endl;
+	}
+	char tsize[24];
+	if(client->buffers->size >= 0 && receive_packet.getOption("tsize",tsize,sizeof(tsize)) > 0){
+		snprintf(tsize,sizeof(tsize),"%lld",(long long)client->buffers->size);
+		if(!options++) oack.createOACK();
+		oack.addOption("tsize",tsize);
+	}
+	if(options){
+		client->state = SESSION_OACK_WAIT;
+		client->last_send = tftp_now_ms();
+		sendPacket(&oack,client);
+	}
+	return 0;
+}
+
+/*
+ *	Create the file of a WRQ and its transfer socket, and send ACK 0
+ *
+ *	@param	client		The Client
+ *	@return				0 | -1 -> Refused or failed
+ */
+int TFTP_SERVER::openWrite(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_REQUEST,client->span);
+	if(DEBUG) cout << "TFTP_SERVER::openWrite() - WRQ Received from "
+					<< client->ip << "...\n";
+	client->request_type = REQUEST_WRITE;
+	if(pack || upstream.enabled()){
+		if(DEBUG) cout << "TFTP_SERVER::openWrite() - WRQ refused, root is a pack or an edge cache\n";
+		TFTP_PACKET error_packet;
+		error_packet.createError(ERROR_ACCESS_VIOLATION,(char*)"Read-only");
+		transport->sendTo(server_socketfd,error_packet.getData(0),error_packet.getSize(),
+						  &(client->address));
+		return -1;
+	}
+	if((client->client_socket = sockets->acquire(&(client->address))) < 0){
+		if(DEBUG) cerr << "[Error] TFTP_SERVER::openWrite() - WRQ socket()\n";
+		return -1;
+	}
+	client->connection = CONNECTED;
+	++active_sessions;
+	transport->watch(client->client_socket,client);
+	if(createWriteFile(client) < 0) return -1;
+	
+	/* Send ACK Back (or the OACK of crc32c options), kept in send_packet for retransmission */
+	client->state = SESSION_RECEIVING;
+	TFTP_PACKET& ack = client->buffers->send_packet;
+	/* A malformed value is left out of the OACK (RFC 2347): not checked */
+	char crc[16];
+	uint32_t value;
+	int oack = 0;
+	if(receive_packet.getOption("crc32c",crc,sizeof(crc)) > 0 && tftp_crc32c_parse(crc,&value) == 0){
+		client->buffers->expected_crc = value;
+		ack.createOACK();
+		ack.addOption("crc32c",crc);
+		oack = 1;
+	}
+	if(client->read_base > 0 && receive_packet.getOption("crc32c-prefix",crc,sizeof(crc)) > 0 &&
+	   tftp_crc32c_parse(crc,&value) == 0){
+		if(!oack) ack.createOACK();
+		ack.addOption("crc32c-prefix",crc);	// Checked by resumeUpload()
+		oack = 1;
+	}
+	if(!oack) ack.createACK(client->block);
+	client->last_send = tftp_now_ms();
+	if(sendPacket(&(client->buffers->send_packet), client) < 0){
+		if(DEBUG) cout << "TFTP_SERVER::openWrite() - sendto returned error ("
+						<< errno << ")\n";
+	}
+	return 0;
 }
 
 /*
@@ -248,6 +1030,7 @@ int TFTP_SERVER::processClient(Client* client){
  *
  */
 int TFTP_SERVER::getReadFile(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_OPEN,client->span);
 	if(DEBUG) cout << "TFTP_SERVER::getReadFile() - " << client->ip
 					<< " - Finding Read File...\n";
 	char* filename = new char[TFTP_PACKET_MAX_SIZE];
@@ -255,26 +1038,122 @@ int TFTP_SERVER::getReadFile(Client* client){
 	
 	strcpy(filename,rootdir);
 	
-	client->receive_packet.getString(2,(filename + strlen(filename)),
-									client->receive_packet.getSize());
+	receive_packet.getString(2,(filename + strlen(filename)),
+									receive_packet.getSize());
 	if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Getting: " << filename << endl;
 	char at[] = "@";
 	strncpy(actual_file,filename,strcspn(filename,at)+1);
 	
 	if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Actual File: " << actual_file << endl;
-	client->read_file = new ifstream(filename,ios::binary | ios::in | ios::ate);
 	
-	if(!client->read_file->is_open() || !client->read_file->good()){
+	if(handler){
+		string name = filename + strlen(rootdir);
+		name.resize(name.find('@') == string::npos ? name.size() : name.find('@'));
+		TFTP_REQUEST request;
+		request.type = REQUEST_READ;
+		request.filename = name.c_str();
+		request.peer = &(client->address);
+		request.bytes = -1;
+		int served = handler->open(request,&(client->buffers->rendered));
+		if(served < 0){
+			if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Handler: not found: " << name << endl;
+			delete[] filename;
+			sendError(client,ERROR_FILE_NOT_FOUND,(char*)"File Not Found");
+			return -1;
+		}
+		if(served > 0){
+			if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Served by handler: " << name
+							<< " (" << client->buffers->rendered.size() << " Bytes)\n";
+			client->read_mem = client->buffers->rendered.data();
+			client->read_len = client->buffers->rendered.size();
+			client->read_pos = min((size_t)getFileOffset(filename),client->read_len);
+			client->read_base = client->read_pos;
+			delete[] filename;
+			return 0;
+		}
+		client->buffers->rendered.clear();
+	}
+	
+	if(virtuals){
+		string name = filename + strlen(rootdir);
+		if(virtuals->render(name.substr(0,name.find('@')).c_str(),&(client->address),&(client->buffers->rendered))){
+			if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Rendered virtual file: " << name
+							<< " (" << client->buffers->rendered.size() << " Bytes)\n";
+			client->read_mem = client->buffers->rendered.data();
+			client->read_len = client->buffers->rendered.size();
+			client->read_pos = min((size_t)getFileOffset(filename),client->read_len);
+			client->read_base = client->read_pos;
+			delete[] filename;
+			return 0;
+		}
+	}
+	
+	if(pack){
+		string name = filename + strlen(rootdir);
+		const char* data;
+		size_t size;
+		checkPack();
+		if(pack->find(name.substr(0,name.find('@')).c_str(),&data,&size) < 0){
+			delete[] filename;
+			if(errno == ESTALE){
+				if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Pack changed in place, not serving it\n";
+				sendError(client,ERROR_NOT_DEFINED,(char*)"Pack unavailable");
+				return -1;
+			}
+			if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Not in pack: " << name << endl;
+			if(negatives) negatives->insert(name.c_str());
+			sendError(client,ERROR_FILE_NOT_FOUND,(char*)"File Not Found");
+			return -1;
+		}
+		client->buffers->preloaded = pack->owner();
+		client->read_mem = size ? data : "";
+		client->read_len = size;
+		client->read_pos = min((size_t)getFileOffset(filename),size);
+		client->read_base = client->read_pos;
+		delete[] filename;
+		return 0;
+	}
+	
+	const TFTP_PRELOAD_FILE* warm;
+	if(preload){
+		string name = filename + strlen(rootdir);
+		if((warm = preload->find(name.substr(0,name.find('@')).c_str()))){
+			client->read_mem = warm->data ? warm->data : "";
+			client->buffers->preloaded = warm->owner;
+			client->read_len = warm->size;
+			client->read_pos = min((size_t)getFileOffset(filename),warm->size);
+			client->read_base = client->read_pos;
+			if(DEBUG) cout << "TFTP_SERVER::getReadFile() - Serving from memory: " << actual_file << endl;
+			delete[] filename;
+			return 0;
+		}
+	}
+	string path(filename,strcspn(filename,"@"));
+	if(upstream.enabled()){
+		int edge = edgeOpen(client,path,getFileOffset(filename));
+		if(edge != 0){
+			delete[] filename;
+			return edge < 0 ? -1 : 0;
+		}
+	}
+	TFTP_STAT st;
+	if((client->read_handle = storage->openRead(path.c_str(),&st)) < 0){
 		if(DEBUG){
 			cout << "TFTP_SERVER::getReadFile() - Could not open file: "
-					<< actual_file << endl;
+					<< path << endl;
 			cout << "TFPT_SERVER::getReadFile() - Sending Error Packet\n";
 		}
+		/* Only a name that is really not there; EMFILE and the like pass */
+		if(negatives && !upstream.enabled() && (errno == ENOENT || errno == ENOTDIR))
+			negatives->insert(filename + strlen(rootdir));
+		delete[] filename;
 		sendError(client,ERROR_FILE_NOT_FOUND,(char*)"File Not Found");
-		disconnect(client);
 		return -1;
 	}
-	client->read_file->seekg(getFileOffset(filename),ios::beg);
+	client->read_base = getFileOffset(filename);
+	client->read_pos = client->read_base;
+	client->buffers->size = max((int64_t)0,st.size - client->read_base);
+	++open_files;
 	
 	if(DEBUG) cout << "TFTP_SERVER::getReadFile() - File Openned: " << actual_file << endl;
 	
@@ -287,6 +1166,7 @@ int TFTP_SERVER::getReadFile(Client* client){
  *
  */
 int TFTP_SERVER::createWriteFile(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_OPEN,client->span);
 	if(DEBUG) cout << "TFTP_SERVER::createWriteFile() - " << client->ip
 					<< " - Creating Write File...\n";
 	char* filename = new char[TFTP_PACKET_MAX_SIZE];
@@ -294,16 +1174,168 @@ int TFTP_SERVER::createWriteFile(Client* client){
 	
 	strcpy(filename,rootdir);
 	
-	client->receive_packet.getString(2,(filename + strlen(filename)),
-									 client->receive_packet.getSize());
+	receive_packet.getString(2,(filename + strlen(filename)),
+									 receive_packet.getSize());
 	char at[] = "@";
-	strncpy(actual_file,filename,strcspn(filename,at));
+	size_t name_len = strcspn(filename,at);
+	
+	/* "name#xxxxxxxx": the upload must have this CRC32C (8 hex digits) */
+	TFTP_SESSION_BUFFERS* b = client->buffers;
+	b->crc = 0;
+	b->expected_crc = -1;
+	char* hash = strrchr(filename + strlen(rootdir),'#');
+	char* end = NULL;
+	unsigned long expected = hash ? strtoul(hash + 1,&end,16) : 0;
+	if(hash && end == hash + 9 && (*end == 0 || *end == '@')){
+		b->expected_crc = expected;
+		name_len = min(name_len,(size_t)(hash - filename));
+	}
+	strncpy(actual_file,filename,name_len);
+	actual_file[name_len] = 0;
+	
+	/* Staged by the storage and published once complete (finishUpload()) */
+	b->upload = actual_file;
+	client->read_base = getFileOffset(filename);
+	if(client->read_base > 0){
+		delete[] filename;
+		return resumeUpload(client,client->read_base);
+	}
+	if((client->write_handle = storage->openWrite(actual_file)) < 0){
+		if(DEBUG) cout << "TFTP_SERVER::createWriteFile() - Could not create " << actual_file << endl;
+		b->upload.clear();
+		delete[] filename;
+		sendError(client,ERROR_ACCESS_VIOLATION,(char*)"Cannot create file");
+		return -1;
+	}
+	++open_files;
 	
 	if(DEBUG) cout << "TFTP_SERVER::createWriteFile() - File (" << actual_file << ") created...\n";
 	
-	client->write_file = new ofstream(actual_file, ios::binary);
+	delete[] filename;
+	return 0;
+}
+
+/*
+ *	"name@offset" WRQ: continue the upload of name suspended when it was
+ *	cut short (see disconnect()), from offset.  What was kept must reach
+ *	offset (beyond it is cut off); the CRC32C of those bytes comes from
+ *	the note saved with them, or is recomputed by reading them, and must
+ *	match a "crc32c-prefix" option if the client sent one.
+ *
+ *	@param	client		Current Client (buffers->upload set)
+ *	@param	offset		Bytes the client already sent
+ *	@return				0 | -1 (error sent)
+ */
+int TFTP_SERVER::resumeUpload(Client* client, int64_t offset){
+	TFTP_SESSION_BUFFERS* b = client->buffers;
+	int64_t kept = 0;
+	string note;
+	int handle = storage->openResume(b->upload.c_str(),offset,&kept,&note);
+	if(handle < 0){
+		char msg[64];
+		int error = ERROR_FILE_NOT_FOUND;
+		if(errno == ERANGE){
+			snprintf(msg,sizeof(msg),"Only %lld bytes to resume from",(long long)kept);
+			error = ERROR_NOT_DEFINED;
+		}
+		else snprintf(msg,sizeof(msg),"No upload to resume");
+		if(DEBUG) cout << "TFTP_SERVER::resumeUpload() - " << b->upload << ": " << msg << endl;
+		b->upload.clear();
+		sendError(client,error,msg);
+		return -1;
+	}
+	
+	long long len = -1;
+	unsigned int crc = 0;
+	if(sscanf(note.c_str(),"%lld %x",&len,&crc) == 2 && len == offset) b->crc = crc;
+	else{
+		/* Cut further back, or the server stopped without saving a note */
+		if(DEBUG) cout << "TFTP_SERVER::resumeUpload() - Reading " << offset << " bytes for their crc32c\n";
+		vector<char> chunk(1 << 16);
+		for(int64_t pos = 0; pos < offset;){
+			int n = storage->pread(handle,&chunk[0],(int)min((int64_t)chunk.size(),offset - pos),pos);
+			if(n <= 0){
+				storage->suspend(handle,"");
+				b->upload.clear();
+				sendError(client,ERROR_ACCESS_VIOLATION,(char*)"Cannot read upload");
+				return -1;
+			}
+			b->crc = tftp_crc32c(b->crc,&chunk[0],n);
+			pos += n;
+		}
+	}
+	
+	char prefix[16];
+	uint32_t expected;
+	if(receive_packet.getOption("crc32c-prefix",prefix,sizeof(prefix)) > 0 &&
+	   tftp_crc32c_parse(prefix,&expected) == 0 && expected != b->crc){
+		/* Not the client's bytes: it has to start over */
+		if(DEBUG) cout << "TFTP_SERVER::resumeUpload() - " << b->upload << ": prefix crc32c is "
+						<< hex << b->crc << dec << ", not " << prefix << endl;
+		storage->abort(handle);
+		b->upload.clear();
+		sendError(client,ERROR_NOT_DEFINED,(char*)"Prefix mismatch");
+		return -1;
+	}
+	client->write_handle = handle;
+	++open_files;
+	if(DEBUG) cout << "TFTP_SERVER::resumeUpload() - " << b->upload << " resumed at " << offset << endl;
+	return 0;
+}
+
+/*
+ *	Last DATA of a WRQ written: check the upload against its expected
+ *	checksum, move it into place and write its sidecar
+ *
+ *	@param	client		Current Client
+ *	@return				0 | -1 -> Rejected (error sent, nothing stored)
+ */
+int TFTP_SERVER::finishUpload(Client* client){
+	TFTP_SESSION_BUFFERS* b = client->buffers;
+	int error = -1;
+	const char* msg = NULL;
+	int handle = client->write_handle;
+	client->write_handle = -1;
+	--open_files;
+	if(b->expected_crc >= 0 && (uint32_t)b->expected_crc != b->crc){
+		storage->abort(handle);
+		error = ERROR_NOT_DEFINED;
+		msg = "Checksum mismatch";
+	}
+	else if(storage->commit(handle) < 0){
+		int full = errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+		error = full ? ERROR_DISK_FULL : ERROR_ACCESS_VIOLATION;
+		msg = full ? "Disk full" : "Cannot store file";
+	}
+	if(msg){
+		if(DEBUG) cout << "TFTP_SERVER::finishUpload() - " << b->upload << ": " << msg << endl;
+		b->upload.clear();
+		sendError(client,error,(char*)msg);
+		return -1;
+	}
 	
-	client->write_file->seekp(getFileOffset(filename),ios::beg);
+	/* Sidecar "crc  name" (as cksum tools write it), appears once the file is in place */
+	string sidecar = b->upload + TFTP_CHECKSUM_SUFFIX;
+	size_t slash = b->upload.rfind('/');
+	char line[MAX_PATH_LENGTH + 16];
+	int n = snprintf(line,sizeof(line),"%08x  %s\n",b->crc,
+					 b->upload.c_str() + (slash == string::npos ? 0 : slash + 1));
+	int h = storage->openWrite(sidecar.c_str());
+	if(h >= 0){
+		if(storage->pwrite(h,line,min(n,(int)sizeof(line) - 1),0) < 0) storage->abort(h);
+		else storage->commit(h);
+	}
+	if(DEBUG) cout << "TFTP_SERVER::finishUpload() - " << b->upload << " stored, crc32c "
+					<< hex << b->crc << dec << endl;
+	if(negatives){
+		negatives->erase(b->upload.c_str() + strlen(rootdir));
+		negatives->erase(sidecar.c_str() + strlen(rootdir));
+	}
+	if(preload){
+		preload->drop(b->upload.c_str() + strlen(rootdir));
+		preload->drop(sidecar.c_str() + strlen(rootdir));
+	}
+	b->upload.clear();
 	return 0;
 }
 
@@ -312,21 +1344,33 @@ int TFTP_SERVER::createWriteFile(Client* client){
  *
  */
 int TFTP_SERVER::createReadPacket(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_READ,client->span,client->block + 1);
 	if(DEBUG) cout << "TFTP_SERVER::createReadPacket() - " << client->ip
 					<< " - Creating Read Packet...\n";
+	if(client->read_mem){
+		int n = min((size_t)TFTP_PACKET_DATA_SIZE,client->read_len - client->read_pos);
+		if(n < TFTP_PACKET_DATA_SIZE) client->disconnect_after_send = true;
+		client->buffers->send_packet.createData(++client->block,(char*)client->read_mem + client->read_pos,n);
+		client->read_pos += n;
+		return 0;
+	}
 	char _data[TFTP_PACKET_DATA_SIZE];
-	client->read_file->read(_data,TFTP_PACKET_DATA_SIZE);
-	
-	if(client->read_file->eof()){
+	int handle = client->fetch ? client->fetch->handle : client->read_handle;
+	int n = storage->pread(handle,_data,TFTP_PACKET_DATA_SIZE,client->read_pos);
+	if(n < 0){
+		if(DEBUG) cout << "TFTP_SERVER::createReadPacket() - Read error (" << errno << "), ending the file here\n";
+		n = 0;
+	}
+	client->read_pos += n;
+	if(n < TFTP_PACKET_DATA_SIZE){
 		if(DEBUG) cout << "TFTP_SERVER::creatReadPacket() - End of File Reached\n" << endl;
 		client->disconnect_after_send = true;
 	}
-	client->send_packet.createData(++client->block,(char*)_data,
-								   client->read_file->gcount());
+	client->buffers->send_packet.createData(++client->block,(char*)_data,n);
 	if(DEBUG){
 		cout << "TFTP_SERVER::createReadPacket() - " << client->ip
 			<< ": Packet (" << client->block - 1 << ") sent...\n";
-		client->send_packet.printData();
+		client->buffers->send_packet.printData();
 	}
 	return 0;
 }
@@ -335,26 +1379,39 @@ int TFTP_SERVER::createReadPacket(Client* client){
  *	Write the data of the packet to the file
  *
  *	@param	client		Current Client
- *	@return				1 = Last Packet | 0 = Middle Packet | -1 = Out of Order Packet
+ *	@return				Bytes written | -1 = Out of Order Packet | -2 = Write failed
+ *						(upload dropped, error sent)
  */
 int TFTP_SERVER::writeData(Client* client){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_WRITE,client->span,client->block + 1);
 	if(DEBUG) cout << "TFTP_SERVER::writeData() - " << client->ip
 					<< " - Writing Data...\n";
-	if(++client->block == client->receive_packet.getBlockNumber()){
+	if(((client->block + 1) & 0xffff) == receive_packet.getBlockNumber()){
+		++client->block;
 		if(DEBUG) cout << "TFTP_SERVER::writeData() - Block (" << client->block << ") Received...\n";
 		
-		char _data[TFTP_PACKET_DATA_SIZE];
-
-		int bytes_written = (client->receive_packet.getSize() - 4);
-
-		client->receive_packet.copyData(4,_data,bytes_written);
+		int bytes_written = (receive_packet.getSize() - 4);
+		const char* _data = (const char*)receive_packet.getData(4);
 		
-		client->write_file->write(_data,bytes_written);
+		if(storage->pwrite(client->write_handle,_data,bytes_written,
+						   client->read_base + (int64_t)(client->block - 1) * TFTP_PACKET_DATA_SIZE) < 0){
+			/* Stop the client now rather than let it send the rest for nothing */
+			int full = errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+			if(DEBUG) cout << "TFTP_SERVER::writeData() - " << client->buffers->upload
+							<< ": write failed (" << errno << ")\n";
+			storage->abort(client->write_handle);
+			client->write_handle = -1;
+			--open_files;
+			client->buffers->upload.clear();
+			sendError(client,full ? ERROR_DISK_FULL : ERROR_ACCESS_VIOLATION,
+					  (char*)(full ? "Disk full" : "Cannot store file"));
+			return -2;
+		}
+		client->buffers->crc = tftp_crc32c(client->buffers->crc,_data,bytes_written);
 		
 		if(DEBUG) cout << "TFTP_SERVER::writeData() - " << bytes_written << " Bytes written\n";
 		
-		if(client->receive_packet.getSize() < TFTP_PACKET_DATA_SIZE + 4){
-			client->write_file->close();
+		if(receive_packet.getSize() < TFTP_PACKET_DATA_SIZE + 4){
 			client->disconnect_after_send = true;
 			//disconnect(client);
 			return bytes_written;
@@ -364,6 +1421,33 @@ int TFTP_SERVER::writeData(Client* client){
 	return -1;
 }
 
+/*
+ *	List the requested Directory into the session's buffers; the listing is then read
+ *	like a file from memory
+ *
+ *	@param	dir			As requested, relative to rootdir ("." for rootdir itself)
+ *	@return				0 | -1 (error sent)
+ */
+int TFTP_SERVER::openListing(Client* client, char* dir){
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_OPEN,client->span);
+	string path = rootdir;	// Storage paths are the server's, as for openRead()
+	if(strcmp(dir,".")) path += dir;
+	if((pack ? listPack(dir,list_buf) : ls((char*)path.c_str(),list_buf)) < 0){
+		if(DEBUG){
+			cout << "TFTP_SERVER::openListing() - Could not open Directory: "
+			<< dir << endl;
+			cout << "TFPT_SERVER::openListing() - Sending Error Packet\n";
+		}
+		sendError(client,ERROR_FILE_NOT_FOUND,(char*)"Directory Not Found");
+		return -1;
+	}
+	client->buffers->rendered = list_buf;
+	client->read_mem = client->buffers->rendered.data();
+	client->read_len = client->buffers->rendered.size();
+	client->read_pos = client->read_base = 0;
+	return 0;
+}
+
 /*
  *	Create a Read like Packet with the contents of the requested Directory
  *
@@ -375,35 +1459,127 @@ int TFTP_SERVER::createDirPacket(Client* client, char* dir){
 					<< " for " << client->ip << " for Directory "
 					<< dir << endl;
 	}
-	int _data_size = 0;
-	if(client->dirPost == 0){
-		if(ls(dir,client->dirBuf) < 0){
-			if(DEBUG){
-				cout << "TFTP_SERVER::createDirPacket() - Could not open Directory: "
-				<< dir << endl;
-				cout << "TFPT_SERVER::createDirPacket() - Sending Error Packet\n";
-			}
-			sendError(client,ERROR_FILE_NOT_FOUND,(char*)"Directory Not Found");
-			disconnect(client);
-			return -1;
+	if(!client->read_mem && openListing(client,dir) < 0) return -1;
+	return createReadPacket(client);
+}
+
+/*
+ *	Hand the client's DATA packet (send_packet) to the egress scheduler
+ *
+ *	@param	client		Current Client
+ *	@return				Bytes queued | -1 on error
+ */
+int TFTP_SERVER::sendData(Client* client){
+	if(DEBUG) cout << "TFTP_SERVER::sendData() - Queueing DATA (block "
+					<< client->buffers->send_packet.getBlockNumber() << ") for " << client->ip << "...\n";
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_SEND,client->span,client->block);
+	return scheduler->send(client, client->client_socket, client->buffers->send_packet.getData(0),
+						   client->buffers->send_packet.getSize(), &(client->address));
+}
+
+/*
+ *	Lock-step RRQ: read the next block into send_packet and queue it
+ *
+ *	@param	client		Current Client
+ *	@return				Bytes queued | -1 on error
+ */
+int TFTP_SERVER::sendBlock(Client* client){
+	if(!blockReady(client)){
+		client->state = SESSION_FETCH_WAIT;		// sendFetched() sends it
+		return 0;
+	}
+	createReadPacket(client);
+	client->state = client->disconnect_after_send ? SESSION_FINAL_ACK : SESSION_SENDING;
+	client->last_send = tftp_now_ms();
+	return sendData(client);
+}
+
+/*
+ *	Windowed RRQ: send blocks until the congestion window is full (one
+ *	window per ACK with the fixed controller), as GSO super-buffers of at
+ *	most TFTP_GSO_MAX_SEGMENTS blocks.  In edge mode it also stops at the
+ *	end of what has been fetched.
+ *
+ *	@param	client		Current Client
+ *	@return				Bytes queued | -1 on error
+ */
+int TFTP_SERVER::sendWindow(Client* client){
+	const int packet = TFTP_PACKET_DATA_SIZE + TFTP_DATA_PKT_DATA_OFFSET;
+	TFTP_CONGESTION* cc = client->buffers->congestion;
+	int limit = cc ? cc->window() : client->window;
+	window_buf.resize(TFTP_GSO_MAX_SEGMENTS * packet);
+	int queued = 0;
+	client->last_send = tftp_now_ms();
+	while(client->block - client->acked_block < limit &&
+		  !(client->last_block && client->block == client->last_block) && blockReady(client)){
+		int first = client->block + 1;
+		int count = 0, size = 0;
+		while(count < TFTP_GSO_MAX_SEGMENTS && client->block - client->acked_block < limit &&
+			  !(client->last_block && client->block == client->last_block) && blockReady(client)){
+			createReadPacket(client);
+			memcpy(&window_buf[size],client->buffers->send_packet.getData(0),client->buffers->send_packet.getSize());
+			size += client->buffers->send_packet.getSize();
+			++count;
+			if(client->buffers->send_packet.getSize() < packet)
+				client->last_block = client->block;
 		}
+		if(DEBUG) cout << "TFTP_SERVER::sendWindow() - Queueing " << count << " DATA (blocks "
+						<< first << "-" << client->block << ") for " << client->ip << "...\n";
+		if(cc) cc->sent(first,client->block,tftp_now_us());
+		TFTP_SPAN_SCOPE span(TFTP_SPAN_SEND,client->span,client->block);
+		int n = scheduler->send(client,client->client_socket,&window_buf[0],size,&(client->address),
+								count > 1 ? packet : 0);
+		if(n < 0) return -1;
+		queued += n;
 	}
-	(strlen(&(client->dirBuf[client->dirPost])) > 512) ?
-		_data_size = 512 :
-		_data_size = strlen(&(client->dirBuf[client->dirPost]));
-	client->send_packet.createData(++client->block,&(client->dirBuf[client->dirPost])
-									,_data_size);
-	client->dirPost += _data_size;
-	if(strlen(&(client->dirBuf[client->dirPost])) <= 512)
-		client->disconnect_after_send = 1;
-	
-	if(DEBUG){
-		cout << "TFTP_SERVER::createDirPacket() - " << client->ip
-		<< ": Packet (" << client->block - 1 << ") sent...\n";
-		client->send_packet.printData();
+	if(client->last_block && client->block == client->last_block) client->state = SESSION_FINAL_ACK;
+	else if(client->block == client->acked_block) client->state = SESSION_FETCH_WAIT;	// Nothing fetched to send
+	else client->state = SESSION_SENDING;
+	return queued;
+}
+
+/*
+ *	Resend what the session is waiting on an answer for: the OACK, the
+ *	last ACK (WRQ), the last DATA or the unacknowledged part of the window
+ */
+void TFTP_SERVER::retransmit(Client* client){
+	if(DEBUG) cout << "TFTP_SERVER::retransmit() - " << client->ip << " (try "
+					<< client->retries << ")\n";
+	++retransmits;
+	client->last_send = tftp_now_ms();
+	switch(client->state){
+		case SESSION_OACK_WAIT:
+		case SESSION_RECEIVING:
+			sendPacket(&(client->buffers->send_packet),client);
+			break;
+		case SESSION_SENDING:
+		case SESSION_FINAL_ACK:
+			if(client->window){
+				if(client->buffers->congestion) client->buffers->congestion->timedOut();
+				seekBlock(client,client->acked_block);
+				sendWindow(client);
+			}
+			else sendData(client);
+			break;
 	}
-	return 0;
-	
+}
+
+/*
+ *	ms without an answer before the last packet or window is resent
+ */
+int TFTP_SERVER::retransmitTimeout(Client* client){
+	if(client->buffers && client->buffers->congestion) return client->buffers->congestion->rto();
+	return TFTP_RETRANSMIT_TIMEOUT;
+}
+
+/*
+ *	Go back to just after block (its ACK said the rest was lost)
+ */
+void TFTP_SERVER::seekBlock(Client* client, int block){
+	long pos = client->read_base + (long)block * TFTP_PACKET_DATA_SIZE;
+	client->read_pos = client->read_mem ? min((size_t)pos,client->read_len) : pos;
+	client->block = block;
+	client->disconnect_after_send = false;
 }
 
 /*
@@ -418,10 +1594,9 @@ int TFTP_SERVER::sendPacket(TFTP_PACKET* _packet, Client* client){
 	}*/
 	if(DEBUG) cout << "TFTP_SERVER::sendPacket() - Sending Packet (" << "\""
 					<< *_packet << "\") to " << client->ip << "...\n";
-	socklen_t len = sizeof(client->address);
-	int n = sendto(client->client_socket, _packet->getData(0),
-				   _packet->getSize(), 0,
-				   (struct sockaddr*)&(client->address), len);
+	TFTP_SPAN_SCOPE span(TFTP_SPAN_SEND,client->span,client->block);
+	int n = transport->sendTo(client->client_socket, _packet->getData(0),
+							  _packet->getSize(), &(client->address));
 	if(DEBUG) cout << "TFTP_SERVER::sendPacket() - Packet Sent ("
 					<< _packet->getSize() << " Bytes)...\n";
 	return n;
@@ -441,75 +1616,412 @@ int TFTP_SERVER::sendError(Client* client, int error_code, char* msg){
 int TFTP_SERVER::disconnect(Client* client){
 	//if(DEBUG) cout << "TFTP_SERVER::disconnect() - Disconnecting Client (" << client->ip << ")...\n";
 	if(!client) return 0;
-	client->receive_packet.clearPacket();
-	client->send_packet.clearPacket();
+	if(client->session){
+		client->session.destroy();	// Suspended (never running when we get here)
+		client->session = nullptr;
+	}
+	scheduler->remove(client);
+	if(client->fetch){
+		if(client->request_type == REQUEST_FETCH)
+			endFetch(client->fetch,FETCH_FAILED,ERROR_NOT_DEFINED,"Upstream timed out");
+		else{
+			vector<Client*>& followers = client->fetch->followers;
+			vector<Client*>::iterator f = find(followers.begin(),followers.end(),client);
+			if(f != followers.end()){
+				*f = followers.back();
+				followers.pop_back();
+			}
+		}
+		client->fetch = NULL;
+	}
+	if(handler && client->buffers && (client->request_type == REQUEST_READ || client->request_type == REQUEST_WRITE)){
+		TFTP_REQUEST request;
+		request.type = client->request_type;
+		request.filename = client->buffers->name.c_str();
+		request.peer = &(client->address);
+		request.bytes = client->buffers->transferred;
+		handler->complete(request,request.bytes < 0 ? -1 : 0);
+	}
+	/*
+	 *	Upload cut short: keep what arrived (all of it full blocks) for a
+	 *	"name@offset" WRQ to continue, with its length and crc32c
+	 */
+	if(client->write_handle >= 0){
+		int64_t kept = client->read_base + (int64_t)client->block * TFTP_PACKET_DATA_SIZE;
+		if(kept > 0 && !client->disconnect_after_send){
+			char note[64];
+			snprintf(note,sizeof(note),"%lld %08x",(long long)kept,client->buffers->crc);
+			storage->suspend(client->write_handle,note);
+			if(DEBUG) cout << "TFTP_SERVER::disconnect() - Kept " << kept << " bytes of " << client->buffers->upload << endl;
+		}
+		else storage->abort(client->write_handle);
+		client->write_handle = -1;
+		--open_files;
+	}
 	//strcpy(client->ip,(char*)"");
 	client->ip = (char*)"";
-	memset(client->dirBuf,0,DIRECTORY_LIST_SIZE);
+	if(client->connection != NOT_CONNECTED) --active_sessions;
 	client->connection = NOT_CONNECTED;
-	client->dirPost = 0;
+	client->state = SESSION_IDLE;
+	client->acked_block = 0;
+	client->retries = 0;
 	client->block = 0;
 	client->request_type = REQUEST_UNDEFINED;
-	client->temp = 0;
 	client->disconnect_after_send = false;
-	if(client->client_socket > 0) close(client->client_socket);
-	//if(client->read_file) delete client->read_file;
-	//if(client->write_file) delete client->write_file;
-	//delete ifstream
-	//delete ofstream
+	client->window = 0;
+	client->last_block = 0;
+	client->read_base = 0;
+	client->span = 0;
+	if(client->buffers) client->buffers->upload.clear();
+	if(client->client_socket > 0){
+		transport->unwatch(client->client_socket);
+		sockets->release(client->client_socket);
+	}
+	client->client_socket = -1;
+	if(client->read_handle >= 0){ storage->close(client->read_handle); client->read_handle = -1; --open_files; }
+	client->read_mem = NULL;
+	client->read_len = client->read_pos = 0;
+	releaseClient(client);
 	return 0;
 }
 
+/*
+ *	Edge mode: serve an RRQ from the cache, or from a fetch of the file
+ *	(a new one, or one already under way for another client)
+ *
+ *	@param	client		The Client
+ *	@param	path		rootdir + name
+ *	@param	offset		"@offset" of the request
+ *	@return				0 -> Serve the cached copy | 1 -> Served from a fetch
+ *						-1 -> Failed (error sent)
+ */
+int TFTP_SERVER::edgeOpen(Client* client, const string& path, int64_t offset){
+	TFTP_FETCH* fetch;
+	unordered_map<string, TFTP_FETCH*>::iterator f = fetches.find(path);
+	if(f != fetches.end()){
+		fetch = f->second;
+		++edge_coalesced;
+	}
+	else{
+		TFTP_STAT st;
+		int64_t cached = (storage->stat(path.c_str(),&st) == 0 && !st.dir) ? st.size : -1;
+		unordered_map<string, long>::iterator v = validated.find(path);
+		if(cached >= 0 && v != validated.end() && tftp_now_ms() - v->second < upstream.revalidate_ms){
+			++edge_hits;
+			return 0;
+		}
+		if(!(fetch = startFetch(path,cached))){
+			if(cached >= 0) return 0;	// Nothing to ask the upstream with: what we have will do
+			sendError(client,ERROR_NOT_DEFINED,(char*)"Server busy");
+			return -1;
+		}
+	}
+	if(DEBUG) cout << "TFTP_SERVER::edgeOpen() - " << client->ip << " served from the fetch of "
+					<< fetch->name << endl;
+	client->fetch = fetch;
+	fetch->followers.push_back(client);
+	client->read_base = offset;
+	client->read_pos = offset;
+	if(fetch->total >= 0) client->buffers->size = max((int64_t)0,fetch->total - offset);
+	return 1;
+}
+
+/*
+ *	Start fetching a file from the upstream, in a session slot of its own
+ *
+ *	@param	path		rootdir + name
+ *	@param	cached		Size of the cached copy to revalidate, -1 = none
+ *	@return				The fetch | NULL if no slot or socket is free
+ */
+TFTP_FETCH* TFTP_SERVER::startFetch(const string& path, int64_t cached){
+	Client* session = acquireClient(&(upstream.address));
+	if(!session) return NULL;
+	/* Not a peer: nothing for it arrives on the listener */
+	unordered_map<uint64_t, Client*>::iterator p = peers.find(peerKey(&(upstream.address)));
+	if(p != peers.end() && p->second == session) peers.erase(p);
+	if((session->client_socket = sockets->acquire(NULL)) < 0){
+		releaseClient(session);
+		return NULL;
+	}
+	TFTP_FETCH* fetch = new TFTP_FETCH();
+	fetch->path = path;
+	fetch->name = path.substr(strlen(rootdir));
+	fetch->cached = cached;
+	fetch->session = session;
+	fetches[path] = fetch;
+	session->fetch = fetch;
+	session->request_type = REQUEST_FETCH;
+	session->request_hash = 0;
+	session->span = 0;
+	session->ip = (char*)"upstream";
+	session->connection = CONNECTED;
+	session->last_active = tftp_now_ms();
+	++active_sessions;
+	++edge_fetches;
+	transport->watch(session->client_socket,session);
+	TFTP_TASK task = fetchSession(session);
+	session->session = task.handle;
+	return fetch;
+}
+
+/*
+ *	Edge mode: RRQ the file of client->fetch from the upstream (asking for
+ *	tsize and windowsize) and write it to the storage, waking the
+ *	sessions served from it as blocks arrive.  Blocks are ACKed one by
+ *	one, or a window at a time (and at the last block in order on a gap,
+ *	RFC 7440).  A revalidation is called off once the OACK shows the
+ *	cached size.
+ */
+TFTP_TASK TFTP_SERVER::fetchSession(Client* client){
+	TFTP_FETCH* fetch = client->fetch;
+	TFTP_PACKET& request = client->buffers->send_packet;
+	char value[24];
+	request.createRRQ((char*)fetch->name.c_str());
+	request.addOption("tsize","0");
+	if(upstream.window > 1){
+		snprintf(value,sizeof(value),"%d",upstream.window);
+		request.addOption("windowsize",value);
+	}
+	if(DEBUG) cout << "TFTP_SERVER::fetchSession() - Fetching " << fetch->name
+					<< (fetch->cached >= 0 ? " (revalidating)" : "") << endl;
+	client->state = SESSION_RECEIVING;
+	client->last_send = tftp_now_ms();
+	sendPacket(&request,client);
+	TFTP_WAIT wait(&(client->wake),client->span);
+	int window = 1;
+	int gap_acked = -1;		// Block ACKed for the last gap
+	for(;;){
+		if(co_await wait == TFTP_WAKE_TIMEOUT){
+			if(timedOut(client) < 0){
+				endFetch(fetch,FETCH_FAILED,ERROR_NOT_DEFINED,"Upstream timed out");
+				co_return;
+			}
+			continue;
+		}
+		if(receive_packet.isError()){
+			char msg[TFTP_PACKET_MAX_SIZE];
+			if(receive_packet.getString(4,msg,sizeof(msg)) == 0) strcpy(msg,"Upstream error");
+			if(DEBUG) cout << "TFTP_SERVER::fetchSession() - " << fetch->name << ": " << msg << endl;
+			endFetch(fetch,FETCH_FAILED,receive_packet.getWord(2),msg);
+			co_return;
+		}
+		if(receive_packet.isOACK() && client->block == 0 && fetch->handle < 0){
+			if(receive_packet.getOption("tsize",value,sizeof(value)) > 0) fetch->total = strtoll(value,NULL,10);
+			if(receive_packet.getOption("windowsize",value,sizeof(value)) > 0) window = max(1,atoi(value));
+			if(fetch->cached >= 0 && fetch->total == fetch->cached){
+				/* Unchanged, as far as the size tells: call the transfer off */
+				TFTP_PACKET error_packet;
+				error_packet.createError(ERROR_NOT_DEFINED,(char*)"Cached copy is current");
+				sendPacket(&error_packet,client);
+				endFetch(fetch,FETCH_CURRENT,0,NULL);
+				co_return;
+			}
+			if(openFetch(client) < 0) co_return;
+			request.createACK(0);
+			client->last_send = tftp_now_ms();
+			sendPacket(&request,client);
+			continue;
+		}
+		if(!receive_packet.isData()) continue;
+		if(fetch->handle < 0 && openFetch(client) < 0) co_return;	// No OACK: the upstream ignored the options
+		int block = receive_packet.getBlockNumber();
+		if(block != ((client->block + 1) & 0xffff)){
+			/* Repeated (our ACK was lost) or past a gap: ACK what we have, once per gap */
+			++duplicates;
+			if(block == (client->block & 0xffff) || gap_acked != client->block){
+				gap_acked = client->block;
+				request.createACK(client->block);
+				client->last_send = tftp_now_ms();
+				sendPacket(&request,client);
+			}
+			continue;
+		}
+		int n = receive_packet.getSize() - TFTP_DATA_PKT_DATA_OFFSET;
+		if(storage->pwrite(fetch->handle,receive_packet.getData(TFTP_DATA_PKT_DATA_OFFSET),n,fetch->size) < 0){
+			int full = errno == ENOSPC || errno == EDQUOT || errno == EFBIG;
+			TFTP_PACKET error_packet;
+			error_packet.createError(ERROR_NOT_DEFINED,(char*)"Transfer cancelled");
+			sendPacket(&error_packet,client);
+			endFetch(fetch,FETCH_FAILED,full ? ERROR_DISK_FULL : ERROR_ACCESS_VIOLATION,
+					 full ? "Disk full" : "Cannot store file");
+			co_return;
+		}
+		++client->block;
+		fetch->size += n;
+		client->retries = 0;
+		client->last_send = tftp_now_ms();	// The upstream is sending: no need to prod it
+		int last = n < TFTP_PACKET_DATA_SIZE;
+		if(last || client->block % window == 0){
+			request.createACK(client->block);
+			sendPacket(&request,client);
+		}
+		if(last){
+			if(DEBUG) cout << "TFTP_SERVER::fetchSession() - " << fetch->name << ": "
+							<< fetch->size << " Bytes fetched\n";
+			endFetch(fetch,FETCH_STORED,0,NULL);
+			co_return;
+		}
+		wakeFollowers(fetch);
+	}
+}
+
+/*
+ *	The upstream is sending the file: stage it in the storage
+ *
+ *	@return				0 | -1 (fetch ended)
+ */
+int TFTP_SERVER::openFetch(Client* client){
+	TFTP_FETCH* fetch = client->fetch;
+	fetch->handle = storage->openWrite(fetch->path.c_str());
+	if(fetch->handle < 0 && errno == ENOENT && storage->makeParents(fetch->path.c_str()) == 0)
+		fetch->handle = storage->openWrite(fetch->path.c_str());
+	if(fetch->handle >= 0){
+		++open_files;
+		return 0;
+	}
+	TFTP_PACKET error_packet;
+	error_packet.createError(ERROR_NOT_DEFINED,(char*)"Transfer cancelled");
+	sendPacket(&error_packet,client);
+	endFetch(fetch,FETCH_FAILED,ERROR_ACCESS_VIOLATION,"Cannot store file");
+	return -1;
+}
+
+/*
+ *	A fetch is over: publish or drop what it staged and move the sessions
+ *	served from it to the cached file, or end them with an error.  When
+ *	the upstream fails before sending any data, a cached copy is served
+ *	as it is.
+ *
+ *	@param	fetch		The fetch (deleted)
+ *	@param	result		FETCH_*
+ *	@param	error		FETCH_FAILED: TFTP error for the sessions
+ *	@param	msg			Its message
+ */
+void TFTP_SERVER::endFetch(TFTP_FETCH* fetch, int result, int error, const char* msg){
+	fetches.erase(fetch->path);
+	fetch->session->fetch = NULL;
+	if(fetch->handle >= 0){
+		--open_files;
+		if(result != FETCH_STORED) storage->abort(fetch->handle);
+		else if(storage->commit(fetch->handle) < 0){
+			result = FETCH_FAILED;
+			error = ERROR_ACCESS_VIOLATION;
+			msg = "Cannot store file";
+		}
+	}
+	int cached = result != FETCH_FAILED || (fetch->cached >= 0 && fetch->size == 0);
+	if(result != FETCH_FAILED) validated[fetch->path] = tftp_now_ms();
+	if(result == FETCH_CURRENT) ++edge_current;
+	if(result == FETCH_FAILED && cached) ++edge_stale;
+	if(negatives){
+		if(result == FETCH_STORED) negatives->erase(fetch->name.c_str());
+		else if(!cached && error == ERROR_FILE_NOT_FOUND) negatives->insert(fetch->name.c_str());
+	}
+	if(preload && result == FETCH_STORED) preload->drop(fetch->name.c_str());
+	if(DEBUG) cout << "TFTP_SERVER::endFetch() - " << fetch->name << ": "
+					<< (result == FETCH_STORED ? "stored" : result == FETCH_CURRENT ? "cached copy current" :
+						cached ? "failed, serving the cached copy" : "failed")
+					<< ", " << fetch->followers.size() << " sessions\n";
+	vector<Client*> followers;
+	followers.swap(fetch->followers);
+	for(size_t i = 0; i < followers.size(); ++i){
+		Client* client = followers[i];
+		client->fetch = NULL;
+		if(cached && (client->read_handle = storage->openRead(fetch->path.c_str(),NULL)) >= 0){
+			++open_files;
+			if(waitsForFetch(client) && !resumeSession(client,TFTP_WAKE_FETCH)) finishClient(client);
+			continue;
+		}
+		sendError(client,msg ? error : ERROR_FILE_NOT_FOUND,(char*)(msg ? msg : "File Not Found"));
+		finishClient(client);
+	}
+	delete fetch;
+}
+
+/*
+ *	More of a fetch is in: let the sessions waiting on it send
+ */
+void TFTP_SERVER::wakeFollowers(TFTP_FETCH* fetch){
+	for(size_t i = fetch->followers.size(); i-- > 0;){	// disconnect() moves the last one to i
+		if(i >= fetch->followers.size()) continue;
+		Client* client = fetch->followers[i];
+		if(waitsForFetch(client) && !resumeSession(client,TFTP_WAKE_FETCH)) finishClient(client);
+	}
+}
+
+/*
+ *	@return				1 if the session has room for blocks it is waiting to be fetched
+ */
+int TFTP_SERVER::waitsForFetch(Client* client){
+	if(client->state == SESSION_FETCH_WAIT) return 1;
+	if(!client->window || client->state != SESSION_SENDING) return 0;
+	TFTP_CONGESTION* cc = client->buffers->congestion;
+	return client->block - client->acked_block < (cc ? cc->window() : client->window);
+}
+
+/*
+ *	Send what a session served from a fetch was waiting for (TFTP_WAKE_FETCH)
+ */
+void TFTP_SERVER::sendFetched(Client* client){
+	if(!waitsForFetch(client) || !blockReady(client)) return;
+	if(client->state == SESSION_FETCH_WAIT) client->last_active = tftp_now_ms();	// The wait was ours
+	if(client->window) sendWindow(client);
+	else sendBlock(client);
+}
+
+/*
+ *	@return				1 if the next block can be read: always, unless the
+ *						session is served from a fetch that has not got that far
+ */
+int TFTP_SERVER::blockReady(Client* client){
+	return !client->fetch || client->fetch->size - (int64_t)client->read_pos >= TFTP_PACKET_DATA_SIZE;
+}
+
 int TFTP_SERVER::closeServer(){
 	if(DEBUG) cout << "TFTP_SERVER::closeServer() - Closing TFTP Server\n";
-	if(server_socketfd > 0) close(server_socketfd);
+	if(server_socketfd > 0) transport->closeSocket(server_socketfd);
+	server_socketfd = -1;
 	return 0;
 }
 
 int TFTP_SERVER::ls(char* dirName, char* b){
-	int slash_at_end = 0;
-	if(dirName[strlen(dirName)-1] == '/')
-		slash_at_end = 1;
-	
-	DIR* dirp;
-	if(!(dirp = opendir(dirName)))	//I don't know how important this is, but
-	{ 								// if test is a dir and test3 is another dir in
-		cout << "My_LS::openDir() - Couldn't Open Directory: "
-		<< dirName << endl;
+	vector<TFTP_DIR_ENTRY> entries;
+	if(storage->list(dirName,&entries) < 0){
+		if(DEBUG) cout << "TFTP_SERVER::ls() - Couldn't Open Directory: "
+						<< dirName << endl;
 		return -1;
 	}
-	DIR* file;
-	struct dirent* direntp, *result;
-	struct dirent entry;
-	string dirlist = "";
-	string currentSpot = dirName;		//beginning directory
-	string temp = currentSpot;
-	if(!slash_at_end) temp += "/";	//path to a directory
-	currentSpot = temp;					//
-	char* name;							//
-	struct stat buf;
-	int return_code = 0;
-	for (return_code = readdir_r(dirp, &entry, &result);
-		 result != NULL && return_code == 0;
-		 return_code = readdir_r(dirp, &entry, &result)){
-		if(entry.d_name[0] == '.') continue;
-		temp += entry.d_name;		//adds the name of the dir/file to the path
-		name = strdup(temp.c_str());	//converts temp to char*
-		if(!(file = opendir(name))){		//checking if a dir or file
-			dirlist += entry.d_name;
-			stat(name,&buf);
-			stringstream ss;
-			ss << buf.st_size;
-			dirlist += ("|" + ss.str() + "\n");
-		}
-		else{
-			dirlist += entry.d_name;
-			dirlist += "/\n";
-		}
-		temp = currentSpot;				//reset the path
+	string dirlist;
+	for(size_t i = 0; i < entries.size(); ++i){
+		dirlist += entries[i].name;
+		if(entries[i].st.dir) dirlist += "/\n";
+		else dirlist += "|" + to_string(entries[i].st.size) + "\n";
 	}
-	strcpy(b,dirlist.c_str());
+	strncpy(b,dirlist.c_str(),DIRECTORY_LIST_SIZE - 1);	// Long listings are cut off
+	b[DIRECTORY_LIST_SIZE - 1] = 0;
 	return 0;
 }
 
-TFTP_SERVER::~TFTP_SERVER(){}
+/*
+ *	ls() for a packed root
+ */
+int TFTP_SERVER::listPack(char* dirName, char* b){
+	string dirlist;
+	checkPack();
+	if(pack->list(dirName,&dirlist) < 0) return -1;
+	strncpy(b,dirlist.c_str(),DIRECTORY_LIST_SIZE - 1);
+	b[DIRECTORY_LIST_SIZE - 1] = 0;
+	return 0;
+}
+
+TFTP_SERVER::~TFTP_SERVER(){
+	if(server_socketfd > 0) closeServer();
+	while(!active_clients.empty()) disconnect(active_clients.back());
+	for(size_t i = 0; i < buffer_pool.size(); ++i) delete buffer_pool[i];
+	if(negatives && negatives->fd() >= 0) transport->unwatch(negatives->fd());
+	delete sockets;
+	delete scheduler;
+	delete admission;
+	if(own_storage) delete storage;
+	if(own_transport) delete transport;
+}
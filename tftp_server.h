@@ -1,8 +1,26 @@
 
 #include "tftp_packet.h"
+#include "tftp_transport.h"
+#include "tftp_scheduler.h"
+#include "tftp_admission.h"
+#include "tftp_handoff.h"
+#include "tftp_preload.h"
+#include "tftp_pack.h"
+#include "tftp_virtual.h"
+#include "tftp_session.h"
+#include "tftp_spans.h"
+#include "tftp_checksum.h"
+#include "tftp_negative.h"
+#include "tftp_socket_pool.h"
+#include "tftp_congestion.h"
+#include "tftp_handler.h"
+#include "tftp_storage.h"
+#include "tftp_upstream.h"
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -11,17 +29,44 @@
 #include <string>
 #include <stdlib.h>
 #include <sstream>
+#include <unordered_map>
+#include <algorithm>
 
-#define MAX_CLIENTS 10	// Number of client this server can handle at one time
+#define MAX_CLIENTS 131072	// Number of client this server can handle at one time
 #define TFTP_DEFAULT_PORT 49999
 #define MAX_PATH_LENGTH 256
 
 #define REQUEST_UNDEFINED 0
 #define REQUEST_READ 1
 #define REQUEST_WRITE 2
+#define REQUEST_FETCH 3		// Edge mode: our RRQ to the upstream
 
 #define NOT_CONNECTED 0
 #define CONNECTED 1
+#define CLOSING 2		// Done, waiting for queued DATA to leave
+
+#define RUN_STOPPED 0		// run(): stop() was called or the listener failed
+#define RUN_HANDED_OFF 1	// run(): listener handed to a new process, sessions drained
+#define RUN_CONTINUE 2		// pollOnce(): still serving, call again
+
+#define TFTP_POLL_INTERVAL 1000		// ms between housekeeping passes when idle
+#define TFTP_SESSION_TIMEOUT 10000	// ms without a packet before a session is dropped
+#define TFTP_LISTEN_BUFFER (8 << 20)	// Listener receive queue: a burst of requests from many clients
+#define TFTP_REQUEST_BATCH 64		// Requests read per listener wakeup
+#define TFTP_REAP_INTERVAL 10			// ms between passes over the sessions for timers
+#define TFTP_RETRANSMIT_TIMEOUT 1000	// ms without an answer before the last packet is resent
+#define TFTP_MAX_RETRIES 5
+
+/* Transfer state of a session */
+#define SESSION_IDLE 0
+#define SESSION_OACK_WAIT 1		// RRQ: OACK sent, waiting for ACK 0
+#define SESSION_SENDING 2		// RRQ: DATA out, waiting for its ACK
+#define SESSION_FINAL_ACK 3		// RRQ: last DATA out, waiting for its ACK
+#define SESSION_RECEIVING 4		// WRQ: ACK out, waiting for the next DATA
+#define SESSION_CLOSING 5		// Done, see CLOSING
+#define SESSION_FETCH_WAIT 6	// RRQ (edge mode): all sent is ACKed, the next block is not fetched yet
+
+#define TFTP_MAX_WINDOW TFTP_GSO_MAX_SEGMENTS	// Largest windowsize (RFC 7440) granted, one GSO send
 
 #define ACK_WAITING 0
 #define ACK_OK 1
@@ -40,46 +85,94 @@
 
 using namespace std;
 
+/*
+ *	Per-session buffers, taken from the server's pool while a session is
+ *	in use and handed back on disconnect
+ */
+struct TFTP_SESSION_BUFFERS{
+	TFTP_PACKET send_packet;	// Last packet sent (resent on timeout)
+	string rendered;			// Virtual file or directory listing (read_mem points here)
+	std::shared_ptr<const void> preloaded;	// Preloaded copy or pack mapping read_mem points into, kept while read
+	string upload;				// WRQ: path the upload is renamed to once complete
+	uint32_t crc;				// WRQ: CRC32C of the data so far
+	int64_t expected_crc;		// WRQ: checksum the client asked for, -1 = none
+	TFTP_CONGESTION* congestion;	// Windowed RRQ: what may be in flight
+	string name;				// Requested file, kept for the handler's complete()
+	int64_t transferred;		// Bytes once the transfer completed, -1 until then
+	int64_t size;				// RRQ: bytes the transfer carries (tsize), -1 = unknown
+	
+	TFTP_SESSION_BUFFERS(){
+		crc = 0;
+		expected_crc = -1;
+		congestion = NULL;
+		transferred = -1;
+		size = -1;
+	}
+};
+
+/*
+ *	One session slot.  Only what the event loop and the timers touch lives
+ *	here (~168 bytes); packets and strings are in buffers, streams on the
+ *	heap, so idle slots stay small.
+ */
 struct Client{
+	struct sockaddr_in address;	// Peer TID
+	int client_socket;			// Our TID
 	int connection;
+	int state;			// SESSION_*
 	int request_type;
-	int block;			//
-	int temp;
-	int acknowledged;
-	int dirPost;		// Marker for Directory List Sending
-	
-	char dirBuf[DIRECTORY_LIST_SIZE];
-	
-	char* ip;
-	
-	fd_set set;
-	
-	int client_socket;
-	struct sockaddr_in address;
-	struct sockaddr_storage addr;
+	int block;
+	int acked_block;	// RRQ: last block the client acknowledged
+	int last_block;		// Final block number once it has been read, else 0
+	int window;			// Negotiated windowsize, 0 = lock-step (no option)
+	int retries;		// Retransmits since the last good packet
+	int disconnect_after_send;
+	int slot;			// Index in the server's active list, -1 = free
+	uint32_t request_hash;	// Of the RRQ/WRQ that opened the session
+	uint32_t span;			// Span id (TFTP_SPANS::sample()), 0 = not traced
+	long last_active;	// tftp_now_ms() of the last packet received
+	long last_send;		// tftp_now_ms() of the last (re)send we wait on
 	
-	ifstream* read_file;
-	ofstream* write_file;
+	const char* read_mem;	// Served from memory (preloaded) instead of read_handle
+	size_t read_len;
+	size_t read_pos;		// Offset of the next block to read
+	long read_base;			// File offset of block 1 ("file@offset" requests)
 	
-	int disconnect_after_send;
+	int read_handle;		// Storage handles, -1 = none
+	int write_handle;
+	TFTP_FETCH* fetch;		// Edge mode: fetch read from (RRQ) or run (REQUEST_FETCH), NULL = none
+	TFTP_SESSION_BUFFERS* buffers;	// NULL while the slot is free
+	std::coroutine_handle<> session;	// readSession()/writeSession(), null while free
+	int wake;			// TFTP_WAKE_* the session is resumed with
 	
-	TFTP_PACKET receive_packet;
-	TFTP_PACKET send_packet;
+	char* ip;
 	
 	Client(){
 		request_type = REQUEST_UNDEFINED;
 		connection = NOT_CONNECTED;
-		acknowledged = ACK_WAITING;
 		block = 0;
 		disconnect_after_send = 0;
+		window = 0;
+		last_block = 0;
+		read_base = 0;
+		last_active = 0;
 		client_socket = -1;
+		read_handle = -1;
+		write_handle = -1;
+		fetch = NULL;
+		read_mem = NULL;
+		read_len = read_pos = 0;
+		buffers = NULL;
+		slot = -1;
+		request_hash = 0;
+		span = 0;
 		ip = (char*)"";
-		dirPost = 0;
-	}
-	
-	~Client(){
-		if(read_file) delete read_file;
-		if(write_file) delete write_file;
+		state = SESSION_IDLE;
+		acked_block = 0;
+		retries = 0;
+		last_send = 0;
+		session = nullptr;
+		wake = 0;
 	}
 };
 
@@ -93,39 +186,158 @@ private:
 	int listener;
 	int DEBUG;
 	
-	int getFileOffset(char* f){
-		char at[] = "@";
-		int off = strcspn(f,at);
-		if(off == strlen(f)) return 0;
-		char offset[16];
-		strncpy(offset,f+off+1,strlen(f) - off);
-		off = atoi(offset);
-		return off;
+	TFTP_TRANSPORT* transport;	// All socket I/O goes through here
+	int own_transport;
+	TFTP_STORAGE* storage;		// All file I/O goes through here
+	int own_storage;
+	TFTP_SCHEDULER* scheduler;	// Paces DATA packets across sessions
+	TFTP_SOCKET_POOL* sockets;	// Spare transfer sockets (TIDs)
+	TFTP_CONGESTION_CONFIG congestion;	// Controller of windowed RRQs
+	TFTP_PACKET receive_packet;	// Packet being processed (one at a time)
+	TFTP_ADMISSION* admission;	// Sheds requests before they cost a socket or file
+	TFTP_PACKET busy_packet;	// Prebuilt "Server busy" ERROR
+	TFTP_PACKET missing_packet;	// Prebuilt "File Not Found" ERROR
+	int active_sessions;
+	int open_files;
+	TFTP_PRELOAD* preload;		// Warmed-up files, not owned
+	TFTP_PACK* pack;			// Packed archive serving as the root, not owned
+	TFTP_VIRTUAL* virtuals;		// Generated files, not owned
+	TFTP_NEGATIVE_CACHE* negatives;	// Names known to be missing, not owned
+	TFTP_HANDLER* handler;		// Embedding program's callbacks, not owned
+	TFTP_UPSTREAM_CONFIG upstream;	// Edge mode: where missing files are fetched from
+	std::unordered_map<std::string, TFTP_FETCH*> fetches;	// Under way, by path
+	std::unordered_map<std::string, long> validated;		// Path -> tftp_now_ms() it was fetched or checked
+	
+	/* Restart (listener handoff) */
+	char** restart_argv;
+	volatile sig_atomic_t restart_requested;
+	int handoff_channel;		// Socketpair to the new process while it starts up
+	pid_t handoff_child;
+	int draining;				// Listener handed off, finishing transfers
+	
+	void beginHandoff();
+	void finishHandoff();
+	volatile sig_atomic_t running;
+	
+	int64_t getFileOffset(char* f){
+		const char* at = strchr(f,'@');
+		if(!at) return 0;
+		long long off = strtoll(at + 1,NULL,10);
+		return off > 0 ? off : 0;
 	}
 	
+	std::vector<char> window_buf;	// Window being assembled for one GSO send
+	char list_buf[DIRECTORY_LIST_SIZE];	// Directory listing being built
+	
+	/* Session storage */
+	std::vector<Client*> free_clients;			// Free slots, next one last
+	std::vector<Client*> released_clients;		// Freed since the last wait()
+	std::vector<Client*> active_clients;		// Slots in use (Client::slot)
+	std::unordered_map<uint64_t, Client*> peers;	// Address:port -> session
+	std::vector<TFTP_SESSION_BUFFERS*> buffer_pool;	// Free session buffers
+	long next_reap;
+	int reap_timer;
+	int listener_drained;		// The listener had nothing more to read
+	long timer_due;				// tftp_now_ms() of the next timer pollOnce() saw, -1 = none
+	int events_handled;			// The last pollOnce() handled events: timers may be due now
+	
+	Client* acquireClient(struct sockaddr_in*);
+	void releaseClient(Client*);
+	
+	static uint64_t peerKey(struct sockaddr_in* a)
+	{ return ((uint64_t)a->sin_addr.s_addr << 16) | a->sin_port; }
+	
 	int ls(char*, char*);
+	int listPack(char*, char*);
+	
+	friend class TFTP_BENCH;
 	
 public:
-	Client clients[MAX_CLIENTS];
+	std::vector<Client> clients;	// Session slots, sized by start()
+	
+	/* Counters */
+	long duplicates;		// Duplicate/stale packets answered from memory or dropped
+	long retransmits;
+	long edge_hits;			// Edge mode: RRQs served from a cached file trusted as is
+	long edge_fetches;		// Fetches started (revalidations included)
+	long edge_coalesced;	// RRQs that joined a fetch under way
+	long edge_current;		// Revalidations that found the cached file current
+	long edge_stale;		// Cached files served because the upstream failed
 	
-	TFTP_SERVER(int, char*, int);
+	TFTP_SERVER(int, char*, int, TFTP_TRANSPORT* = NULL, int = -1);
 	
+	/* Serving (run() = start() + pollOnce() until stopped) */
 	int run(int);
+	int start(int);
+	int pollOnce(int);
+	int pollFd();
+	int nextTimeout();
+	void stop();
+	void restart();
+	void setRestartArgv(char**);
+	void setRateLimits(TFTP_RATE_LIMITS);
+	void setAdmissionLimits(TFTP_ADMISSION_LIMITS);
+	void setSocketPool(TFTP_SOCKET_POOL_CONFIG);
+	void setCongestionControl(TFTP_CONGESTION_CONFIG);
+	void setPreload(TFTP_PRELOAD*);
+	void setPack(TFTP_PACK*);
+	void setVirtualFiles(TFTP_VIRTUAL*);
+	void setNegativeCache(TFTP_NEGATIVE_CACHE*);
+	void setHandler(TFTP_HANDLER*);
+	void setStorage(TFTP_STORAGE*);
+	void setUpstream(TFTP_UPSTREAM_CONFIG);
 	
 	/* Packet Received */
+	Client* receiveRequest();
+	Client* findClient(struct sockaddr_in*);
+	int rejectRequest(struct sockaddr_in*);
+	int answerMissing(struct sockaddr_in*);
+	void checkPack();
+	int authorizeRequest(struct sockaddr_in*, string*);
+	void completeUnserved(struct sockaddr_in*, const string&);
 	int receivePacket(Client*);
-	int processClient(Client*);
+	int startSession(Client*);
+	int resumeSession(Client*, int);
+	int timedOut(Client*);
+	int retransmitTimeout(Client*);
+	TFTP_TASK readSession(Client*);
+	TFTP_TASK writeSession(Client*);
+	void finishClient(Client*);
+	int reapClients();
+	int answerDuplicate(Client*);
+	static uint32_t requestHash(TFTP_PACKET*);
+	void retransmit(Client*);
 	
 	/* RRQ */
+	int openRead(Client*);
 	int getReadFile(Client*);
 	int createReadPacket(Client*);
 	
+	/* Edge mode */
+	int edgeOpen(Client*, const string& path, int64_t offset);
+	TFTP_FETCH* startFetch(const string& path, int64_t cached);
+	TFTP_TASK fetchSession(Client*);
+	int openFetch(Client*);
+	void endFetch(TFTP_FETCH*, int result, int error, const char* msg);
+	void wakeFollowers(TFTP_FETCH*);
+	int waitsForFetch(Client*);
+	void sendFetched(Client*);
+	int blockReady(Client*);
+	
 	/* WRQ */
+	int openWrite(Client*);
 	int createWriteFile(Client*);
+	int resumeUpload(Client*, int64_t offset);
+	int finishUpload(Client*);
 	int writeData(Client*);
 	
+	int openListing(Client*, char*);
 	int createDirPacket(Client*, char*);
 	
+	int sendData(Client*);
+	int sendBlock(Client*);
+	int sendWindow(Client*);
+	void seekBlock(Client*, int);
 	int sendPacket(TFTP_PACKET*, Client*);
 	
 	int sendError(Client*, int, char*);
@@ -140,12 +352,12 @@ public:
 
 class TFTPServerException{
 private:
-	char* err;
+	string err;
 public:
 	TFTPServerException(char* msg){
 		stringstream s;
 		s << "TFTP Server Exception: " << msg;
-		s >> err;
+		err = s.str();
 	}
 	void print(ostream &out)
 	{ out << err; }
@@ -0,0 +1,44 @@
+
+#include "tftp_session.h"
+#include <new>
+
+using namespace std;
+
+vector<void*> TFTP_FRAME_POOL::free_frames[TFTP_FRAME_CLASSES];
+long TFTP_FRAME_POOL::allocated = 0;
+long TFTP_FRAME_POOL::reused = 0;
+
+/*
+ *	@return			Size class of a frame | -1 if too large to pool
+ */
+static int frameClass(size_t size){
+	size_t c = (size + TFTP_FRAME_ALIGN - 1) / TFTP_FRAME_ALIGN;
+	return c < TFTP_FRAME_CLASSES ? (int)c : -1;
+}
+
+/*
+ *	Get a frame of at least size bytes, from its free list if it has one
+ */
+void* TFTP_FRAME_POOL::allocate(size_t size){
+	int c = frameClass(size);
+	if(c >= 0 && !free_frames[c].empty()){
+		void* frame = free_frames[c].back();
+		free_frames[c].pop_back();
+		++reused;
+		return frame;
+	}
+	++allocated;
+	return ::operator new(c >= 0 ? c * TFTP_FRAME_ALIGN : size);
+}
+
+/*
+ *	Give a frame back to its free list (frames are never returned to the heap)
+ */
+void TFTP_FRAME_POOL::release(void* frame, size_t size){
+	int c = frameClass(size);
+	if(c < 0){
+		::operator delete(frame);
+		return;
+	}
+	free_frames[c].push_back(frame);
+}
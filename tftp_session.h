@@ -0,0 +1,99 @@
+#ifndef TFTP_SESSION_H
+#define TFTP_SESSION_H
+
+#include "tftp_spans.h"
+#include <coroutine>
+#include <exception>
+#include <stddef.h>
+#include <vector>
+
+/*
+ *	Session coroutines
+ *
+ *	Every transfer runs as a coroutine on the server's event loop.  It
+ *	suspends on TFTP_WAIT until a datagram arrives on its socket (TID) or
+ *	its retransmit timer expires, and the loop resumes it with the reason.
+ *	Storage calls are made synchronously from the session and do not
+ *	suspend it.
+ *	A suspended session is one small frame; frames come from
+ *	TFTP_FRAME_POOL, so once the pool is warm starting a session does not
+ *	touch the general heap.
+ */
+
+#define TFTP_WAKE_PACKET	1	// A datagram from the peer is in the server's receive_packet
+#define TFTP_WAKE_TIMEOUT	2	// Nothing arrived before the retransmit deadline
+#define TFTP_WAKE_FETCH		3	// The upstream fetch the session is served from moved on (edge mode)
+
+#define TFTP_FRAME_ALIGN	64	// Pool size classes are multiples of this
+#define TFTP_FRAME_CLASSES	32	// Frames up to 2 KB are pooled, larger ones use the heap
+
+/*
+ *	Free lists of coroutine frames by size class (event loop only, not
+ *	thread safe)
+ */
+class TFTP_FRAME_POOL{
+private:
+	static std::vector<void*> free_frames[TFTP_FRAME_CLASSES];
+
+public:
+	static void* allocate(size_t size);
+	static void release(void* frame, size_t size);
+
+	/* Counters */
+	static long allocated;		// Frames taken from the heap
+	static long reused;			// Frames taken from a free list
+};
+
+/*
+ *	Return type of a session coroutine.  It runs eagerly up to its first
+ *	wait and stays suspended at the end, so the loop sees done() and
+ *	destroys the frame when it disconnects the session.
+ */
+struct TFTP_TASK{
+	struct promise_type{
+		TFTP_TASK get_return_object()
+		{ return TFTP_TASK(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_never initial_suspend() noexcept
+		{ return std::suspend_never(); }
+		std::suspend_always final_suspend() noexcept
+		{ return std::suspend_always(); }
+		void return_void(){}
+		void unhandled_exception()
+		{ std::terminate(); }
+
+		static void* operator new(size_t size)
+		{ return TFTP_FRAME_POOL::allocate(size); }
+		static void operator delete(void* frame, size_t size)
+		{ TFTP_FRAME_POOL::release(frame, size); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit TFTP_TASK(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+/*
+ *	co_await: suspend until the loop resumes the session (a TFTP_SPAN_WAIT
+ *	span when the session is traced)
+ *
+ *	@return		TFTP_WAKE_*
+ */
+struct TFTP_WAIT{
+	int* wake;		// Set by the loop before it resumes
+	uint32_t span;
+	uint64_t since;
+
+	TFTP_WAIT(int* _wake, uint32_t _span)
+	{ wake = _wake; span = _span; since = 0; }
+
+	bool await_ready() const noexcept
+	{ return false; }
+	void await_suspend(std::coroutine_handle<>) noexcept
+	{ if(span) since = TFTP_SPANS::now(); }
+	int await_resume() const noexcept{
+		if(span) TFTP_SPANS::record(TFTP_SPAN_WAIT, span, since, *wake);
+		return *wake;
+	}
+};
+
+#endif
@@ -0,0 +1,593 @@
+#include "tftp_sim.h"
+#include "tftp_server.h"
+#include <errno.h>
+#include <time.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+using namespace std;
+
+/* Event types */
+#define TFTP_SIM_EVENT_START		0	// Client sends its RRQ
+#define TFTP_SIM_EVENT_TO_SERVER	1	// Datagram reaches a server socket
+#define TFTP_SIM_EVENT_TO_CLIENT	2	// Datagram reaches a client
+#define TFTP_SIM_EVENT_TIMER		3	// Client retransmit timer
+
+/*
+ *	Parses a size/rate with an optional K, M or G suffix (powers of 1000)
+ */
+static double parseAmount(const char* s){
+	char* end = NULL;
+	double v = strtod(s, &end);
+	switch(end ? *end : 0){
+		case 'k': case 'K': return v * 1e3;
+		case 'm': case 'M': return v * 1e6;
+		case 'g': case 'G': return v * 1e9;
+	}
+	return v;
+}
+
+static uint64_t threadCpuNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *	Parse "clients=N,ramp=MS,files=N,size=B,window=N,delay=MS,jitter=MS,
+ *	loss=P,rate=B/s,uplink=B/s,timeout=MS,retries=N,seed=N"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_SIM_CONFIG::parse(const char* spec, TFTP_SIM_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "clients"))			out->clients = atoi(val);
+		else if(!strcmp(tok, "ramp"))		out->ramp_ms = atoi(val);
+		else if(!strcmp(tok, "files"))		out->files = atoi(val);
+		else if(!strcmp(tok, "size"))		out->size = (long)parseAmount(val);
+		else if(!strcmp(tok, "window"))		out->window = atoi(val);
+		else if(!strcmp(tok, "delay"))		out->delay_ms = atof(val);
+		else if(!strcmp(tok, "jitter"))		out->jitter_ms = atof(val);
+		else if(!strcmp(tok, "loss"))		out->loss = atof(val);
+		else if(!strcmp(tok, "rate"))		out->rate = parseAmount(val);
+		else if(!strcmp(tok, "uplink"))		out->uplink = parseAmount(val);
+		else if(!strcmp(tok, "timeout"))	out->timeout_ms = atoi(val);
+		else if(!strcmp(tok, "retries"))	out->retries = atoi(val);
+		else if(!strcmp(tok, "seed"))		out->seed = strtoull(val, NULL, 0);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->clients < 1 || out->files < 1 || out->size < 0 || out->window < 0 ||
+	   out->ramp_ms < 0 || out->delay_ms < 0 || out->jitter_ms < 0 || out->jitter_ms > out->delay_ms ||
+	   out->loss < 0 || out->loss >= 1 || out->timeout_ms < 1 || out->retries < 0) rv = -1;
+	return rv;
+}
+
+/*
+ *	Constructor
+ *
+ *	@param	_config		Clients, files and network
+ */
+TFTP_SIM::TFTP_SIM(TFTP_SIM_CONFIG _config){
+	config = _config;
+	server = NULL;
+	listen_port = 0;
+	now = TFTP_SIM_EPOCH_NS;
+	seq = 0;
+	rng = config.seed ? config.seed : 1;
+	uplink_free_ns = 0;
+	ports.assign(65536, -1);
+	next_port = TFTP_SIM_EPHEMERAL;
+	finished = 0;
+	last_finish_ns = now;
+	waits = 0;
+	cpu_mark_ns = threadCpuNs();
+	completed = failed = errors = corrupt = client_retransmits = 0;
+	dropped = overflows = unreachable = datagrams = 0;
+	peak_active = active = 0;
+	peak_heap = 0;
+	server_cpu_ns = sim_cpu_ns = 0;
+
+	/* Not periodic in the block size, so a block sent for another checks wrong */
+	content.resize(config.size ? config.size : 1);
+	for(long i = 0; i < config.size; ++i) content[i] = (char)((i * 2654435761u) >> 24);
+
+	TFTP_SIM_CLIENT idle;
+	memset(&idle, 0, sizeof(idle));
+	idle.state = TFTP_SIM_WAITING;
+	idle.gap_acked = -1;
+	idle.last_ack = -1;
+	clients.assign(config.clients, idle);
+	for(int i = 0; i < config.clients; ++i) clients[i].file = i % config.files;
+}
+
+string TFTP_SIM::fileName(int i){
+	char name[32];
+	snprintf(name, sizeof(name), "sim%d", i);
+	return name;
+}
+
+double TFTP_SIM::random(){
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void TFTP_SIM::schedule(Event& e){
+	e.seq = seq++;
+	events.push(std::move(e));
+}
+
+/*
+ *	A datagram of len bytes offered to a link at from_ns leaves it at the
+ *	returned time (FIFO, no queue limit)
+ */
+uint64_t TFTP_SIM::linkTime(uint64_t from_ns, uint64_t* free_ns, double rate, int len){
+	uint64_t start = max(from_ns, *free_ns);
+	*free_ns = start + (uint64_t)((len + 28) * 1e9 / rate);	// + IP/UDP headers
+	return *free_ns;
+}
+
+/*
+ *	Let the clients start arriving; the server must be listening on port
+ *
+ *	@param	_server		Stopped once every client is done
+ */
+void TFTP_SIM::start(TFTP_SERVER* _server, int port){
+	server = _server;
+	listen_port = port;
+	for(int i = 0; i < config.clients; ++i){
+		Event e;
+		e.at = now + (uint64_t)(random() * config.ramp_ms * 1e6);
+		e.type = TFTP_SIM_EVENT_START;
+		e.client = i;
+		e.port = port;
+		schedule(e);
+	}
+}
+
+int TFTP_SIM::done()
+{ return finished == config.clients; }
+
+/*
+ *	One-way delay of a datagram, with its jitter
+ */
+uint64_t TFTP_SIM::propagation()
+{ return (uint64_t)((config.delay_ms + (2 * random() - 1) * config.jitter_ms) * 1e6); }
+
+/*
+ *	Put the client's packet on its way to a server port
+ */
+void TFTP_SIM::toServer(int client, int port){
+	if(config.loss > 0 && random() < config.loss){
+		++dropped;
+		return;
+	}
+	TFTP_SIM_CLIENT& c = clients[client];
+	Event e;
+	e.at = max(now + propagation(), c.up_ns);	// Jitter, but no reordering on a link
+	c.up_ns = e.at;
+	e.type = TFTP_SIM_EVENT_TO_SERVER;
+	e.client = client;
+	e.port = port;
+	e.len = packet.getSize();
+	e.data.assign((const char*)packet.getData(0), e.len);
+	schedule(e);
+}
+
+/*
+ *	The client (re)sends its last packet: the RRQ to the listener, an ACK
+ *	to its session
+ */
+void TFTP_SIM::send(int client, int port){
+	TFTP_SIM_CLIENT& c = clients[client];
+	if(c.last_ack < 0){
+		packet.createRRQ((char*)fileName(c.file).c_str());
+		if(config.window > 0){
+			char w[8];
+			snprintf(w, sizeof(w), "%d", config.window);
+			packet.addOption("windowsize", w);
+		}
+	}
+	else packet.createACK(c.last_ack & 0xffff);
+	toServer(client, port);
+	arm(client);
+}
+
+/*
+ *	(Re)start the client's retransmit timer.  One timer event per client is
+ *	queued at most: when it fires early it is queued again for the deadline.
+ */
+void TFTP_SIM::arm(int client){
+	TFTP_SIM_CLIENT& c = clients[client];
+	c.deadline_ns = now + config.timeout_ms * 1000000ULL;
+	if(!c.armed) queueTimer(client);
+}
+
+void TFTP_SIM::queueTimer(int client){
+	TFTP_SIM_CLIENT& c = clients[client];
+	c.armed = 1;
+	Event e;
+	e.at = c.deadline_ns;
+	e.type = TFTP_SIM_EVENT_TIMER;
+	e.client = client;
+	e.port = 0;
+	schedule(e);
+}
+
+void TFTP_SIM::expire(int client){
+	TFTP_SIM_CLIENT& c = clients[client];
+	c.armed = 0;
+	if(c.state != TFTP_SIM_ACTIVE) return;
+	if(now < c.deadline_ns){
+		queueTimer(client);
+		return;
+	}
+	if(++c.retries > config.retries){
+		finish(client, TFTP_SIM_FAILED);
+		return;
+	}
+	++client_retransmits;
+	send(client, c.last_ack < 0 ? listen_port : c.tid);
+}
+
+void TFTP_SIM::finish(int client, int state){
+	TFTP_SIM_CLIENT& c = clients[client];
+	c.state = state;
+	c.finish_ns = last_finish_ns = now;
+	--active;
+	++finished;
+	if(state == TFTP_SIM_DONE){
+		++completed;
+		completion_ns.push_back(now - c.start_ns);
+	}
+	else ++failed;
+}
+
+/*
+ *	A datagram from server port `port` reaches a client
+ */
+void TFTP_SIM::receive(int client, int port, const string& data, int len){
+	TFTP_SIM_CLIENT& c = clients[client];
+	if(c.state == TFTP_SIM_WAITING || c.state == TFTP_SIM_FAILED) return;
+	int n = min((int)data.size(), TFTP_PACKET_MAX_SIZE);
+	memcpy(packet.getData(0), data.data(), n);
+	packet.setSize(n);
+	if(c.state == TFTP_SIM_DONE){
+		/* Our last ACK was lost, the server resends the last block */
+		if(packet.isData() && packet.getBlockNumber() == (c.block & 0xffff)){
+			packet.createACK(c.block & 0xffff);
+			toServer(client, port);
+		}
+		return;
+	}
+	if(packet.isError()){
+		++errors;
+		finish(client, TFTP_SIM_FAILED);
+		return;
+	}
+	if(packet.isOACK() && c.block == 0){
+		/* The server may grant less than was asked for */
+		char w[8];
+		c.window = packet.getOption("windowsize", w, sizeof(w)) > 0 ? atoi(w) : 0;
+		c.tid = port;
+		c.last_ack = 0;
+		c.retries = 0;
+		send(client, port);
+		return;
+	}
+	if(!packet.isData()) return;
+	int block = packet.getBlockNumber();
+	int last = len - TFTP_DATA_PKT_DATA_OFFSET < TFTP_PACKET_DATA_SIZE;
+	int in_order = (block == ((c.block + 1) & 0xffff));
+	if(in_order){
+		++c.block;
+		c.tid = port;
+		c.retries = 0;
+		if(c.window > 0 && ++c.unacked < c.window && !last){
+			arm(client);	// Progress, don't time out mid-window
+			return;
+		}
+	}
+	else if(c.window > 0){
+		if(((block - c.block) & 0xffff) >= 0x8000 || block == (c.block & 0xffff)) return;	// Old or duplicate
+		if(c.gap_acked == c.block) return;
+		c.gap_acked = c.block;		// Gap: ACK what arrived in order, the server goes back
+	}
+	else if(block != (c.block & 0xffff)) return;	// Stale, not a duplicate of the last block
+	c.unacked = 0;
+	c.last_ack = c.block;
+	send(client, port);
+	if(in_order && last) finish(client, TFTP_SIM_DONE);
+}
+
+void TFTP_SIM::deliver(Event& e){
+	switch(e.type){
+		case TFTP_SIM_EVENT_START:{
+			TFTP_SIM_CLIENT& c = clients[e.client];
+			c.state = TFTP_SIM_ACTIVE;
+			c.start_ns = now;
+			peak_active = max(peak_active, ++active);
+			send(e.client, e.port);
+			break;
+		}
+		case TFTP_SIM_EVENT_TO_SERVER:{
+			int fd = ports[e.port];
+			if(fd < 0){
+				++unreachable;
+				break;
+			}
+			Socket& s = sockets[fd];
+			if(s.peer >= 0 && s.peer != e.client){
+				++unreachable;
+				break;
+			}
+			int cost = e.data.size() + TFTP_SIM_TRUESIZE;
+			if(s.queued + cost > s.rcvbuf){
+				++overflows;
+				break;
+			}
+			s.queued += cost;
+			Datagram d;
+			d.client = e.client;
+			d.data = std::move(e.data);
+			s.queue.push_back(std::move(d));
+			if(s.tag && !s.ready){
+				s.ready = 1;
+				ready.push_back(fd);
+			}
+			++datagrams;
+			break;
+		}
+		case TFTP_SIM_EVENT_TO_CLIENT:
+			++datagrams;
+			receive(e.client, e.port, e.data, e.len);
+			break;
+		case TFTP_SIM_EVENT_TIMER:
+			expire(e.client);
+			break;
+	}
+}
+
+/*
+ *	Whether a DATA packet for client c holds the right bytes of its file.
+ *	Blocks sent are within half the block number space of what the client
+ *	has, which places the 16 bit block number in the file.
+ */
+int TFTP_SIM::checkData(TFTP_SIM_CLIENT& c, const char* buf, int len){
+	int block = ((const unsigned char*)buf)[2] << 8 | ((const unsigned char*)buf)[3];
+	long full = c.block + (int16_t)(block - (c.block & 0xffff));
+	long off = (full - 1) * TFTP_PACKET_DATA_SIZE;
+	int size = len - TFTP_DATA_PKT_DATA_OFFSET;
+	if(full < 1 || off > config.size ||
+	   size != min((long)TFTP_PACKET_DATA_SIZE, config.size - off)) return 0;
+	return !memcmp(buf + TFTP_DATA_PKT_DATA_OFFSET, &content[off], size);
+}
+
+TFTP_SIM::Socket* TFTP_SIM::socketOf(int fd){
+	if(fd < 0 || fd >= (int)sockets.size() || !sockets[fd].open){
+		errno = EBADF;
+		return NULL;
+	}
+	return &sockets[fd];
+}
+
+int TFTP_SIM::openSocket(){
+	int fd;
+	if(free_fds.empty()){
+		fd = sockets.size();
+		sockets.push_back(Socket());
+		sockets[fd].ready = 0;
+	}
+	else{
+		fd = free_fds.back();
+		free_fds.pop_back();
+	}
+	Socket& s = sockets[fd];		// `ready` stays: it may still be listed
+	s.open = 1;
+	s.port = 0;
+	s.peer = -1;
+	s.tag = NULL;
+	s.rcvbuf = TFTP_SIM_RCVBUF;
+	s.queued = 0;
+	s.queue.clear();
+	return fd;
+}
+
+/*
+ *	Port 0 takes the next free ephemeral port
+ */
+int TFTP_SIM::bindSocket(int fd, struct sockaddr_in* addr){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	int port = ntohs(addr->sin_port);
+	if(!port){
+		for(int tries = 0; ports[next_port] >= 0; ++tries){
+			if(tries >= 65536 - TFTP_SIM_EPHEMERAL){
+				errno = EADDRINUSE;
+				return -1;
+			}
+			if(++next_port > 65535) next_port = TFTP_SIM_EPHEMERAL;
+		}
+		port = next_port;
+	}
+	else if(ports[port] >= 0){
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if(s->port) ports[s->port] = -1;
+	s->port = port;
+	ports[port] = fd;
+	return 0;
+}
+
+int TFTP_SIM::closeSocket(int fd){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	if(s->port) ports[s->port] = -1;
+	s->open = 0;
+	s->tag = NULL;
+	s->queue.clear();
+	s->queued = 0;
+	free_fds.push_back(fd);
+	return 0;
+}
+
+int TFTP_SIM::setReceiveBuffer(int fd, int bytes){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	s->rcvbuf = bytes;
+	return 0;
+}
+
+int TFTP_SIM::setSendBuffer(int fd, int bytes)
+{ return socketOf(fd) ? 0 : -1; }
+
+int TFTP_SIM::connectSocket(int fd, struct sockaddr_in* to){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	s->peer = to ? (int)(ntohl(to->sin_addr.s_addr) - TFTP_SIM_CLIENT_NET) : -1;
+	return 0;
+}
+
+/*
+ *	Server -> client: through the shared uplink, the client's link, then
+ *	the delay.  Anything not addressed to a client disappears.
+ */
+int TFTP_SIM::sendTo(int fd, const void* buf, int len, struct sockaddr_in* to){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	if(!s->port){
+		struct sockaddr_in any;
+		memset(&any, 0, sizeof(any));
+		if(bindSocket(fd, &any) < 0) return -1;
+	}
+	uint32_t client = ntohl(to->sin_addr.s_addr) - TFTP_SIM_CLIENT_NET;
+	if(client >= clients.size()) return len;
+	TFTP_SIM_CLIENT& c = clients[client];
+	uint64_t at = now;
+	if(config.uplink > 0) at = linkTime(at, &uplink_free_ns, config.uplink, len);
+	if(config.rate > 0) at = linkTime(at, &c.link_free_ns, config.rate, len);
+	/* DATA is checked here and travels as its header: no payload copies */
+	int header = len;
+	if(len >= TFTP_DATA_PKT_DATA_OFFSET && ((const unsigned char*)buf)[1] == TFTP_OPCODE_DATA){
+		if(!checkData(c, (const char*)buf, len)) ++corrupt;
+		header = TFTP_DATA_PKT_DATA_OFFSET;
+	}
+	if(config.loss > 0 && random() < config.loss){
+		++dropped;
+		return len;
+	}
+	Event e;
+	e.at = max(at + propagation(), c.down_ns);
+	c.down_ns = e.at;
+	e.type = TFTP_SIM_EVENT_TO_CLIENT;
+	e.client = client;
+	e.port = s->port;
+	e.len = len;
+	e.data.assign((const char*)buf, header);
+	schedule(e);
+	return len;
+}
+
+int TFTP_SIM::recvFrom(int fd, void* buf, int len, struct sockaddr_in* from){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	if(s->queue.empty()){
+		errno = EAGAIN;
+		return -1;
+	}
+	Datagram& d = s->queue.front();
+	int n = min(len, (int)d.data.size());
+	memcpy(buf, d.data.data(), n);
+	memset(from, 0, sizeof(*from));
+	from->sin_family = AF_INET;
+	from->sin_addr.s_addr = htonl(TFTP_SIM_CLIENT_NET + d.client);
+	from->sin_port = htons(TFTP_SIM_CLIENT_PORT);
+	s->queued -= d.data.size() + TFTP_SIM_TRUESIZE;
+	s->queue.pop_front();
+	return n;
+}
+
+int TFTP_SIM::watch(int fd, void* tag){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	s->tag = tag;
+	if(!s->queue.empty() && !s->ready){
+		s->ready = 1;
+		ready.push_back(fd);
+	}
+	return 0;
+}
+
+int TFTP_SIM::unwatch(int fd){
+	Socket* s = socketOf(fd);
+	if(!s) return -1;
+	s->tag = NULL;
+	return 0;
+}
+
+/*
+ *	Watched sockets with datagrams queued (level triggered, like epoll);
+ *	the ones with nothing left drop off the list
+ */
+int TFTP_SIM::collect(TFTP_EVENT* out, int max_events){
+	int n = 0;
+	size_t keep = 0;
+	for(size_t i = 0; i < ready.size(); ++i){
+		Socket& s = sockets[ready[i]];
+		if(!s.open || !s.tag || s.queue.empty()){
+			s.ready = 0;
+			continue;
+		}
+		if(n < max_events) out[n++].tag = s.tag;
+		ready[keep++] = ready[i];
+	}
+	ready.resize(keep);
+	return n;
+}
+
+void TFTP_SIM::sampleHeap(){
+	struct mallinfo2 m = mallinfo2();
+	peak_heap = max(peak_heap, m.uordblks + m.hblkhd);
+}
+
+/*
+ *	Runs the network and the clients up to the first datagram a watched
+ *	socket gets, or for timeout_ms of virtual time.  Stops the server
+ *	once every client is done and nothing is left in flight.
+ */
+int TFTP_SIM::wait(TFTP_EVENT* out, int max_events, int timeout_ms){
+	uint64_t entered = threadCpuNs();
+	server_cpu_ns += entered - cpu_mark_ns;
+	uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : now + timeout_ms * 1000000ULL;
+	int n;
+	while(!(n = collect(out, max_events))){
+		if(events.empty() || events.top().at > deadline){
+			if(timeout_ms >= 0) now = deadline;
+			break;
+		}
+		/* Moved out, the heap only compares at/seq while popping */
+		Event e = std::move(const_cast<Event&>(events.top()));
+		events.pop();
+		now = max(now, e.at);
+		deliver(e);
+	}
+	if(done() && events.empty() && server) server->stop();
+	if(++waits % TFTP_SIM_HEAP_SAMPLE == 0) sampleHeap();
+	cpu_mark_ns = threadCpuNs();
+	sim_cpu_ns += cpu_mark_ns - entered;
+	return n;
+}
@@ -0,0 +1,233 @@
+#ifndef TFTP_SIM_H
+#define TFTP_SIM_H
+
+#include "tftp_transport.h"
+#include "tftp_packet.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+
+class TFTP_SERVER;
+
+/*
+ *	Discrete-event simulator
+ *
+ *	Runs the real server (sessions, scheduler, admission, congestion
+ *	control, timers) against thousands of simulated clients on one thread,
+ *	in virtual time.  TFTP_SIM is both the server's transport and its
+ *	clock: sockets are queues in memory, the network is a link per client
+ *	(one-way delay, jitter, loss, a rate) behind the server's shared uplink,
+ *	and wait() jumps the clock to the next delivery or timer instead of
+ *	sleeping.  An hour of traffic takes as long as the CPU work in it.
+ *
+ *	The server's processing takes no virtual time; its CPU time is measured
+ *	apart from the simulator's (thread CPU time outside wait()).  Socket
+ *	receive queues are bounded like the kernel's (SO_RCVBUF, counting
+ *	TFTP_SIM_TRUESIZE per datagram), so a listener overrun drops requests.
+ *
+ *	Clients behave like tftp_loadgen's: an RRQ (asking for `window` if set)
+ *	for one of `files` files of `size` bytes, an ACK per window or for the
+ *	last in-order block after a gap, the last packet resent after `timeout`
+ *	ms up to `retries` times.  They start at random over `ramp` ms and
+ *	re-ACK a repeated last block once done.  Every DATA is checked against
+ *	the file as it is sent.  Jitter never reorders a link's datagrams.
+ */
+
+#define TFTP_SIM_CLIENTS		1000
+#define TFTP_SIM_FILE_SIZE		(1 << 20)
+#define TFTP_SIM_RCVBUF			212992		// Kernel default SO_RCVBUF
+#define TFTP_SIM_TRUESIZE		768			// Bytes a queued datagram costs beyond its payload
+#define TFTP_SIM_EPHEMERAL		32768		// First port handed out by bind(port 0)
+#define TFTP_SIM_CLIENT_NET		0x0A000001	// 10.0.0.1, client i is this + i
+#define TFTP_SIM_CLIENT_PORT	1024
+#define TFTP_SIM_EPOCH_NS		1000000000ULL	// Virtual time starts here (0 reads as "never")
+#define TFTP_SIM_HEAP_SAMPLE	1024		// wait() calls between heap samples
+
+struct TFTP_SIM_CONFIG{
+	int clients;		// Transfers simulated
+	int ramp_ms;		// Client starts spread at random over this
+	int files;			// Client i reads "sim<i % files>"
+	long size;			// Bytes per file
+	int window;			// windowsize asked for, 0 = lock-step
+	double delay_ms;	// One-way delay
+	double jitter_ms;	// Uniform +/- on top of the delay
+	double loss;		// Probability a datagram is dropped (either way)
+	double rate;		// Bytes/s of each client's link, 0 = unlimited
+	double uplink;		// Bytes/s of the server's link, shared, 0 = unlimited
+	int timeout_ms;		// Client retransmit timeout
+	int retries;
+	uint64_t seed;		// Same seed => same run
+
+	TFTP_SIM_CONFIG(){
+		clients = TFTP_SIM_CLIENTS;
+		ramp_ms = 1000;
+		files = 1;
+		size = TFTP_SIM_FILE_SIZE;
+		window = 0;
+		delay_ms = 1;
+		jitter_ms = 0;
+		loss = 0;
+		rate = uplink = 0;
+		timeout_ms = 1000;
+		retries = 5;
+		seed = 1;
+	}
+
+	static int parse(const char* spec, TFTP_SIM_CONFIG* out);
+};
+
+/*
+ *	Per simulated client, kept small: there are many
+ */
+struct TFTP_SIM_CLIENT{
+	int state;			// TFTP_SIM_*
+	int file;
+	int block;			// Last block received in order
+	int window;			// windowsize granted, 0 = lock-step
+	int unacked;		// In-order blocks since the last ACK
+	int gap_acked;		// Block last ACKed for a gap
+	int last_ack;		// Last packet sent: ACK of this block, -1 = the RRQ
+	int tid;			// Server port of the session, 0 until it answers
+	int retries;
+	int armed;			// A timer event is queued (it may be early, see deadline_ns)
+	uint64_t deadline_ns;	// Retransmit when the clock gets here
+	uint64_t start_ns;
+	uint64_t finish_ns;
+	uint64_t link_free_ns;	// The client's link is busy until then
+	uint64_t down_ns;		// Last arrival at the client (links keep order)
+	uint64_t up_ns;			// Last arrival from it at the server
+};
+
+#define TFTP_SIM_WAITING	0
+#define TFTP_SIM_ACTIVE		1
+#define TFTP_SIM_DONE		2
+#define TFTP_SIM_FAILED		3
+
+class TFTP_SIM : public TFTP_TRANSPORT, public TFTP_CLOCK{
+private:
+	struct Datagram{
+		int client;
+		std::string data;
+	};
+
+	struct Socket{
+		int open;
+		int port;
+		int peer;			// connect()ed client, -1 = any
+		void* tag;			// watch() tag, NULL = not watched
+		int ready;			// In `ready`
+		int rcvbuf;
+		int queued;			// Bytes charged against rcvbuf
+		std::deque<Datagram> queue;
+	};
+
+	struct Event{
+		uint64_t at;
+		uint64_t seq;
+		int type;			// TFTP_SIM_EVENT_* (tftp_sim.cc)
+		int client;
+		int port;			// Server port it goes to (or comes from)
+		int len;			// Datagram size
+		std::string data;	// Its bytes; only the header of a DATA
+	};
+
+	struct Later{
+		bool operator()(const Event& a, const Event& b) const
+		{ return a.at != b.at ? a.at > b.at : a.seq > b.seq; }
+	};
+
+	TFTP_SIM_CONFIG config;
+	TFTP_SERVER* server;
+	int listen_port;
+	uint64_t now;
+	uint64_t seq;
+	uint64_t rng;
+	uint64_t uplink_free_ns;
+	std::priority_queue<Event, std::vector<Event>, Later> events;
+	std::vector<Socket> sockets;		// By fd
+	std::vector<int> free_fds;
+	std::vector<int> ports;				// Port -> fd, -1 = none
+	int next_port;
+	std::vector<int> ready;				// fds that may have datagrams for wait()
+	std::vector<TFTP_SIM_CLIENT> clients;
+	std::vector<char> content;			// Every file's bytes
+	TFTP_PACKET packet;					// Client packet being built
+	int finished;						// Clients done or failed
+	uint64_t last_finish_ns;
+	long waits;
+	uint64_t cpu_mark_ns;				// Thread CPU time when wait() last returned
+
+	double random();
+	void schedule(Event& e);
+	uint64_t linkTime(uint64_t from_ns, uint64_t* free_ns, double rate, int len);
+	uint64_t propagation();
+	int checkData(TFTP_SIM_CLIENT& c, const char* buf, int len);
+	void toServer(int client, int port);
+	void deliver(Event& e);
+	void receive(int client, int port, const std::string& data, int len);
+	void send(int client, int port);
+	void arm(int client);
+	void queueTimer(int client);
+	void expire(int client);
+	void finish(int client, int state);
+	Socket* socketOf(int fd);
+	int collect(TFTP_EVENT* out, int max_events);
+	void sampleHeap();
+
+public:
+	/* Results */
+	std::vector<uint64_t> completion_ns;	// Per completed transfer, start to last ACK
+	long completed;
+	long failed;
+	long errors;			// Transfers the server answered with an ERROR
+	long corrupt;			// DATA sent with the wrong bytes (or size) for its block
+	long client_retransmits;
+	long dropped;			// Lost on a link
+	long overflows;			// Dropped at a full socket queue
+	long unreachable;		// Sent to a port no socket has
+	long datagrams;			// Delivered either way
+	int peak_active;		// Clients transferring at once
+	int active;
+	size_t peak_heap;		// Heap in use, sampled
+	uint64_t server_cpu_ns;	// Thread CPU time outside wait()
+	uint64_t sim_cpu_ns;	// Inside wait(): the network and the clients
+
+	TFTP_SIM(TFTP_SIM_CONFIG config);
+
+	/* The files the clients ask for */
+	const char* data()
+	{ return &content[0]; }
+	long fileSize()
+	{ return config.size; }
+	int files()
+	{ return config.files; }
+	static std::string fileName(int i);
+
+	void start(TFTP_SERVER* server, int port);
+	int done();
+	uint64_t elapsedNs()
+	{ return now - TFTP_SIM_EPOCH_NS; }
+	uint64_t lastFinishNs()
+	{ return last_finish_ns - TFTP_SIM_EPOCH_NS; }
+
+	uint64_t nowNs()
+	{ return now; }
+
+	int openSocket();
+	int bindSocket(int fd, struct sockaddr_in* addr);
+	int closeSocket(int fd);
+	int setReceiveBuffer(int fd, int bytes);
+	int setSendBuffer(int fd, int bytes);
+	int connectSocket(int fd, struct sockaddr_in* to);
+
+	int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to);
+	int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from);
+
+	int watch(int fd, void* tag);
+	int unwatch(int fd);
+	int wait(TFTP_EVENT* events, int max_events, int timeout_ms);
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "tftp_server.h"
+#include "tftp_sim.h"
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <vector>
+#include <algorithm>
+
+/*
+ *	Scaling experiments in virtual time
+ *
+ *	Runs the real server against simulated clients (see tftp_sim.h) and
+ *	reports how long the transfers took in virtual time, the memory
+ *	high-water mark and the server's CPU time per transfer.  The server
+ *	takes the same -r/-a/-s/-g specs as TFTPServer.
+ *
+ *	Usage: tftp_simulate [-m model] [-r ratelimits] [-a admission]
+ *	                     [-s sockets] [-g congestion] [-c sessions] [-d]
+ */
+
+using namespace std;
+
+#define SIM_PORT 69
+
+static void usage(){
+	cout << "tftp_simulate [-m model] [-r ratelimits] [-a admission] [-s sockets] [-g congestion]"
+		<< " [-c sessions] [-d]\n"
+		<< "  -m  clients=N,ramp=MS,files=N,size=B,window=N,delay=MS,jitter=MS,loss=P,\n"
+		<< "      rate=B/s,uplink=B/s,timeout=MS,retries=N,seed=N\n"
+		<< "  -c  session slots of the server (default: MAX_CLIENTS)\n";
+}
+
+static double wallSeconds(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]){
+	TFTP_SIM_CONFIG model;
+	TFTP_RATE_LIMITS limits;
+	TFTP_ADMISSION_LIMITS admission;
+	TFTP_SOCKET_POOL_CONFIG socket_pool;
+	TFTP_CONGESTION_CONFIG congestion;
+	int sessions = MAX_CLIENTS;
+	int debug = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "m:r:a:s:g:c:d")) != -1){
+		int bad = 0;
+		switch(opt){
+			case 'm': bad = TFTP_SIM_CONFIG::parse(optarg, &model); break;
+			case 'r': bad = TFTP_RATE_LIMITS::parse(optarg, &limits); break;
+			case 'a': bad = TFTP_ADMISSION_LIMITS::parse(optarg, &admission); break;
+			case 's': bad = TFTP_SOCKET_POOL_CONFIG::parse(optarg, &socket_pool); break;
+			case 'g': bad = TFTP_CONGESTION_CONFIG::parse(optarg, &congestion); break;
+			case 'c': sessions = atoi(optarg); break;
+			case 'd': debug = 1; break;
+			default: usage(); return 1;
+		}
+		if(bad < 0){
+			cerr << "tftp_simulate: Bad spec \"" << optarg << "\"\n";
+			return 1;
+		}
+	}
+
+	/* The clock first: the server stamps its timers from the start */
+	TFTP_SIM sim(model);
+	tftp_set_clock(&sim);
+	TFTP_PRELOAD files;
+	for(int i = 0; i < sim.files(); ++i)
+		files.add(TFTP_SIM::fileName(i).c_str(), sim.data(), sim.fileSize());
+
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double wall = wallSeconds();
+	TFTP_SERVER* server = new TFTP_SERVER(SIM_PORT, (char*)"/nonexistent/", debug, &sim);
+	server->setRateLimits(limits);
+	server->setAdmissionLimits(admission);
+	server->setSocketPool(socket_pool);
+	server->setCongestionControl(congestion);
+	server->setPreload(&files);
+	sim.start(server, SIM_PORT);
+	server->run(sessions);
+	wall = wallSeconds() - wall;
+	getrusage(RUSAGE_SELF, &after);
+
+	double virtual_s = sim.lastFinishNs() / 1e9;	// The server may linger on timeouts after
+	double cpu_s = (after.ru_utime.tv_sec - before.ru_utime.tv_sec + after.ru_stime.tv_sec - before.ru_stime.tv_sec)
+				 + (after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+	vector<uint64_t>& times = sim.completion_ns;
+	sort(times.begin(), times.end());
+	long per = sim.completed ? sim.server_cpu_ns / sim.completed : 0;
+	cout << "clients:     " << model.clients << " (" << sim.completed << " completed, "
+		<< sim.failed << " failed, " << sim.errors << " errors, " << sim.corrupt << " corrupt DATA)\n"
+		<< "virtual:     " << virtual_s << " s (" << sim.elapsedNs() / 1e9 << " s run) in " << wall
+		<< " s wall (" << (wall > 0 ? sim.elapsedNs() / 1e9 / wall : 0) << "x)\n"
+		<< "goodput:     " << (virtual_s > 0 ? sim.completed * (double)sim.fileSize() / virtual_s / 1e6 : 0)
+		<< " MB/s (virtual)\n"
+		<< "concurrency: " << sim.peak_active << " transfers at most\n"
+		<< "network:     " << sim.datagrams << " datagrams, " << sim.dropped << " lost, "
+		<< sim.overflows << " socket overruns, " << sim.unreachable << " unreachable\n"
+		<< "retransmit:  server " << server->retransmits << ", clients " << sim.client_retransmits
+		<< ", duplicates " << server->duplicates << "\n";
+	if(!times.empty()){
+		size_t n = times.size();
+		cout << "completion:  p50 " << times[n / 2] / 1000000.0 << " ms, p90 "
+			<< times[n * 9 / 10] / 1000000.0 << " ms, p99 " << times[n * 99 / 100] / 1000000.0
+			<< " ms, max " << times[n - 1] / 1000000.0 << " ms\n";
+	}
+	cout << "cpu:         server " << sim.server_cpu_ns / 1e6 << " ms (" << per / 1000.0
+		<< " us/transfer), simulator " << sim.sim_cpu_ns / 1e6 << " ms, process " << cpu_s * 1e3 << " ms\n"
+		<< "memory:      max RSS " << after.ru_maxrss / 1024 << " MB, heap peak "
+		<< sim.peak_heap / (1 << 20) << " MB (sampled)\n";
+	delete server;
+	tftp_set_clock(NULL);
+	return sim.failed ? 2 : 0;
+}
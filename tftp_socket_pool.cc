@@ -0,0 +1,143 @@
+#include "tftp_socket_pool.h"
+#include <string.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/*
+ *	Parse "size=N,sndbuf=B,rcvbuf=B,connect=0|1"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_SOCKET_POOL_CONFIG::parse(const char* spec, TFTP_SOCKET_POOL_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "size"))			out->size = atoi(val);
+		else if(!strcmp(tok, "sndbuf"))		out->sndbuf = atoi(val);
+		else if(!strcmp(tok, "rcvbuf"))		out->rcvbuf = atoi(val);
+		else if(!strcmp(tok, "connect"))	out->connect = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->size < 0 || out->sndbuf < 0 || out->rcvbuf < 0) rv = -1;
+	return rv;
+}
+
+/*
+ *	Constructor, the pool starts empty (see refill())
+ *
+ *	@param	t		Transport the sockets are opened through
+ */
+TFTP_SOCKET_POOL::TFTP_SOCKET_POOL(TFTP_TRANSPORT* t){
+	transport = t;
+	reused = created = strays = 0;
+}
+
+/*
+ *	Sets the pool size and socket options; spares past the new size are
+ *	closed, new ones come with the next refill()
+ */
+void TFTP_SOCKET_POOL::setConfig(TFTP_SOCKET_POOL_CONFIG _config){
+	config = _config;
+	while((int)spares.size() > config.size){
+		transport->closeSocket(spares.back());
+		spares.pop_back();
+	}
+}
+
+/*
+ *	A transfer socket ready to use: bound to an ephemeral port, buffers
+ *	sized
+ *
+ *	@return			fd | -1
+ */
+int TFTP_SOCKET_POOL::create(){
+	int fd = transport->openSocket();
+	if(fd < 0) return -1;
+	struct sockaddr_in any;
+	memset(&any, 0, sizeof(any));
+	any.sin_family = AF_INET;
+	any.sin_addr.s_addr = INADDR_ANY;
+	any.sin_port = 0;
+	if(transport->bindSocket(fd, &any) < 0){
+		transport->closeSocket(fd);
+		return -1;
+	}
+	if(config.sndbuf) transport->setSendBuffer(fd, config.sndbuf);
+	if(config.rcvbuf) transport->setReceiveBuffer(fd, config.rcvbuf);
+	++created;
+	return fd;
+}
+
+/*
+ *	Create spares, at most TFTP_SOCKET_POOL_REFILL at a time, while the
+ *	pool is below its size (call it while idle)
+ *
+ *	@return			Spares created
+ */
+int TFTP_SOCKET_POOL::refill(){
+	int n = 0;
+	while((int)spares.size() < config.size && n < TFTP_SOCKET_POOL_REFILL){
+		int fd = create();
+		if(fd < 0) break;
+		spares.push_back(fd);
+		++n;
+	}
+	return n;
+}
+
+/*
+ *	Socket for a new session
+ *
+ *	@param	peer	The client (connected to, if configured)
+ *	@return			fd | -1
+ */
+int TFTP_SOCKET_POOL::acquire(struct sockaddr_in* peer){
+	int fd;
+	if(spares.empty()){
+		if((fd = create()) < 0) return -1;
+	}
+	else{
+		fd = spares.front();
+		spares.pop_front();
+		++reused;
+		/* Whatever the last client sent after its session ended */
+		char stray[4];		// Truncated, the rest of a datagram is discarded with it
+		struct sockaddr_in from;
+		while(transport->recvFrom(fd, stray, sizeof(stray), &from) >= 0) ++strays;
+	}
+	if(config.connect && transport->connectSocket(fd, peer) < 0){
+		transport->closeSocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ *	A session is done with its socket (it must not be watched any more)
+ */
+void TFTP_SOCKET_POOL::release(int fd){
+	if(fd < 0) return;
+	if((int)spares.size() >= config.size ||
+	   (config.connect && transport->connectSocket(fd, NULL) < 0)){
+		transport->closeSocket(fd);
+		return;
+	}
+	spares.push_back(fd);
+}
+
+int TFTP_SOCKET_POOL::count()
+{ return spares.size(); }
+
+/*
+ *	Destructor, closes the spares
+ */
+TFTP_SOCKET_POOL::~TFTP_SOCKET_POOL(){
+	for(size_t i = 0; i < spares.size(); ++i) transport->closeSocket(spares[i]);
+}
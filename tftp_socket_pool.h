@@ -0,0 +1,67 @@
+#ifndef TFTP_SOCKET_POOL_H
+#define TFTP_SOCKET_POOL_H
+
+#include "tftp_transport.h"
+#include <deque>
+
+/*
+ *	Transfer socket pool
+ *
+ *	Every RRQ/WRQ is answered from a socket of its own (its TID).  Instead
+ *	of a socket() per request, an implicit bind on its first send and a
+ *	close() after, sessions take a spare that is already created, bound to
+ *	an ephemeral port and has its buffers sized, and give it back when
+ *	they end.  With `connect` the socket is also connect()ed to the client
+ *	for the session (the kernel then filters other senders itself, so
+ *	strays are dropped instead of answered "Unknown transfer ID").
+ *
+ *	A socket keeps its port across sessions; the one idle longest is
+ *	handed out first, so a port is not reused while its last client may
+ *	still be sending.  What reached it while spare (a late ACK) is read off
+ *	and dropped before it is handed out again.
+ */
+
+#define TFTP_SOCKET_POOL_SIZE	64		// Spares kept
+#define TFTP_SOCKET_POOL_REFILL	8		// Spares created per refill()
+
+struct TFTP_SOCKET_POOL_CONFIG{
+	int size;			// Spares kept, 0 = a socket per session
+	int sndbuf;			// SO_SNDBUF bytes, 0 = kernel default
+	int rcvbuf;			// SO_RCVBUF bytes, 0 = kernel default
+	int connect;		// connect() to the client for the session
+
+	TFTP_SOCKET_POOL_CONFIG(){
+		size = TFTP_SOCKET_POOL_SIZE;
+		sndbuf = rcvbuf = 0;
+		connect = 0;
+	}
+
+	static int parse(const char* spec, TFTP_SOCKET_POOL_CONFIG* out);
+};
+
+class TFTP_SOCKET_POOL{
+private:
+	TFTP_TRANSPORT* transport;
+	TFTP_SOCKET_POOL_CONFIG config;
+	std::deque<int> spares;		// Longest idle first
+
+	int create();
+
+public:
+	/* Counters */
+	long reused;		// Sessions given a spare
+	long created;		// Sockets created (up front or on demand)
+	long strays;		// Datagrams dropped off spares
+
+	TFTP_SOCKET_POOL(TFTP_TRANSPORT* transport);
+
+	void setConfig(TFTP_SOCKET_POOL_CONFIG config);
+	int refill();
+	int acquire(struct sockaddr_in* peer);
+	void release(int fd);
+	int count();
+
+	~TFTP_SOCKET_POOL();
+};
+
+#endif
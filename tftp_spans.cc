@@ -0,0 +1,130 @@
+#include "tftp_spans.h"
+#include "tftp_transport.h"
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mutex>
+
+using namespace std;
+
+TFTP_SPAN_CONFIG TFTP_SPANS::config;
+uint32_t TFTP_SPANS::sessions = 0;
+vector<TFTP_SPAN_RING*> TFTP_SPANS::rings;
+thread_local TFTP_SPAN_RING* TFTP_SPANS::ring = NULL;
+int TFTP_SPANS::enabled = 0;
+volatile sig_atomic_t TFTP_SPANS::dump_requested = 0;
+
+static mutex rings_lock;
+
+static const char* span_names[TFTP_SPAN_NAMES] = {
+	"recv", "request", "open", "read", "write", "send", "wait", "session"
+};
+
+/*
+ *	Parse "out=FILE,sample=N,ring=N"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_SPAN_CONFIG::parse(const char* spec, TFTP_SPAN_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "out"))			out->out = val;
+		else if(!strcmp(tok, "sample"))	out->sample = atoi(val);
+		else if(!strcmp(tok, "ring"))	out->ring = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->out.empty() || out->sample < 1 || out->ring < 1) rv = -1;
+	return rv;
+}
+
+/*
+ *	Turn spans on (before any session starts)
+ */
+void TFTP_SPANS::configure(TFTP_SPAN_CONFIG _config){
+	config = _config;
+	enabled = !config.out.empty();
+}
+
+/*
+ *	Span id for a new session
+ *
+ *	@return			Non-zero for one session in `sample` | 0 (not traced)
+ */
+uint32_t TFTP_SPANS::sample(){
+	if(!enabled) return 0;
+	uint32_t n = ++sessions;
+	if(!n) n = ++sessions;		// 0 means not traced
+	return n % config.sample == 0 ? n : 0;
+}
+
+uint64_t TFTP_SPANS::now()
+{ return tftp_now_ns(); }
+
+/*
+ *	Record a span that started at start_ns and ends now, into this
+ *	thread's ring (overwriting its oldest span when full)
+ */
+void TFTP_SPANS::record(int name, uint32_t session, uint64_t start_ns, int arg){
+	if(!enabled) return;
+	if(!ring){
+		ring = new TFTP_SPAN_RING();
+		ring->spans.resize(config.ring);
+		ring->next = 0;
+		lock_guard<mutex> hold(rings_lock);
+		ring->thread = rings.size() + 1;
+		rings.push_back(ring);
+	}
+	TFTP_SPAN& s = ring->spans[ring->next++ % ring->spans.size()];
+	s.start_ns = start_ns;
+	s.duration_ns = now() - start_ns;
+	s.session = session;
+	s.arg = arg;
+	s.name = name;
+}
+
+/*
+ *	Write every ring to config.out as Chrome trace-event JSON ("X"
+ *	complete events, microseconds).  Each session gets its own track
+ *	(tid = span id), so one transfer reads left to right.  Other threads'
+ *	rings are read as they are: call it from the event loop while they
+ *	are quiet.
+ *
+ *	@return			Spans written | -1 if the file cannot be written
+ */
+int TFTP_SPANS::dump(){
+	dump_requested = 0;
+	if(!enabled) return 0;
+	string tmp = config.out + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "w");
+	if(!f) return -1;
+	int pid = getpid();
+	int written = 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tftpserver\"}}", pid);
+	lock_guard<mutex> hold(rings_lock);
+	for(size_t r = 0; r < rings.size(); ++r){
+		TFTP_SPAN_RING* g = rings[r];
+		size_t size = g->spans.size();
+		size_t first = g->next > size ? g->next - size : 0;
+		for(size_t i = first; i < g->next; ++i){
+			const TFTP_SPAN& s = g->spans[i % size];
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"tftp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+					"\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%d,\"thread\":%d}}",
+					span_names[s.name], s.start_ns / 1000.0, s.duration_ns / 1000.0,
+					pid, s.session, s.arg, g->thread);
+			++written;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0 || rename(tmp.c_str(), config.out.c_str()) < 0) return -1;
+	return written;
+}
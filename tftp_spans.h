@@ -0,0 +1,101 @@
+#ifndef TFTP_SPANS_H
+#define TFTP_SPANS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <signal.h>
+
+/*
+ *	Per-transfer latency spans
+ *
+ *	One session in `sample` is traced: its receive wakeups, request
+ *	handling, file open, block reads and writes, sends and waits for the
+ *	peer are recorded as spans into a ring per thread, and the rings are
+ *	written out as Chrome trace-event JSON (load it in Perfetto or
+ *	chrome://tracing).  Sessions that are not sampled cost one test of
+ *	their span id; with spans off, nothing else.
+ *
+ *	The rings keep the latest spans; a dump (SIGUSR1, and at exit) writes
+ *	what they hold without stopping the server.
+ */
+
+/* Span names */
+#define TFTP_SPAN_RECV		0	// Datagram read off a socket, until its session is known
+#define TFTP_SPAN_REQUEST	1	// RRQ/WRQ handled: parse, open, first answer
+#define TFTP_SPAN_OPEN		2	// File or listing opened (getReadFile(), openListing())
+#define TFTP_SPAN_READ		3	// One block read (createReadPacket())
+#define TFTP_SPAN_WRITE		4	// One block written (writeData())
+#define TFTP_SPAN_SEND		5	// Packet or window handed to the socket/scheduler
+#define TFTP_SPAN_WAIT		6	// Suspended until the peer answered or the timer fired
+#define TFTP_SPAN_SESSION	7	// Whole transfer
+#define TFTP_SPAN_NAMES		8
+
+#define TFTP_SPAN_RING_SIZE	65536	// Spans kept per thread
+
+struct TFTP_SPAN_CONFIG{
+	std::string out;		// JSON file written on dump, "" = spans off
+	int sample;				// Trace one session in this many
+	int ring;				// Spans kept per thread
+
+	TFTP_SPAN_CONFIG(){
+		sample = 1;
+		ring = TFTP_SPAN_RING_SIZE;
+	}
+
+	static int parse(const char* spec, TFTP_SPAN_CONFIG* out);
+};
+
+struct TFTP_SPAN{
+	uint64_t start_ns;		// CLOCK_MONOTONIC
+	uint64_t duration_ns;
+	uint32_t session;		// Span id of the session
+	int32_t arg;			// Block number, wake reason...
+	int name;				// TFTP_SPAN_*
+};
+
+struct TFTP_SPAN_RING{
+	std::vector<TFTP_SPAN> spans;
+	size_t next;			// Total spans recorded, next % size is the slot
+	int thread;
+};
+
+/*
+ *	Span recorder (static: any thread, any module may record)
+ */
+class TFTP_SPANS{
+private:
+	static TFTP_SPAN_CONFIG config;
+	static uint32_t sessions;
+	static std::vector<TFTP_SPAN_RING*> rings;
+	static thread_local TFTP_SPAN_RING* ring;
+
+public:
+	static int enabled;
+	static volatile sig_atomic_t dump_requested;
+
+	static void configure(TFTP_SPAN_CONFIG);
+	static uint32_t sample();
+	static uint64_t now();
+	static void record(int name, uint32_t session, uint64_t start_ns, int arg = 0);
+	static int dump();
+};
+
+/*
+ *	Records a span from construction to destruction (when the session is
+ *	sampled)
+ */
+struct TFTP_SPAN_SCOPE{
+	uint32_t session;
+	uint64_t start;
+	int name;
+	int arg;
+
+	TFTP_SPAN_SCOPE(int _name, uint32_t _session, int _arg = 0)
+	{ name = _name; session = _session; arg = _arg; start = session ? TFTP_SPANS::now() : 0; }
+	~TFTP_SPAN_SCOPE()
+	{ if(session) TFTP_SPANS::record(name, session, start, arg); }
+};
+
+#endif
@@ -0,0 +1,689 @@
+#include "tftp_storage.h"
+#include "tftp_checksum.h"
+#include "tftp_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <algorithm>
+
+using namespace std;
+
+#define TFTP_STORAGE_COPY_CHUNK	(1 << 20)
+#define TFTP_RESUME_XATTR		"user.tftp.resume"	// Note of a suspended upload
+#define TFTP_RESUME_NOTE_MAX	256
+
+/*
+ *	Parses a size with an optional K, M or G suffix (powers of 1024)
+ */
+static int64_t parseSize(const char* s){
+	char* end = NULL;
+	double v = strtod(s, &end);
+	switch(end ? *end : 0){
+		case 'k': case 'K': return (int64_t)(v * (1 << 10));
+		case 'm': case 'M': return (int64_t)(v * (1 << 20));
+		case 'g': case 'G': return (int64_t)(v * (1 << 30));
+	}
+	return (int64_t)v;
+}
+
+static int64_t statNs(const struct stat& s)
+{ return (int64_t)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec; }
+
+static void fillStat(const struct stat& s, TFTP_STAT* st){
+	st->size = s.st_size;
+	st->mtime_ns = statNs(s);
+	st->inode = s.st_ino;
+	st->dir = S_ISDIR(s.st_mode);
+}
+
+static string joinPath(const char* dir, const string& name){
+	string path = dir;
+	if(!path.empty() && path[path.size() - 1] != '/') path += '/';
+	return path + name;
+}
+
+/*
+ *	Parse "type=fs|ram,cache=N,revalidate=MS,limit=B,files=N,load=0|1"
+ *
+ *	@return			0 | -1 on a bad spec
+ */
+int TFTP_STORAGE_CONFIG::parse(const char* spec, TFTP_STORAGE_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "type")){
+			if(!strcmp(val, "fs"))			out->type = TFTP_STORAGE_LOCAL;
+			else if(!strcmp(val, "ram"))	out->type = TFTP_STORAGE_RAM;
+			else{ rv = -1; break; }
+		}
+		else if(!strcmp(tok, "cache"))	out->cache = atoi(val);
+		else if(!strcmp(tok, "revalidate"))	out->revalidate_ms = atoi(val);
+		else if(!strcmp(tok, "limit"))	out->limit = parseSize(val);
+		else if(!strcmp(tok, "files"))	out->files = atol(val);
+		else if(!strcmp(tok, "load"))	out->load = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(out->cache < 0 || out->revalidate_ms < 0 || out->limit < 0 || out->files < 0) rv = -1;
+	return rv;
+}
+
+/*
+ *	Backend for a config
+ *
+ *	@param	rootdir		Copied into a ram backend with load=1
+ *	@return				The backend (owned by the caller) | NULL if loading failed
+ */
+TFTP_STORAGE* TFTP_STORAGE::create(const TFTP_STORAGE_CONFIG& config, const char* rootdir){
+	if(config.type != TFTP_STORAGE_RAM) return new TFTP_LOCAL_STORAGE(config.cache, config.revalidate_ms);
+	TFTP_RAM_STORAGE* ram = new TFTP_RAM_STORAGE(config.limit, config.files);
+	if(config.load){
+		TFTP_LOCAL_STORAGE local;
+		if(ram->load(&local, rootdir) < 0){
+			delete ram;
+			return NULL;
+		}
+	}
+	return ram;
+}
+
+/*
+ *	Local file system
+ *
+ *	@param	_cache			Unused read fds kept open (0 = every reader opens its own)
+ *	@param	_revalidate_ms	How long a cached fd is trusted without a stat()
+ */
+TFTP_LOCAL_STORAGE::TFTP_LOCAL_STORAGE(int _cache, int _revalidate_ms){
+	cache = _cache;
+	revalidate_ms = _revalidate_ms;
+	hits = opens = revalidations = retirements = evictions = 0;
+}
+
+/*
+ *	@return			The cached fd still is the file at its path | 0 (it has been retired)
+ */
+int TFTP_LOCAL_STORAGE::valid(Cached& c){
+	long now = tftp_now_ms();
+	if(now - c.checked_ms < revalidate_ms) return 1;
+	++revalidations;
+	TFTP_STAT now_st;
+	if(stat(c.path.c_str(), &now_st) == 0 && now_st.inode == c.st.inode &&
+	   now_st.mtime_ns == c.st.mtime_ns && now_st.size == c.st.size){
+		c.checked_ms = now;
+		return 1;
+	}
+	++retirements;
+	return 0;
+}
+
+/*
+ *	The path no longer leads to this fd: readers that have it finish on
+ *	it, it is closed after the last one
+ */
+void TFTP_LOCAL_STORAGE::retire(int fd){
+	Cached& c = cached[fd];
+	paths.erase(c.path);
+	c.retired = 1;
+	if(c.refs == 0){
+		idle.erase(c.idle_pos);
+		cached.erase(fd);
+		::close(fd);
+	}
+}
+
+/*
+ *	Close an unused fd
+ */
+void TFTP_LOCAL_STORAGE::drop(int fd){
+	Cached& c = cached[fd];
+	paths.erase(c.path);
+	idle.erase(c.idle_pos);
+	cached.erase(fd);
+	::close(fd);
+}
+
+int TFTP_LOCAL_STORAGE::openRead(const char* path, TFTP_STAT* st){
+	if(cache){
+		unordered_map<string, int>::iterator p = paths.find(path);
+		if(p != paths.end()){
+			int fd = p->second;
+			Cached& c = cached[fd];
+			if(valid(c)){
+				if(c.refs++ == 0) idle.erase(c.idle_pos);
+				if(st) *st = c.st;
+				++hits;
+				return fd;
+			}
+			retire(fd);
+		}
+	}
+	++opens;
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat s;
+	int err = fstat(fd, &s) < 0 ? errno : S_ISDIR(s.st_mode) ? EISDIR : 0;
+	if(err){
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+	if(st) fillStat(s, st);
+	if(cache){
+		Cached& c = cached[fd];
+		c.path = path;
+		fillStat(s, &(c.st));
+		c.refs = 1;
+		c.retired = 0;
+		c.checked_ms = tftp_now_ms();
+		paths[c.path] = fd;
+	}
+	return fd;
+}
+
+int TFTP_LOCAL_STORAGE::pread(int handle, void* buf, int len, int64_t offset){
+	int done = 0;
+	while(done < len){
+		ssize_t n = ::pread(handle, (char*)buf + done, len - done, offset + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		if(n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ *	Uploads are written to "path.part" and renamed over path on commit
+ */
+int TFTP_LOCAL_STORAGE::openWrite(const char* path){
+	string part = string(path) + TFTP_PART_SUFFIX;
+	int fd = ::open(part.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd < 0) return -1;
+	Upload& u = uploads[fd];
+	u.path = path;
+	u.error = 0;
+	return fd;
+}
+
+int TFTP_LOCAL_STORAGE::pwrite(int handle, const void* buf, int len, int64_t offset){
+	unordered_map<int, Upload>::iterator u = uploads.find(handle);
+	if(u == uploads.end()){
+		errno = EBADF;
+		return -1;
+	}
+	int done = 0;
+	while(done < len){
+		ssize_t n = ::pwrite(handle, (const char*)buf + done, len - done, offset + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0){
+			if(n == 0) errno = ENOSPC;
+			if(!u->second.error) u->second.error = errno;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/*
+ *	@return			0 | -1 (errno of a failed write, close or rename; the upload is dropped)
+ */
+int TFTP_LOCAL_STORAGE::commit(int handle){
+	unordered_map<int, Upload>::iterator u = uploads.find(handle);
+	if(u == uploads.end()){
+		errno = EBADF;
+		return -1;
+	}
+	string path = u->second.path;
+	string part = path + TFTP_PART_SUFFIX;
+	int err = u->second.error;
+	uploads.erase(u);
+	if(::close(handle) < 0 && !err) err = errno;
+	if(!err && rename(part.c_str(), path.c_str()) < 0) err = errno;
+	if(err){
+		unlink(part.c_str());
+		errno = err;
+		return -1;
+	}
+	/* Readers from now on get the new file */
+	unordered_map<string, int>::iterator p = paths.find(path);
+	if(p != paths.end()){
+		++retirements;
+		retire(p->second);
+	}
+	return 0;
+}
+
+int TFTP_LOCAL_STORAGE::abort(int handle){
+	unordered_map<int, Upload>::iterator u = uploads.find(handle);
+	if(u == uploads.end()){
+		errno = EBADF;
+		return -1;
+	}
+	string part = u->second.path + TFTP_PART_SUFFIX;
+	uploads.erase(u);
+	::close(handle);
+	unlink(part.c_str());
+	return 0;
+}
+
+/*
+ *	A suspended upload is its "path.part", left in place; the note goes in
+ *	an extended attribute (lost where they are not supported)
+ */
+int TFTP_LOCAL_STORAGE::suspend(int handle, const string& note){
+	unordered_map<int, Upload>::iterator u = uploads.find(handle);
+	if(u == uploads.end()){
+		errno = EBADF;
+		return -1;
+	}
+	if(u->second.error){
+		int err = u->second.error;
+		abort(handle);
+		errno = err;
+		return -1;
+	}
+	uploads.erase(u);
+	fsetxattr(handle, TFTP_RESUME_XATTR, note.data(), note.size(), 0);
+	return ::close(handle);
+}
+
+int TFTP_LOCAL_STORAGE::openResume(const char* path, int64_t offset, int64_t* kept, string* note){
+	string part = string(path) + TFTP_PART_SUFFIX;
+	int fd = ::open(part.c_str(), O_RDWR | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat st;
+	int err = fstat(fd, &st) < 0 ? errno : S_ISREG(st.st_mode) ? 0 : EISDIR;
+	if(!err){
+		*kept = st.st_size;
+		if(st.st_size < offset) err = ERANGE;
+		else if(st.st_size > offset && ftruncate(fd, offset) < 0) err = errno;
+	}
+	if(err){
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+	char buf[TFTP_RESUME_NOTE_MAX];
+	ssize_t n = fgetxattr(fd, TFTP_RESUME_XATTR, buf, sizeof(buf));
+	note->assign(buf, n > 0 ? n : 0);
+	Upload& u = uploads[fd];
+	u.path = path;
+	u.error = 0;
+	return fd;
+}
+
+/*
+ *	A shared fd stays open for the next reader, unless the cache is full
+ *	(the oldest unused one goes) or it has been retired
+ */
+int TFTP_LOCAL_STORAGE::close(int handle){
+	unordered_map<int, Cached>::iterator i = cached.find(handle);
+	if(i == cached.end()) return ::close(handle);
+	Cached& c = i->second;
+	if(--c.refs > 0) return 0;
+	if(c.retired){
+		cached.erase(i);
+		return ::close(handle);
+	}
+	idle.push_back(handle);
+	c.idle_pos = --idle.end();
+	while((int)idle.size() > cache){
+		++evictions;
+		drop(idle.front());
+	}
+	return 0;
+}
+
+int TFTP_LOCAL_STORAGE::makeParents(const char* path){
+	string dir(path);
+	for(size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1)){
+		dir[slash] = 0;
+		if(mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) return -1;
+		dir[slash] = '/';
+	}
+	return 0;
+}
+
+int TFTP_LOCAL_STORAGE::stat(const char* path, TFTP_STAT* st){
+	struct stat s;
+	if(::stat(path, &s) < 0) return -1;
+	fillStat(s, st);
+	return 0;
+}
+
+/*
+ *	Entries of dir in directory order, hidden ones ("." first) left out
+ */
+int TFTP_LOCAL_STORAGE::list(const char* dir, vector<TFTP_DIR_ENTRY>* entries){
+	DIR* dirp = opendir(dir);
+	if(!dirp) return -1;
+	struct dirent* e;
+	while((e = readdir(dirp))){
+		if(e->d_name[0] == '.') continue;
+		struct stat s;
+		if(fstatat(dirfd(dirp), e->d_name, &s, 0) < 0) continue;
+		TFTP_DIR_ENTRY entry;
+		entry.name = e->d_name;
+		fillStat(s, &(entry.st));
+		entries->push_back(entry);
+	}
+	closedir(dirp);
+	return 0;
+}
+
+/*
+ *	Destructor, unfinished uploads are dropped
+ */
+TFTP_LOCAL_STORAGE::~TFTP_LOCAL_STORAGE(){
+	while(!uploads.empty()) abort(uploads.begin()->first);
+	for(unordered_map<int, Cached>::iterator i = cached.begin(); i != cached.end(); ++i)
+		::close(i->first);
+}
+
+/*
+ *	In memory
+ *
+ *	@param	_limit		Bytes stored and staged at most, 0 = no limit
+ *	@param	_max_files	Files at most, 0 = no limit
+ */
+TFTP_RAM_STORAGE::TFTP_RAM_STORAGE(int64_t _limit, long _max_files){
+	limit = _limit;
+	max_files = _max_files;
+	next_serial = 1;
+	bytes = peak_bytes = 0;
+}
+
+/*
+ *	Copy a directory tree in from another backend
+ *
+ *	@return			Files copied | -1 (a file could not be read or the limits were hit)
+ */
+int TFTP_RAM_STORAGE::load(TFTP_STORAGE* from, const char* dir){
+	vector<TFTP_DIR_ENTRY> entries;
+	if(from->list(dir, &entries) < 0) return -1;
+	int copied = 0;
+	vector<char> chunk(TFTP_STORAGE_COPY_CHUNK);
+	for(size_t i = 0; i < entries.size(); ++i){
+		string path = joinPath(dir, entries[i].name);
+		if(entries[i].st.dir){
+			int n = load(from, path.c_str());
+			if(n < 0) return -1;
+			copied += n;
+			continue;
+		}
+		int in = from->openRead(path.c_str(), NULL);
+		if(in < 0) return -1;
+		int out = openWrite(path.c_str());
+		int n = 0;
+		int64_t off = 0;
+		while(out >= 0 && (n = from->pread(in, &chunk[0], chunk.size(), off)) > 0){
+			if(pwrite(out, &chunk[0], n, off) < 0) break;
+			off += n;
+		}
+		from->close(in);
+		if(out < 0) return -1;
+		if(n != 0){
+			abort(out);
+			return -1;
+		}
+		if(commit(out) < 0) return -1;
+		++copied;
+	}
+	return copied;
+}
+
+TFTP_RAM_STORAGE::Handle* TFTP_RAM_STORAGE::handleOf(int handle, int writing){
+	if(handle < 0 || handle >= (int)handles.size() || !handles[handle].open ||
+	   handles[handle].writing != writing){
+		errno = EBADF;
+		return NULL;
+	}
+	return &handles[handle];
+}
+
+int TFTP_RAM_STORAGE::newHandle(){
+	int handle;
+	if(free_handles.empty()){
+		handle = handles.size();
+		handles.push_back(Handle());
+	}
+	else{
+		handle = free_handles.back();
+		free_handles.pop_back();
+	}
+	Handle& h = handles[handle];
+	h.open = 1;
+	h.error = 0;
+	return handle;
+}
+
+int TFTP_RAM_STORAGE::release(int handle){
+	Handle& h = handles[handle];
+	bytes -= h.staged.size();
+	h.open = 0;
+	h.data.reset();
+	h.path.clear();
+	string().swap(h.staged);
+	free_handles.push_back(handle);
+	return 0;
+}
+
+int TFTP_RAM_STORAGE::openRead(const char* path, TFTP_STAT* st){
+	map<string, File>::iterator f = files.find(path);
+	if(f == files.end()){
+		TFTP_STAT dir;
+		errno = stat(path, &dir) == 0 ? EISDIR : ENOENT;
+		return -1;
+	}
+	int handle = newHandle();
+	Handle& h = handles[handle];
+	h.writing = 0;
+	h.data = f->second.data;
+	if(st){
+		st->size = f->second.data->size();
+		st->mtime_ns = f->second.mtime_ns;
+		st->inode = f->second.serial;
+		st->dir = 0;
+	}
+	return handle;
+}
+
+int TFTP_RAM_STORAGE::pread(int handle, void* buf, int len, int64_t offset){
+	Handle* h = handleOf(handle, 0);
+	if(!h && !(h = handleOf(handle, 1))) return -1;
+	const string& data = h->writing ? h->staged : *(h->data);
+	if(offset >= (int64_t)data.size() || len <= 0) return 0;
+	int n = (int)min((int64_t)len, (int64_t)data.size() - offset);
+	memcpy(buf, data.data() + offset, n);
+	return n;
+}
+
+/*
+ *	A new upload replaces a suspended one of the same path
+ */
+int TFTP_RAM_STORAGE::openWrite(const char* path){
+	map<string, Suspended>::iterator s = suspended.find(path);
+	if(s != suspended.end()){
+		bytes -= s->second.staged.size();
+		suspended.erase(s);
+	}
+	int handle = newHandle();
+	Handle& h = handles[handle];
+	h.writing = 1;
+	h.path = path;
+	return handle;
+}
+
+/*
+ *	@return			len | -1 (ENOSPC past the byte limit; the upload fails on commit)
+ */
+int TFTP_RAM_STORAGE::pwrite(int handle, const void* buf, int len, int64_t offset){
+	Handle* h = handleOf(handle, 1);
+	if(!h) return -1;
+	if(len <= 0) return 0;
+	int64_t end = offset + len;
+	int64_t grow = max((int64_t)0, end - (int64_t)h->staged.size());
+	if(limit && bytes + grow > limit){
+		if(!h->error) h->error = ENOSPC;
+		errno = ENOSPC;
+		return -1;
+	}
+	if(grow){
+		h->staged.resize(end);
+		bytes += grow;
+		peak_bytes = max(peak_bytes, bytes);
+	}
+	memcpy(&(h->staged[offset]), buf, len);
+	return len;
+}
+
+int TFTP_RAM_STORAGE::commit(int handle){
+	Handle* h = handleOf(handle, 1);
+	if(!h) return -1;
+	map<string, File>::iterator f = files.find(h->path);
+	int err = h->error;
+	if(!err && f == files.end() && max_files && (long)files.size() >= max_files) err = ENOSPC;
+	if(err){
+		release(handle);
+		errno = err;
+		return -1;
+	}
+	if(f == files.end()) f = files.insert(make_pair(h->path, File())).first;
+	else bytes -= f->second.data->size();
+	shared_ptr<string> data = make_shared<string>();
+	data->swap(h->staged);
+	f->second.data = data;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	f->second.mtime_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	f->second.serial = next_serial++;
+	release(handle);	// The staged bytes are counted as stored now
+	return 0;
+}
+
+int TFTP_RAM_STORAGE::abort(int handle){
+	if(!handleOf(handle, 1)) return -1;
+	return release(handle);
+}
+
+/*
+ *	The staged bytes stay counted against the limit while suspended
+ */
+int TFTP_RAM_STORAGE::suspend(int handle, const string& note){
+	Handle* h = handleOf(handle, 1);
+	if(!h) return -1;
+	if(h->error){
+		int err = h->error;
+		release(handle);
+		errno = err;
+		return -1;
+	}
+	Suspended& s = suspended[h->path];
+	bytes -= s.staged.size();	// An older one of the path
+	s.staged.swap(h->staged);
+	string().swap(h->staged);
+	s.note = note;
+	return release(handle);
+}
+
+int TFTP_RAM_STORAGE::openResume(const char* path, int64_t offset, int64_t* kept, string* note){
+	map<string, Suspended>::iterator s = suspended.find(path);
+	if(s == suspended.end()){
+		errno = ENOENT;
+		return -1;
+	}
+	*kept = s->second.staged.size();
+	if(*kept < offset){
+		errno = ERANGE;
+		return -1;
+	}
+	int handle = newHandle();
+	Handle& h = handles[handle];
+	h.writing = 1;
+	h.path = path;
+	h.staged.swap(s->second.staged);
+	bytes -= *kept - offset;
+	h.staged.resize(offset);
+	*note = s->second.note;
+	suspended.erase(s);
+	return handle;
+}
+
+int TFTP_RAM_STORAGE::close(int handle){
+	if(!handleOf(handle, 0)) return -1;
+	return release(handle);
+}
+
+/*
+ *	A directory exists while some file is under it
+ */
+int TFTP_RAM_STORAGE::stat(const char* path, TFTP_STAT* st){
+	map<string, File>::iterator f = files.find(path);
+	if(f != files.end()){
+		st->size = f->second.data->size();
+		st->mtime_ns = f->second.mtime_ns;
+		st->inode = f->second.serial;
+		st->dir = 0;
+		return 0;
+	}
+	string prefix = joinPath(path, "");
+	f = files.lower_bound(prefix);
+	if(f == files.end() || f->first.compare(0, prefix.size(), prefix) != 0){
+		errno = ENOENT;
+		return -1;
+	}
+	st->size = 0;
+	st->mtime_ns = 0;
+	st->inode = 0;
+	st->dir = 1;
+	return 0;
+}
+
+/*
+ *	Entries of dir in name order, hidden ones left out
+ */
+int TFTP_RAM_STORAGE::list(const char* dir, vector<TFTP_DIR_ENTRY>* entries){
+	string prefix = joinPath(dir, "");
+	map<string, File>::iterator f = files.lower_bound(prefix);
+	if(f == files.end() || f->first.compare(0, prefix.size(), prefix) != 0){
+		errno = ENOENT;
+		return -1;
+	}
+	/* Everything under dir/ sorts together, a subdirectory's files too */
+	string last_dir;
+	for(; f != files.end() && f->first.compare(0, prefix.size(), prefix) == 0; ++f){
+		string rest = f->first.substr(prefix.size());
+		size_t slash = rest.find('/');
+		if(rest.empty() || rest[0] == '.') continue;
+		TFTP_DIR_ENTRY entry;
+		if(slash != string::npos){
+			entry.name = rest.substr(0, slash);
+			if(entry.name == last_dir) continue;
+			last_dir = entry.name;
+			entry.st.size = entry.st.mtime_ns = 0;
+			entry.st.inode = 0;
+			entry.st.dir = 1;
+		}
+		else{
+			entry.name = rest;
+			entry.st.size = f->second.data->size();
+			entry.st.mtime_ns = f->second.mtime_ns;
+			entry.st.inode = f->second.serial;
+			entry.st.dir = 0;
+		}
+		entries->push_back(entry);
+	}
+	return 0;
+}
@@ -0,0 +1,246 @@
+#ifndef TFTP_STORAGE_H
+#define TFTP_STORAGE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+/*
+ *	Where served files come from and uploads go
+ *
+ *	Paths are the server's (rootdir + requested name).  Files are read by
+ *	handle at explicit offsets, so a handle carries no position.  Writes
+ *	go to a staging copy that appears under its path on commit(), whole,
+ *	or is dropped by abort(); until then readers see the old file.  An
+ *	upload cut short can be kept instead (suspend()) and continued later
+ *	(openResume()).  Failures return -1 with errno set (ENOENT, ENOSPC, ...).
+ *
+ *	Backends:
+ *		local	the file system (fds, uploads staged as "path.part"); read-only
+ *				fds are shared by every reader of a file and kept open
+ *				after the last one, see TFTP_LOCAL_STORAGE
+ *		ram		files in memory, with optional byte and file limits; readers
+ *				keep the version they opened if it is replaced
+ *
+ *	Neither is thread-safe: a storage belongs to one server thread.
+ */
+
+#define TFTP_STORAGE_LOCAL	0
+#define TFTP_STORAGE_RAM	1
+
+#define TFTP_FD_CACHE_IDLE			1024	// Unused fds kept open
+#define TFTP_FD_CACHE_REVALIDATE	1000	// ms a cached fd is trusted without a stat()
+
+struct TFTP_STORAGE_CONFIG{
+	int type;			// TFTP_STORAGE_*
+	int cache;			// local: unused read fds kept open, 0 = no sharing or caching
+	int revalidate_ms;	// local: how stale a cached fd may be (0 = stat() on every open)
+	int64_t limit;		// ram: bytes stored (and being uploaded) at most, 0 = no limit
+	long files;			// ram: files at most, 0 = no limit
+	int load;			// ram: copy rootdir in at startup
+
+	TFTP_STORAGE_CONFIG(){
+		type = TFTP_STORAGE_LOCAL;
+		cache = TFTP_FD_CACHE_IDLE;
+		revalidate_ms = TFTP_FD_CACHE_REVALIDATE;
+		limit = 0;
+		files = 0;
+		load = 0;
+	}
+
+	static int parse(const char* spec, TFTP_STORAGE_CONFIG* out);
+};
+
+struct TFTP_STAT{
+	int64_t size;
+	int64_t mtime_ns;
+	uint64_t inode;		// Identity of this version of the file (ram: a serial)
+	int dir;
+};
+
+struct TFTP_DIR_ENTRY{
+	std::string name;
+	TFTP_STAT st;
+};
+
+class TFTP_STORAGE{
+public:
+	/*
+	 *	@param	st		Filled with the file's size and identity (NULL = not wanted)
+	 *	@return			Handle | -1 (EISDIR for a directory)
+	 */
+	virtual int openRead(const char* path, TFTP_STAT* st) = 0;
+	virtual int pread(int handle, void* buf, int len, int64_t offset) = 0;
+
+	/* Staged write of path; commit() publishes it, abort() drops it.
+	   pread() on a write handle reads the staged bytes. */
+	virtual int openWrite(const char* path) = 0;
+	virtual int pwrite(int handle, const void* buf, int len, int64_t offset) = 0;
+	virtual int commit(int handle) = 0;
+	virtual int abort(int handle) = 0;
+
+	/*
+	 *	Close a write handle keeping the staged bytes, with a note for
+	 *	whoever resumes them (dropped instead if a write failed)
+	 */
+	virtual int suspend(int handle, const std::string& note) = 0;
+
+	/*
+	 *	Continue a suspended upload of path, cut to offset bytes
+	 *
+	 *	@param	kept	Set to the bytes it had (on ERANGE too)
+	 *	@param	note	Set to its note ("" if lost)
+	 *	@return			Write handle | -1 (ENOENT: none kept, ERANGE: shorter than offset)
+	 */
+	virtual int openResume(const char* path, int64_t offset, int64_t* kept, std::string* note) = 0;
+
+	/* Read handles */
+	virtual int close(int handle) = 0;
+
+	/* Create the missing directories leading to path (for files put there
+	   by the server itself, e.g. an edge cache) */
+	virtual int makeParents(const char* path)
+	{ return 0; }
+
+	virtual int stat(const char* path, TFTP_STAT* st) = 0;
+	virtual int list(const char* dir, std::vector<TFTP_DIR_ENTRY>* entries) = 0;
+
+	static TFTP_STORAGE* create(const TFTP_STORAGE_CONFIG& config, const char* rootdir);
+
+	virtual ~TFTP_STORAGE(){}
+};
+
+/*
+ *	The file system: handles are fds
+ *
+ *	Read-only fds are shared: every reader of a path gets the same fd (the
+ *	reads are positional) and it stays open, up to `cache` unused ones in
+ *	LRU order, after the last reader closes it.  A hot file costs no
+ *	open()/close() and fd usage is bounded by the files in use plus the
+ *	cache.  A cached fd is trusted for revalidate_ms, then checked with a
+ *	stat() against the inode, mtime and size it was opened with; a file
+ *	that changed (or an upload committed here) retires the fd: new readers
+ *	get a new one, current readers finish on the old version.
+ */
+class TFTP_LOCAL_STORAGE : public TFTP_STORAGE{
+private:
+	struct Upload{
+		std::string path;
+		int error;			// errno of the first failed write, 0 = none
+	};
+
+	struct Cached{
+		std::string path;
+		TFTP_STAT st;
+		int refs;
+		int retired;		// No longer found by path, closed with the last reader
+		long checked_ms;	// tftp_now_ms() of the last validation
+		std::list<int>::iterator idle_pos;	// In idle while refs == 0
+	};
+
+	std::unordered_map<int, Upload> uploads;	// By fd
+	std::unordered_map<int, Cached> cached;		// By fd
+	std::unordered_map<std::string, int> paths;	// Path -> fd of its current version
+	std::list<int> idle;						// Unused cached fds, oldest first
+	int cache;
+	int revalidate_ms;
+
+	int valid(Cached& c);
+	void retire(int fd);
+	void drop(int fd);
+
+public:
+	/* Counters */
+	long hits;			// openRead() served by a shared fd
+	long opens;			// open() calls for reading
+	long revalidations;
+	long retirements;	// Fds retired because their file changed
+	long evictions;		// Unused fds closed for room
+
+	TFTP_LOCAL_STORAGE(int cache = TFTP_FD_CACHE_IDLE, int revalidate_ms = TFTP_FD_CACHE_REVALIDATE);
+
+	long openFds()
+	{ return cached.size(); }
+
+	int openRead(const char* path, TFTP_STAT* st);
+	int pread(int handle, void* buf, int len, int64_t offset);
+	int openWrite(const char* path);
+	int pwrite(int handle, const void* buf, int len, int64_t offset);
+	int commit(int handle);
+	int abort(int handle);
+	int suspend(int handle, const std::string& note);
+	int openResume(const char* path, int64_t offset, int64_t* kept, std::string* note);
+	int close(int handle);
+	int makeParents(const char* path);
+	int stat(const char* path, TFTP_STAT* st);
+	int list(const char* dir, std::vector<TFTP_DIR_ENTRY>* entries);
+
+	~TFTP_LOCAL_STORAGE();
+};
+
+/*
+ *	Files in memory, keyed by path; directories are implied by the paths
+ */
+class TFTP_RAM_STORAGE : public TFTP_STORAGE{
+private:
+	struct File{
+		std::shared_ptr<const std::string> data;
+		int64_t mtime_ns;
+		uint64_t serial;
+	};
+
+	struct Handle{
+		int open;
+		int writing;
+		std::shared_ptr<const std::string> data;	// Reading
+		std::string path;							// Writing
+		std::string staged;
+		int error;
+	};
+
+	struct Suspended{
+		std::string staged;
+		std::string note;
+	};
+
+	std::map<std::string, File> files;
+	std::map<std::string, Suspended> suspended;		// Uploads kept for resume, by path
+	std::vector<Handle> handles;
+	std::vector<int> free_handles;
+	int64_t limit;
+	long max_files;
+	uint64_t next_serial;
+
+	Handle* handleOf(int handle, int writing);
+	int newHandle();
+	int release(int handle);
+
+public:
+	/* Usage */
+	int64_t bytes;			// Stored plus staged (suspended uploads too)
+	int64_t peak_bytes;
+
+	TFTP_RAM_STORAGE(int64_t limit = 0, long max_files = 0);
+
+	int load(TFTP_STORAGE* from, const char* dir);
+	long count()
+	{ return files.size(); }
+
+	int openRead(const char* path, TFTP_STAT* st);
+	int pread(int handle, void* buf, int len, int64_t offset);
+	int openWrite(const char* path);
+	int pwrite(int handle, const void* buf, int len, int64_t offset);
+	int commit(int handle);
+	int abort(int handle);
+	int suspend(int handle, const std::string& note);
+	int openResume(const char* path, int64_t offset, int64_t* kept, std::string* note);
+	int close(int handle);
+	int stat(const char* path, TFTP_STAT* st);
+	int list(const char* dir, std::vector<TFTP_DIR_ENTRY>* entries);
+};
+
+#endif
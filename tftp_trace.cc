@@ -0,0 +1,244 @@
+#include "tftp_trace.h"
+#include "tftp_packet.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+static uint64_t nowUs(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ *	Constructor
+ *
+ *	@param	inner		Transport that actually moves the datagrams
+ *	@param	own_inner	Delete inner with this transport
+ */
+TFTP_TRACE_TRANSPORT::TFTP_TRACE_TRANSPORT(TFTP_TRANSPORT* _inner, int _own_inner){
+	inner = _inner;
+	own_inner = _own_inner;
+	trace_fd = -1;
+	last_flush = tftp_now_ms();
+	records = bytes = write_errors = 0;
+	buffer.reserve(TFTP_TRACE_BUFFER + sizeof(TFTP_TRACE_RECORD) + 65536);
+}
+
+/*
+ *	Start writing the trace
+ *
+ *	@param	path		Trace file
+ *	@param	append		Add to an existing trace (a restarted server) instead of truncating it
+ *	@return				0 | -1 if it cannot be created
+ */
+int TFTP_TRACE_TRANSPORT::open(const char* path, int append){
+	trace_fd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+	if(trace_fd < 0) return -1;
+	struct stat st;
+	if(fstat(trace_fd, &st) == 0 && st.st_size > 0) return 0;
+	TFTP_TRACE_HEADER h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TFTP_TRACE_MAGIC, sizeof(h.magic));
+	h.start_us = nowUs(CLOCK_REALTIME);
+	buffer.insert(buffer.end(), (const char*)&h, (const char*)&h + sizeof(h));
+	return flush();
+}
+
+/*
+ *	Port an fd is bound to, looked up once (an unbound socket gets one on
+ *	its first send)
+ */
+uint16_t TFTP_TRACE_TRANSPORT::localPort(int fd){
+	if(fd < 0) return 0;
+	if((size_t)fd >= ports.size()) ports.resize(fd + 1, 0);
+	if(!ports[fd]){
+		struct sockaddr_in a;
+		socklen_t len = sizeof(a);
+		if(getsockname(fd, (struct sockaddr*)&a, &len) == 0) ports[fd] = ntohs(a.sin_port);
+	}
+	return ports[fd];
+}
+
+/*
+ *	Buffer one record, written out once TFTP_TRACE_BUFFER has filled up
+ */
+void TFTP_TRACE_TRANSPORT::record(int direction, int fd, const void* buf, int len,
+								  struct sockaddr_in* peer){
+	if(trace_fd < 0) return;
+	TFTP_TRACE_RECORD r;
+	memset(&r, 0, sizeof(r));
+	r.time_us = nowUs(CLOCK_MONOTONIC);
+	if(peer){
+		r.peer_addr = peer->sin_addr.s_addr;
+		r.peer_port = peer->sin_port;
+	}
+	r.local_port = localPort(fd);
+	r.wire_length = len;
+	if(direction == TFTP_TRACE_OUT && TFTP_TRACE_DATA_SNAP >= 0 && len > TFTP_TRACE_DATA_SNAP &&
+	   ((const unsigned char*)buf)[1] == TFTP_OPCODE_DATA && ((const unsigned char*)buf)[0] == 0)
+		len = TFTP_TRACE_DATA_SNAP;
+	r.length = len;
+	r.direction = direction;
+	buffer.insert(buffer.end(), (const char*)&r, (const char*)&r + sizeof(r));
+	if(len > 0) buffer.insert(buffer.end(), (const char*)buf, (const char*)buf + len);
+	++records;
+	if(buffer.size() >= TFTP_TRACE_BUFFER) flush();
+}
+
+/*
+ *	Write what is buffered; one write() of whole records, so processes
+ *	appending to the same trace never split each other's records
+ *
+ *	@return			0 | -1
+ */
+int TFTP_TRACE_TRANSPORT::flush(){
+	last_flush = tftp_now_ms();
+	if(buffer.empty() || trace_fd < 0) return 0;
+	ssize_t n = write(trace_fd, &buffer[0], buffer.size());
+	if(n != (ssize_t)buffer.size()){
+		++write_errors;
+		buffer.clear();
+		return -1;
+	}
+	bytes += n;
+	buffer.clear();
+	return 0;
+}
+
+int TFTP_TRACE_TRANSPORT::openSocket()
+{ return inner->openSocket(); }
+
+/*
+ *	Only a bind to a given port is recorded: a TID socket bound to port 0
+ *	up front (a pooled one) is not a listener
+ */
+int TFTP_TRACE_TRANSPORT::bindSocket(int fd, struct sockaddr_in* addr){
+	int rv = inner->bindSocket(fd, addr);
+	if(rv == 0 && addr->sin_port) record(TFTP_TRACE_BIND, fd, NULL, 0, NULL);
+	return rv;
+}
+
+int TFTP_TRACE_TRANSPORT::closeSocket(int fd){
+	if(fd >= 0 && (size_t)fd < ports.size()) ports[fd] = 0;
+	return inner->closeSocket(fd);
+}
+
+int TFTP_TRACE_TRANSPORT::setReceiveBuffer(int fd, int bytes)
+{ return inner->setReceiveBuffer(fd, bytes); }
+
+int TFTP_TRACE_TRANSPORT::setSendBuffer(int fd, int bytes)
+{ return inner->setSendBuffer(fd, bytes); }
+
+int TFTP_TRACE_TRANSPORT::connectSocket(int fd, struct sockaddr_in* to)
+{ return inner->connectSocket(fd, to); }
+
+int TFTP_TRACE_TRANSPORT::sendTo(int fd, const void* buf, int len, struct sockaddr_in* to){
+	int rv = inner->sendTo(fd, buf, len, to);
+	if(rv >= 0) record(TFTP_TRACE_OUT, fd, buf, len, to);
+	return rv;
+}
+
+int TFTP_TRACE_TRANSPORT::recvFrom(int fd, void* buf, int len, struct sockaddr_in* from){
+	int rv = inner->recvFrom(fd, buf, len, from);
+	if(rv >= 0) record(TFTP_TRACE_IN, fd, buf, rv, from);
+	return rv;
+}
+
+int TFTP_TRACE_TRANSPORT::setTxTime(int fd)
+{ return inner->setTxTime(fd); }
+
+int TFTP_TRACE_TRANSPORT::sendToAt(int fd, const void* buf, int len, struct sockaddr_in* to,
+								   long txtime_ns){
+	int rv = inner->sendToAt(fd, buf, len, to, txtime_ns);
+	if(rv >= 0) record(TFTP_TRACE_OUT, fd, buf, len, to);
+	return rv;
+}
+
+/*
+ *	One record per datagram, as the peer sees them
+ */
+int TFTP_TRACE_TRANSPORT::sendSegments(int fd, const void* buf, int len, int segment,
+									   struct sockaddr_in* to){
+	int rv = inner->sendSegments(fd, buf, len, segment, to);
+	if(rv < 0) return rv;
+	for(int off = 0; off < len; off += segment)
+		record(TFTP_TRACE_OUT, fd, (const char*)buf + off, min(segment, len - off), to);
+	return rv;
+}
+
+int TFTP_TRACE_TRANSPORT::watch(int fd, void* tag)
+{ return inner->watch(fd, tag); }
+
+int TFTP_TRACE_TRANSPORT::unwatch(int fd)
+{ return inner->unwatch(fd); }
+
+/*
+ *	Writes the buffer out when the server goes idle for a while, so a
+ *	quiet server's trace is never more than TFTP_TRACE_FLUSH_MS behind
+ */
+int TFTP_TRACE_TRANSPORT::wait(TFTP_EVENT* events, int max_events, int timeout_ms){
+	if(!buffer.empty() && tftp_now_ms() - last_flush >= TFTP_TRACE_FLUSH_MS) flush();
+	if(!buffer.empty() && (timeout_ms < 0 || timeout_ms > TFTP_TRACE_FLUSH_MS))
+		timeout_ms = TFTP_TRACE_FLUSH_MS;
+	return inner->wait(events, max_events, timeout_ms);
+}
+
+/*
+ *	Destructor, writes what is left
+ */
+TFTP_TRACE_TRANSPORT::~TFTP_TRACE_TRANSPORT(){
+	flush();
+	if(trace_fd >= 0) close(trace_fd);
+	if(own_inner) delete inner;
+}
+
+struct EntryOrder{
+	bool operator()(const TFTP_TRACE_ENTRY& a, const TFTP_TRACE_ENTRY& b) const
+	{ return a.r.time_us < b.r.time_us; }
+};
+
+/*
+ *	Read a whole trace; a record cut short at the end is ignored
+ *
+ *	@return			Records read | -1 if the file is not a trace
+ */
+int TFTP_TRACE::open(const char* path){
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(TFTP_TRACE_HEADER)){
+		close(fd);
+		return -1;
+	}
+	data.resize(st.st_size);
+	size_t got = 0;
+	while(got < data.size()){
+		ssize_t n = read(fd, &data[got], data.size() - got);
+		if(n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	memcpy(&header, &data[0], sizeof(header));
+	if(got < data.size() || memcmp(header.magic, TFTP_TRACE_MAGIC, sizeof(header.magic)) != 0)
+		return -1;
+	entries.clear();
+	size_t off = sizeof(TFTP_TRACE_HEADER);
+	while(off + sizeof(TFTP_TRACE_RECORD) <= data.size()){
+		TFTP_TRACE_ENTRY e;
+		memcpy(&e.r, &data[off], sizeof(e.r));
+		off += sizeof(e.r);
+		if(off + e.r.length > data.size()) break;
+		e.payload = &data[off];
+		off += e.r.length;
+		entries.push_back(e);
+	}
+	/* Appended by more than one process (restart): put the time line back together */
+	stable_sort(entries.begin(), entries.end(), EntryOrder());
+	return entries.size();
+}
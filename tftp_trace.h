@@ -0,0 +1,123 @@
+#ifndef TFTP_TRACE_H
+#define TFTP_TRACE_H
+
+#include "tftp_transport.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ *	Packet trace capture
+ *
+ *	TFTP_TRACE_TRANSPORT wraps the server's transport and appends every
+ *	datagram it receives or sends (listener and TIDs alike) to a trace
+ *	file.  DATA the server sends is cut to its header (TFTP_TRACE_DATA_SNAP):
+ *	the file is on the server already, and the trace stays small enough to
+ *	leave on under load.  Records are buffered and written in whole records,
+ *	so a trace cut short by a crash is still readable up to its last write.
+ *	tftp_replay re-drives a server from a trace.
+ *
+ *	Layout (host byte order, addresses and peer ports as on the wire):
+ *		TFTP_TRACE_HEADER
+ *		TFTP_TRACE_RECORD, payload		repeated
+ *
+ *	Times are CLOCK_MONOTONIC, so the old and new process of a restart
+ *	can append to the same trace and stay on one time line.
+ */
+
+#define TFTP_TRACE_MAGIC	"TFTPTRC1"
+
+#define TFTP_TRACE_IN		0	// Received by the server
+#define TFTP_TRACE_OUT		1	// Sent by the server
+#define TFTP_TRACE_BIND		2	// Socket bound to a port (the listener), no payload
+
+#define TFTP_TRACE_DATA_SNAP	4	// Bytes kept of each DATA sent (opcode and block), -1 = all
+
+#define TFTP_TRACE_BUFFER	(256 << 10)	// Bytes buffered before a write()
+#define TFTP_TRACE_FLUSH_MS	1000		// Written at least this often while idle
+
+struct TFTP_TRACE_HEADER{
+	char magic[8];
+	uint64_t start_us;		// Wall clock (CLOCK_REALTIME) when the capture began
+};
+
+struct TFTP_TRACE_RECORD{
+	uint64_t time_us;		// CLOCK_MONOTONIC
+	uint32_t peer_addr;
+	uint16_t peer_port;
+	uint16_t local_port;	// Server side: the listener or the session's TID
+	uint16_t length;		// Payload bytes that follow
+	uint16_t wire_length;	// Size of the datagram (more than length if snapped)
+	uint8_t direction;		// TFTP_TRACE_*
+	uint8_t reserved[3];
+};
+
+/*
+ *	Records every datagram through another transport into a trace file
+ */
+class TFTP_TRACE_TRANSPORT : public TFTP_TRANSPORT{
+private:
+	TFTP_TRANSPORT* inner;
+	int own_inner;
+	int trace_fd;
+	std::vector<char> buffer;
+	std::vector<uint16_t> ports;	// Local port by fd, 0 = not looked up yet
+	long last_flush;
+
+	uint16_t localPort(int fd);
+	void record(int direction, int fd, const void* buf, int len, struct sockaddr_in* peer);
+	int flush();
+
+public:
+	/* Counters */
+	long records;
+	long bytes;
+	long write_errors;
+
+	TFTP_TRACE_TRANSPORT(TFTP_TRANSPORT* inner, int own_inner = 1);
+
+	int open(const char* path, int append = 0);
+
+	int openSocket();
+	int bindSocket(int fd, struct sockaddr_in* addr);
+	int closeSocket(int fd);
+	int setReceiveBuffer(int fd, int bytes);
+	int setSendBuffer(int fd, int bytes);
+	int connectSocket(int fd, struct sockaddr_in* to);
+
+	int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to);
+	int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from);
+
+	int setTxTime(int fd);
+	int sendToAt(int fd, const void* buf, int len, struct sockaddr_in* to, long txtime_ns);
+	int sendSegments(int fd, const void* buf, int len, int segment, struct sockaddr_in* to);
+
+	int watch(int fd, void* tag);
+	int unwatch(int fd);
+	int wait(TFTP_EVENT* events, int max_events, int timeout_ms);
+	int pollFd()
+	{ return inner->pollFd(); }
+
+	~TFTP_TRACE_TRANSPORT();
+};
+
+struct TFTP_TRACE_ENTRY{
+	TFTP_TRACE_RECORD r;
+	const char* payload;
+};
+
+/*
+ *	A trace read back into memory, records in time order
+ */
+class TFTP_TRACE{
+private:
+	std::vector<char> data;
+
+public:
+	TFTP_TRACE_HEADER header;
+	std::vector<TFTP_TRACE_ENTRY> entries;
+
+	int open(const char* path);
+};
+
+#endif
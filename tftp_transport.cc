@@ -0,0 +1,442 @@
+
+#include "tftp_transport.h"
+#include <sys/epoll.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace std;
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103		// linux/udp.h, older libc headers lack it
+#endif
+
+static TFTP_CLOCK* installed_clock = NULL;
+
+/*
+ *	Replace the monotonic clock (NULL puts it back); install it before
+ *	the server is created, every timestamp it keeps must come from it
+ */
+void tftp_set_clock(TFTP_CLOCK* clock)
+{ installed_clock = clock; }
+
+/*
+ *	Monotonic clock in nanoseconds
+ */
+uint64_t tftp_now_ns(){
+	if(installed_clock) return installed_clock->nowNs();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *	Monotonic clock in milliseconds
+ */
+long tftp_now_ms()
+{ return tftp_now_ns() / 1000000ULL; }
+
+/*
+ *	Constructor
+ */
+TFTP_SOCKET_TRANSPORT::TFTP_SOCKET_TRANSPORT(){
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	gso = 1;
+	gso_sends = 0;
+}
+
+int TFTP_SOCKET_TRANSPORT::openSocket()
+{ return socket(AF_INET, SOCK_DGRAM, 0); }
+
+int TFTP_SOCKET_TRANSPORT::bindSocket(int fd, struct sockaddr_in* addr)
+{ return bind(fd, (struct sockaddr*)addr, sizeof(struct sockaddr_in)); }
+
+/*
+ *	Closing an fd removes it from the epoll set as well
+ */
+int TFTP_SOCKET_TRANSPORT::closeSocket(int fd)
+{ return close(fd); }
+
+/*
+ *	SO_RCVBUFFORCE when privileged, else SO_RCVBUF (capped by rmem_max)
+ */
+int TFTP_SOCKET_TRANSPORT::setReceiveBuffer(int fd, int bytes){
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == 0) return 0;
+	return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+/*
+ *	SO_SNDBUFFORCE when privileged, else SO_SNDBUF (capped by wmem_max)
+ */
+int TFTP_SOCKET_TRANSPORT::setSendBuffer(int fd, int bytes){
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bytes, sizeof(bytes)) == 0) return 0;
+	return setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+}
+
+/*
+ *	connect() the socket to one peer: the kernel then drops datagrams from
+ *	anyone else and keeps the route.  AF_UNSPEC undoes it.
+ */
+int TFTP_SOCKET_TRANSPORT::connectSocket(int fd, struct sockaddr_in* to){
+	struct sockaddr_in none;
+	if(!to){
+		memset(&none, 0, sizeof(none));
+		none.sin_family = AF_UNSPEC;
+		to = &none;
+	}
+	return connect(fd, (struct sockaddr*)to, sizeof(struct sockaddr_in));
+}
+
+int TFTP_SOCKET_TRANSPORT::sendTo(int fd, const void* buf, int len, struct sockaddr_in* to){
+	return sendto(fd, buf, len, 0, (struct sockaddr*)to, sizeof(struct sockaddr_in));
+}
+
+/*
+ *	Never blocks: callers read what wait() reported, an empty queue is
+ *	-1 with EAGAIN
+ */
+int TFTP_SOCKET_TRANSPORT::recvFrom(int fd, void* buf, int len, struct sockaddr_in* from){
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	return recvfrom(fd, buf, len, MSG_DONTWAIT, (struct sockaddr*)from, &addrlen);
+}
+
+/*
+ *	Turn on SO_TXTIME for fd (needs the fq qdisc on the egress device to
+ *	actually hold packets until their departure time)
+ *
+ *	@return			0 | -1 if the kernel doesn't support it
+ */
+int TFTP_SOCKET_TRANSPORT::setTxTime(int fd){
+#ifdef SO_TXTIME
+	struct sock_txtime cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.clockid = CLOCK_MONOTONIC;
+	return setsockopt(fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg));
+#else
+	return -1;
+#endif
+}
+
+/*
+ *	sendTo() with an SCM_TXTIME departure time
+ *
+ *	@param	txtime_ns	CLOCK_MONOTONIC departure time
+ */
+int TFTP_SOCKET_TRANSPORT::sendToAt(int fd, const void* buf, int len, struct sockaddr_in* to,
+									long txtime_ns){
+#ifdef SO_TXTIME
+	struct iovec iov;
+	iov.iov_base = (void*)buf;
+	iov.iov_len = len;
+	char control[CMSG_SPACE(sizeof(uint64_t))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = to;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+	uint64_t t = txtime_ns;
+	memcpy(CMSG_DATA(cm), &t, sizeof(t));
+	return sendmsg(fd, &msg, 0);
+#else
+	return sendTo(fd, buf, len, to);
+#endif
+}
+
+/*
+ *	Send buf as datagrams of `segment` bytes with a single sendmsg() and
+ *	UDP_SEGMENT, letting the kernel (or NIC) split it.  Falls back to one
+ *	sendto() per datagram, for good, if the kernel refuses it.
+ *
+ *	@param	segment		Size of every datagram but the last
+ *	@return				len | -1 on error
+ */
+int TFTP_SOCKET_TRANSPORT::sendSegments(int fd, const void* buf, int len, int segment,
+										struct sockaddr_in* to){
+	if(gso && len > segment && (len + segment - 1) / segment <= TFTP_GSO_MAX_SEGMENTS){
+		struct iovec iov;
+		iov.iov_base = (void*)buf;
+		iov.iov_len = len;
+		char control[CMSG_SPACE(sizeof(uint16_t))];
+		memset(control, 0, sizeof(control));
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = to;
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t size = segment;
+		memcpy(CMSG_DATA(cm), &size, sizeof(size));
+		int n = sendmsg(fd, &msg, 0);
+		if(n >= 0){
+			++gso_sends;
+			return n;
+		}
+		if(errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP && errno != EIO)
+			return -1;
+		gso = 0;	// Kernel without UDP GSO
+	}
+	return TFTP_TRANSPORT::sendSegments(fd, buf, len, segment, to);
+}
+
+/*
+ *	Start reporting readability of fd
+ *
+ *	@param	fd		Socket
+ *	@param	tag		Returned with the fd from wait()
+ *	@return			0 | -1 on error
+ */
+int TFTP_SOCKET_TRANSPORT::watch(int fd, void* tag){
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = tag;
+	if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == 0) return 0;
+	if(errno != EEXIST) return -1;
+	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int TFTP_SOCKET_TRANSPORT::unwatch(int fd)
+{ return epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL); }
+
+/*
+ *	Wait for watched fds to become readable
+ *
+ *	@param	events		Filled with the tags of the ready fds
+ *	@param	max_events	Size of events
+ *	@param	timeout_ms	-1 = forever
+ *	@return				-1 - Error | 0 - Timeout | >0 - # of events
+ */
+int TFTP_SOCKET_TRANSPORT::wait(TFTP_EVENT* events, int max_events, int timeout_ms){
+	struct epoll_event evs[TFTP_TRANSPORT_MAX_EVENTS];
+	if(max_events > TFTP_TRANSPORT_MAX_EVENTS) max_events = TFTP_TRANSPORT_MAX_EVENTS;
+	int n = epoll_wait(epollfd, evs, max_events, timeout_ms);
+	for(int i = 0; i < n; ++i)
+		events[i].tag = evs[i].data.ptr;
+	return n;
+}
+
+/*
+ *	Destructor
+ */
+TFTP_SOCKET_TRANSPORT::~TFTP_SOCKET_TRANSPORT()
+{ if(epollfd >= 0) close(epollfd); }
+
+/*
+ *	Parse an impairment spec, e.g. "loss=0.02,delay=40,jitter=5,dup=0.01,reorder=0.01,seed=7"
+ *
+ *	@param	spec	Comma separated key=value list
+ *	@param	out		Settings to fill in (untouched keys keep their value)
+ *	@return			0 | -1 on an unknown key
+ */
+int TFTP_IMPAIRMENT::parse(const char* spec, TFTP_IMPAIRMENT* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "loss"))			out->loss = atof(val);
+		else if(!strcmp(tok, "dup"))		out->duplicate = atof(val);
+		else if(!strcmp(tok, "reorder"))	out->reorder = atof(val);
+		else if(!strcmp(tok, "delay"))		out->delay_ms = atoi(val);
+		else if(!strcmp(tok, "jitter"))		out->jitter_ms = atoi(val);
+		else if(!strcmp(tok, "reorder_ms"))	out->reorder_ms = atoi(val);
+		else if(!strcmp(tok, "seed"))		out->seed = strtoull(val, NULL, 0);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	return rv;
+}
+
+/*
+ *	Constructor
+ *
+ *	@param	inner		Transport that actually moves the datagrams
+ *	@param	cfg			Impairment settings
+ *	@param	own_inner	Delete inner with this transport
+ */
+TFTP_IMPAIRED_TRANSPORT::TFTP_IMPAIRED_TRANSPORT(TFTP_TRANSPORT* _inner, TFTP_IMPAIRMENT _cfg,
+												 int _own_inner){
+	inner = _inner;
+	own_inner = _own_inner;
+	config = _cfg;
+	rng = config.seed ? config.seed : 0x9e3779b97f4a7c15ULL;
+	seq = 0;
+	sent = dropped = duplicated = reordered = delayed = 0;
+}
+
+/*
+ *	xorshift64*, uniform in [0,1)
+ */
+double TFTP_IMPAIRED_TRANSPORT::random(){
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct HeldOrder{
+	template<typename T>
+	bool operator()(const T& a, const T& b) const
+	{ return a.due_ms != b.due_ms ? a.due_ms > b.due_ms : a.seq > b.seq; }
+};
+
+void TFTP_IMPAIRED_TRANSPORT::hold(int fd, const void* buf, int len, struct sockaddr_in* to,
+								   long due_ms){
+	Held h;
+	h.due_ms = due_ms;
+	h.seq = seq++;
+	h.fd = fd;
+	h.to = *to;
+	h.data.assign((const char*)buf, (const char*)buf + len);
+	held.push_back(h);
+	push_heap(held.begin(), held.end(), HeldOrder());
+}
+
+/*
+ *	Send every held datagram that is due
+ *
+ *	@return			Time until the next one is due (ms) | -1 if none held
+ */
+int TFTP_IMPAIRED_TRANSPORT::flush(long now_ms){
+	while(!held.empty() && held.front().due_ms <= now_ms){
+		pop_heap(held.begin(), held.end(), HeldOrder());
+		Held& h = held.back();
+		int fd = h.fd;
+		inner->sendTo(fd, &h.data[0], h.data.size(), &h.to);
+		held.pop_back();
+		vector<int>::iterator c = find(closing.begin(), closing.end(), fd);
+		if(c == closing.end()) continue;
+		size_t i = 0;
+		while(i < held.size() && held[i].fd != fd) ++i;
+		if(i == held.size()){
+			closing.erase(c);
+			inner->closeSocket(fd);
+		}
+	}
+	return held.empty() ? -1 : (int)(held.front().due_ms - now_ms);
+}
+
+int TFTP_IMPAIRED_TRANSPORT::openSocket()
+{ return inner->openSocket(); }
+
+int TFTP_IMPAIRED_TRANSPORT::bindSocket(int fd, struct sockaddr_in* addr)
+{ return inner->bindSocket(fd, addr); }
+
+int TFTP_IMPAIRED_TRANSPORT::setReceiveBuffer(int fd, int bytes)
+{ return inner->setReceiveBuffer(fd, bytes); }
+
+int TFTP_IMPAIRED_TRANSPORT::setSendBuffer(int fd, int bytes)
+{ return inner->setSendBuffer(fd, bytes); }
+
+int TFTP_IMPAIRED_TRANSPORT::connectSocket(int fd, struct sockaddr_in* to)
+{ return inner->connectSocket(fd, to); }
+
+/*
+ *	Like a kernel socket, datagrams already "sent" still go out after close:
+ *	the real close is deferred until nothing is held for the fd
+ */
+int TFTP_IMPAIRED_TRANSPORT::closeSocket(int fd){
+	for(size_t i = 0; i < held.size(); ++i)
+		if(held[i].fd == fd){
+			inner->unwatch(fd);
+			closing.push_back(fd);
+			return 0;
+		}
+	return inner->closeSocket(fd);
+}
+
+/*
+ *	Send a datagram through the impairment model
+ *
+ *	@return			len as if it were sent (drops are silent, like the network)
+ */
+int TFTP_IMPAIRED_TRANSPORT::sendTo(int fd, const void* buf, int len, struct sockaddr_in* to){
+	++sent;
+	long now = tftp_now_ms();
+	flush(now);
+	if(config.loss > 0 && random() < config.loss){
+		++dropped;
+		return len;
+	}
+	int copies = 1;
+	if(config.duplicate > 0 && random() < config.duplicate){
+		++duplicated;
+		copies = 2;
+	}
+	for(int c = 0; c < copies; ++c){
+		long delay = config.delay_ms;
+		if(config.jitter_ms > 0)
+			delay += (long)(random() * (2 * config.jitter_ms + 1)) - config.jitter_ms;
+		if(config.reorder > 0 && random() < config.reorder){
+			++reordered;
+			delay += config.reorder_ms;
+		}
+		if(delay <= 0){
+			if(inner->sendTo(fd, buf, len, to) < 0) return -1;
+			continue;
+		}
+		++delayed;
+		hold(fd, buf, len, to, now + delay);
+	}
+	return len;
+}
+
+int TFTP_IMPAIRED_TRANSPORT::recvFrom(int fd, void* buf, int len, struct sockaddr_in* from)
+{ return inner->recvFrom(fd, buf, len, from); }
+
+int TFTP_IMPAIRED_TRANSPORT::watch(int fd, void* tag)
+{ return inner->watch(fd, tag); }
+
+int TFTP_IMPAIRED_TRANSPORT::unwatch(int fd)
+{ return inner->unwatch(fd); }
+
+/*
+ *	Waits no longer than the next held datagram is due, then releases it
+ */
+int TFTP_IMPAIRED_TRANSPORT::wait(TFTP_EVENT* events, int max_events, int timeout_ms){
+	long start = tftp_now_ms();
+	long deadline = timeout_ms < 0 ? -1 : start + timeout_ms;
+	while(true){
+		long now = tftp_now_ms();
+		int next = flush(now);
+		int t = timeout_ms < 0 ? -1 : (int)max(0L, deadline - now);
+		if(next >= 0 && (t < 0 || next < t)) t = next;
+		int n = inner->wait(events, max_events, t);
+		if(n != 0) return n;
+		if(deadline >= 0 && tftp_now_ms() >= deadline){
+			flush(tftp_now_ms());
+			return 0;
+		}
+	}
+}
+
+/*
+ *	Destructor, held datagrams are dropped
+ */
+TFTP_IMPAIRED_TRANSPORT::~TFTP_IMPAIRED_TRANSPORT(){
+	for(size_t i = 0; i < closing.size(); ++i)
+		inner->closeSocket(closing[i]);
+	if(own_inner) delete inner;
+}
@@ -0,0 +1,202 @@
+#ifndef TFTP_TRANSPORT_H
+#define TFTP_TRANSPORT_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ *	Datagram transport used by the server (and tools) for every socket
+ *	operation, so the network can be swapped out or impaired in-process.
+ *
+ *	Sockets are plain fds.  Readiness is reported through watch()/wait():
+ *	wait() hands back the tag each ready fd was registered with.
+ */
+
+#define TFTP_TRANSPORT_MAX_EVENTS	64
+#define TFTP_GSO_MAX_SEGMENTS		64	// Per sendSegments() call (kernel's UDP_MAX_SEGMENTS)
+
+struct TFTP_EVENT{
+	void* tag;
+};
+
+class TFTP_TRANSPORT{
+public:
+	virtual int openSocket() = 0;
+	virtual int bindSocket(int fd, struct sockaddr_in* addr) = 0;
+	virtual int closeSocket(int fd) = 0;
+
+	/* Kernel receive queue of fd, for listeners that take bursts */
+	virtual int setReceiveBuffer(int fd, int bytes)
+	{ return -1; }
+	virtual int setSendBuffer(int fd, int bytes)
+	{ return -1; }
+
+	/* Fix the peer of fd (to = NULL dissolves it); transports without
+	   connected sockets keep taking any peer */
+	virtual int connectSocket(int fd, struct sockaddr_in* to)
+	{ return -1; }
+
+	virtual int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to) = 0;
+	virtual int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from) = 0;
+
+	/* Departure times (SO_TXTIME); transports without them send immediately */
+	virtual int setTxTime(int fd)
+	{ return -1; }
+	virtual int sendToAt(int fd, const void* buf, int len, struct sockaddr_in* to, long txtime_ns)
+	{ return sendTo(fd, buf, len, to); }
+
+	/* Send buf as consecutive datagrams of `segment` bytes (the last may be
+	   shorter); the kernel transport does it in one call with UDP GSO */
+	virtual int sendSegments(int fd, const void* buf, int len, int segment, struct sockaddr_in* to){
+		for(int off = 0; off < len; off += segment){
+			int n = len - off < segment ? len - off : segment;
+			if(sendTo(fd, (const char*)buf + off, n, to) < 0) return -1;
+		}
+		return len;
+	}
+
+	virtual int watch(int fd, void* tag) = 0;
+	virtual int unwatch(int fd) = 0;
+	virtual int wait(TFTP_EVENT* events, int max_events, int timeout_ms) = 0;
+
+	/* An fd that polls readable when wait() has events, for a host's event
+	   loop; -1 when there is none and wait() must be called on a timer */
+	virtual int pollFd()
+	{ return -1; }
+
+	virtual ~TFTP_TRANSPORT(){}
+};
+
+/*
+ *	Kernel UDP sockets, readiness through epoll
+ */
+class TFTP_SOCKET_TRANSPORT : public TFTP_TRANSPORT{
+private:
+	int epollfd;
+	int gso;			// UDP_SEGMENT still believed to work
+
+public:
+	TFTP_SOCKET_TRANSPORT();
+
+	int openSocket();
+	int bindSocket(int fd, struct sockaddr_in* addr);
+	int closeSocket(int fd);
+	int setReceiveBuffer(int fd, int bytes);
+	int setSendBuffer(int fd, int bytes);
+	int connectSocket(int fd, struct sockaddr_in* to);
+
+	int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to);
+	int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from);
+
+	int setTxTime(int fd);
+	int sendToAt(int fd, const void* buf, int len, struct sockaddr_in* to, long txtime_ns);
+	int sendSegments(int fd, const void* buf, int len, int segment, struct sockaddr_in* to);
+
+	int watch(int fd, void* tag);
+	int unwatch(int fd);
+	int wait(TFTP_EVENT* events, int max_events, int timeout_ms);
+	int pollFd()
+	{ return epollfd; }
+
+	/* Counters */
+	long gso_sends;		// sendmsg() calls carrying several datagrams
+
+	~TFTP_SOCKET_TRANSPORT();
+};
+
+/*
+ *	Impairment settings, all applied to outgoing datagrams
+ *	(impair both ends to impair both directions)
+ */
+struct TFTP_IMPAIRMENT{
+	double loss;		// Probability a datagram is dropped
+	double duplicate;	// Probability a datagram is sent twice
+	double reorder;		// Probability a datagram is held back by reorder_ms
+	int delay_ms;		// Fixed one-way delay
+	int jitter_ms;		// Uniform +/- jitter on top of the delay
+	int reorder_ms;		// Extra hold time of reordered datagrams
+	uint64_t seed;		// PRNG seed, same seed => same decisions
+
+	TFTP_IMPAIRMENT(){
+		loss = duplicate = reorder = 0;
+		delay_ms = jitter_ms = 0;
+		reorder_ms = 10;
+		seed = 1;
+	}
+
+	static int parse(const char* spec, TFTP_IMPAIRMENT* out);
+};
+
+/*
+ *	Wraps another transport and drops, delays, duplicates and reorders
+ *	what is sent through it.  Held datagrams are released from wait().
+ */
+class TFTP_IMPAIRED_TRANSPORT : public TFTP_TRANSPORT{
+private:
+	struct Held{
+		long due_ms;
+		long seq;
+		int fd;
+		struct sockaddr_in to;
+		std::vector<char> data;
+	};
+
+	TFTP_TRANSPORT* inner;
+	int own_inner;
+	TFTP_IMPAIRMENT config;
+	uint64_t rng;
+	long seq;
+	std::vector<Held> held;		// Min-heap on (due_ms, seq)
+	std::vector<int> closing;	// Closed by the caller, still has held datagrams
+
+	double random();
+	void hold(int fd, const void* buf, int len, struct sockaddr_in* to, long due_ms);
+	int flush(long now_ms);
+
+public:
+	/* Counters */
+	long sent;
+	long dropped;
+	long duplicated;
+	long reordered;
+	long delayed;
+
+	TFTP_IMPAIRED_TRANSPORT(TFTP_TRANSPORT* inner, TFTP_IMPAIRMENT cfg, int own_inner = 1);
+
+	int openSocket();
+	int bindSocket(int fd, struct sockaddr_in* addr);
+	int closeSocket(int fd);
+	int setReceiveBuffer(int fd, int bytes);
+	int setSendBuffer(int fd, int bytes);
+	int connectSocket(int fd, struct sockaddr_in* to);
+
+	int sendTo(int fd, const void* buf, int len, struct sockaddr_in* to);
+	int recvFrom(int fd, void* buf, int len, struct sockaddr_in* from);
+
+	int watch(int fd, void* tag);
+	int unwatch(int fd);
+	int wait(TFTP_EVENT* events, int max_events, int timeout_ms);
+
+	~TFTP_IMPAIRED_TRANSPORT();
+};
+
+/*
+ *	Time source of the server and its parts (timers, pacing, admission,
+ *	spans).  The monotonic clock unless another one is installed, e.g.
+ *	the simulator's virtual time (see tftp_sim.h).
+ */
+class TFTP_CLOCK{
+public:
+	virtual uint64_t nowNs() = 0;
+
+	virtual ~TFTP_CLOCK(){}
+};
+
+void tftp_set_clock(TFTP_CLOCK* clock);
+uint64_t tftp_now_ns();
+long tftp_now_ms();
+
+#endif
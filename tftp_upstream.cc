@@ -0,0 +1,34 @@
+#include "tftp_upstream.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ *	Parses "host=IP,port=N,window=N,revalidate=MS"
+ *
+ *	@return			0 | -1 on a bad spec (no host, unknown key or value out of range)
+ */
+int TFTP_UPSTREAM_CONFIG::parse(const char* spec, TFTP_UPSTREAM_CONFIG* out){
+	char* copy = strdup(spec);
+	char* save = NULL;
+	int rv = 0, host = 0, port = TFTP_UPSTREAM_PORT;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char* eq = strchr(tok, '=');
+		if(!eq){ rv = -1; break; }
+		*eq = 0;
+		const char* val = eq + 1;
+		if(!strcmp(tok, "host")){
+			if(!inet_aton(val, &(out->address.sin_addr))){ rv = -1; break; }
+			host = 1;
+		}
+		else if(!strcmp(tok, "port"))		port = atoi(val);
+		else if(!strcmp(tok, "window"))		out->window = atoi(val);
+		else if(!strcmp(tok, "revalidate"))	out->revalidate_ms = atoi(val);
+		else{ rv = -1; break; }
+	}
+	free(copy);
+	if(!host || port < 1 || port > 65535 || out->window < 1 || out->window > 64 ||
+	   out->revalidate_ms < 0) rv = -1;
+	if(rv == 0) out->address.sin_port = htons(port);
+	return rv;
+}
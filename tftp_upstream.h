@@ -0,0 +1,86 @@
+#ifndef TFTP_UPSTREAM_H
+#define TFTP_UPSTREAM_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ *	Edge mode: rootdir is a cache of an upstream TFTP server
+ *
+ *	An RRQ for a file that is not cached is fetched from the upstream (an
+ *	RRQ of our own, ACKed block by block, or window by window with
+ *	windowsize) into the storage, and the client is served from the copy
+ *	as it fills: it does not wait for the whole file.  Every RRQ for the
+ *	same file that comes in meanwhile follows the same fetch, so a boot
+ *	storm costs the WAN one transfer.
+ *
+ *	A cached file is trusted for `revalidate` ms after it was fetched or
+ *	checked.  After that the next RRQ checks it: the fetch asks for tsize
+ *	(RFC 2349), and if the upstream's size is the cached one the fetch is
+ *	called off after the OACK and the copy is served.  If the size differs,
+ *	or the upstream cannot tell (no OACK), the file is fetched again.  An
+ *	upstream that fails or does not answer leaves the cached copy in use.
+ *
+ *	TFTP carries no modification time: a file that changes but keeps its
+ *	size is only noticed if it is removed from the cache.  The size is
+ *	only as fresh as the upstream's answer: when this server is the
+ *	upstream, its fs storage trusts an open file for its own revalidate
+ *	ms (TFTP_FD_CACHE_REVALIDATE by default) and may report the old size
+ *	that long after a change.  A copy is thus stale for at most
+ *	`revalidate` plus the upstream's own staleness.
+ */
+
+#define TFTP_UPSTREAM_PORT			69
+#define TFTP_UPSTREAM_WINDOW		16		// windowsize asked of the upstream
+#define TFTP_UPSTREAM_REVALIDATE	10000	// ms a cached file is trusted without asking
+
+struct TFTP_UPSTREAM_CONFIG{
+	struct sockaddr_in address;		// sin_port 0 = edge mode off
+	int window;			// windowsize to ask for, 1 = lock-step
+	int revalidate_ms;	// 0 = check on every RRQ
+
+	TFTP_UPSTREAM_CONFIG(){
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = 0;
+		window = TFTP_UPSTREAM_WINDOW;
+		revalidate_ms = TFTP_UPSTREAM_REVALIDATE;
+	}
+
+	int enabled() const
+	{ return address.sin_port != 0; }
+
+	static int parse(const char* spec, TFTP_UPSTREAM_CONFIG* out);
+};
+
+#define FETCH_STORED	0	// The upstream's file is in the cache now
+#define FETCH_CURRENT	1	// The cached copy has the upstream's size
+#define FETCH_FAILED	2
+
+struct Client;
+
+/*
+ *	One file being fetched, and the RRQ sessions served from it
+ */
+struct TFTP_FETCH{
+	std::string path;		// rootdir + name
+	std::string name;		// As asked of the upstream
+	Client* session;		// Talking to the upstream
+	int64_t cached;			// Size of the cached copy being revalidated, -1 = none
+	int handle;				// Storage write handle being filled, -1 until the data starts
+	int64_t size;			// Bytes in it so far
+	int64_t total;			// tsize the upstream announced, -1 = unknown
+	std::vector<Client*> followers;
+
+	TFTP_FETCH(){
+		session = NULL;
+		cached = -1;
+		handle = -1;
+		size = 0;
+		total = -1;
+	}
+};
+
+#endif
@@ -0,0 +1,213 @@
+
+#include "tftp_virtual.h"
+#include "tftp_transport.h"
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+/*
+ *	Constructor
+ */
+TFTP_VIRTUAL::TFTP_VIRTUAL()
+{ rendered = 0; }
+
+/*
+ *	Split text into literal and variable segments
+ *
+ *	@param	text	Pattern or template
+ *	@param	open	Variable opener: "{" (patterns) or "${" (templates)
+ *	@param	out		Compiled segments
+ *	@return			0 | -1 on an unterminated variable
+ */
+int TFTP_VIRTUAL::compile(const string& text, const char* open, vector<TFTP_TEMPLATE_SEGMENT>* out){
+	size_t olen = strlen(open);
+	size_t pos = 0;
+	while(pos < text.size()){
+		size_t v = text.find(open, pos);
+		TFTP_TEMPLATE_SEGMENT lit;
+		lit.var = 0;
+		lit.text = text.substr(pos, v == string::npos ? string::npos : v - pos);
+		if(!lit.text.empty()) out->push_back(lit);
+		if(v == string::npos) break;
+		size_t end = text.find('}', v + olen);
+		if(end == string::npos) return -1;
+		TFTP_TEMPLATE_SEGMENT var;
+		var.var = 1;
+		var.text = text.substr(v + olen, end - v - olen);
+		size_t bar = var.text.find('|');
+		if(bar != string::npos){
+			var.fallback = var.text.substr(bar + 1);
+			var.text.erase(bar);
+		}
+		if(var.text.empty()) return -1;
+		out->push_back(var);
+		pos = end + 1;
+	}
+	return 0;
+}
+
+/*
+ *	Match name against pattern[seg..]; a capture takes one or more
+ *	characters of a single path component
+ *
+ *	@return			1 on a match (captures filled in) | 0
+ */
+int TFTP_VIRTUAL::match(const vector<TFTP_TEMPLATE_SEGMENT>& pattern, size_t seg,
+						const char* name, map<string, string>* captures){
+	if(seg == pattern.size()) return *name == 0;
+	const TFTP_TEMPLATE_SEGMENT& s = pattern[seg];
+	if(!s.var){
+		if(strncmp(name, s.text.c_str(), s.text.size())) return 0;
+		return match(pattern, seg + 1, name + s.text.size(), captures);
+	}
+	for(size_t len = 1; name[len - 1] && name[len - 1] != '/'; ++len){
+		if(match(pattern, seg + 1, name + len, captures)){
+			(*captures)[s.text] = string(name, len);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *	(Re)read a provider's key=value data file if it changed
+ *
+ *	@return			0 | -1 if it can't be read
+ */
+int TFTP_VIRTUAL::loadData(TFTP_VIRTUAL_PROVIDER* p){
+	if(p->data_file.empty()) return 0;
+	p->data_checked = tftp_now_ms();
+	struct stat st;
+	if(stat(p->data_file.c_str(), &st) < 0) return -1;
+	long mtime = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+	if(mtime == p->data_mtime) return 0;
+	ifstream in(p->data_file.c_str());
+	if(!in.is_open()) return -1;
+	map<string, string> data;
+	string line;
+	while(getline(in, line)){
+		if(line.empty() || line[0] == '#') continue;
+		size_t eq = line.find('=');
+		if(eq == string::npos) continue;
+		string key = line.substr(0, eq);
+		string val = line.substr(eq + 1);
+		while(!key.empty() && (key[key.size() - 1] == ' ' || key[key.size() - 1] == '\t')) key.erase(key.size() - 1);
+		size_t b = val.find_first_not_of(" \t");
+		val = (b == string::npos) ? "" : val.substr(b);
+		if(!val.empty() && val[val.size() - 1] == '\r') val.erase(val.size() - 1);
+		data[key] = val;
+	}
+	p->data.swap(data);
+	p->data_mtime = mtime;
+	return 0;
+}
+
+/*
+ *	Resolves path relative to the directory of base
+ */
+static string relativeTo(const char* base, const string& path){
+	if(path.empty() || path[0] == '/') return path;
+	const char* slash = strrchr(base, '/');
+	if(!slash) return path;
+	return string(base, slash + 1 - base) + path;
+}
+
+/*
+ *	Load the providers from a config file (see tftp_virtual.h)
+ *
+ *	@param	config		Config file; relative paths in it are relative to it
+ *	@return				# of providers | -1 on error
+ */
+int TFTP_VIRTUAL::load(const char* config){
+	ifstream in(config);
+	if(!in.is_open()) return -1;
+	string line;
+	while(getline(in, line)){
+		size_t hash = line.find('#');
+		if(hash != string::npos) line.erase(hash);
+		istringstream fields(line);
+		string pattern, tmpl, data;
+		if(!(fields >> pattern)) continue;
+		if(!(fields >> tmpl)) return -1;
+		fields >> data;
+
+		TFTP_VIRTUAL_PROVIDER p;
+		while(!pattern.empty() && pattern[0] == '/') pattern.erase(0, 1);
+		ifstream t(relativeTo(config, tmpl).c_str(), ios::binary);
+		if(!t.is_open()) return -1;
+		stringstream body;
+		body << t.rdbuf();
+		if(compile(pattern, "{", &p.pattern) < 0 || compile(body.str(), "${", &p.body) < 0) return -1;
+		p.data_file = data.empty() ? "" : relativeTo(config, data);
+		p.data_mtime = 0;
+		p.data_checked = 0;
+		if(loadData(&p) < 0) return -1;
+		providers.push_back(p);
+	}
+	return providers.size();
+}
+
+/*
+ *	Render the virtual file for a request, if a provider matches it
+ *
+ *	@param	name		Requested file name (relative to the root)
+ *	@param	client		Requesting client
+ *	@param	out			Rendered file
+ *	@return				1 - Rendered | 0 - No provider matches
+ */
+int TFTP_VIRTUAL::render(const char* name, struct sockaddr_in* client, string* out){
+	while(*name == '/') ++name;
+	for(size_t i = 0; i < providers.size(); ++i){
+		TFTP_VIRTUAL_PROVIDER* p = &providers[i];
+		map<string, string> vars;
+		if(!match(p->pattern, 0, name, &vars)) continue;
+		if(tftp_now_ms() - p->data_checked > TFTP_VIRTUAL_CHECK_INTERVAL) loadData(p);
+
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &client->sin_addr, ip, sizeof(ip));
+		char port[8];
+		snprintf(port, sizeof(port), "%d", ntohs(client->sin_port));
+		vector<string> scopes;
+		for(map<string, string>::iterator c = vars.begin(); c != vars.end(); ++c)
+			scopes.push_back(c->second + ".");
+		scopes.push_back(string(ip) + ".");
+		scopes.push_back("");
+		vars["client_ip"] = ip;
+		vars["client_port"] = port;
+		vars["file"] = name;
+
+		out->clear();
+		for(size_t s = 0; s < p->body.size(); ++s){
+			const TFTP_TEMPLATE_SEGMENT& seg = p->body[s];
+			if(!seg.var){
+				*out += seg.text;
+				continue;
+			}
+			map<string, string>::iterator v = vars.find(seg.text);
+			if(v != vars.end()){
+				*out += v->second;
+				continue;
+			}
+			size_t k = 0;
+			for(; k < scopes.size(); ++k){
+				map<string, string>::iterator d = p->data.find(scopes[k] + seg.text);
+				if(d != p->data.end()){
+					*out += d->second;
+					break;
+				}
+			}
+			if(k == scopes.size()) *out += seg.fallback;
+		}
+		++rendered;
+		return 1;
+	}
+	return 0;
+}
+
+int TFTP_VIRTUAL::count()
+{ return providers.size(); }
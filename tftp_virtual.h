@@ -0,0 +1,67 @@
+#ifndef TFTP_VIRTUAL_H
+#define TFTP_VIRTUAL_H
+
+#include <netinet/in.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ *	Virtual files
+ *
+ *	RRQs matching a provider's path pattern are answered with a template
+ *	rendered for that request instead of a file.  The config lists one
+ *	provider per line:
+ *
+ *		pattern		template	[datafile]
+ *		pxelinux.cfg/01-{mac}	pxe.tmpl	hosts.kv
+ *
+ *	{name} in a pattern captures one path component.  A template is text
+ *	with ${name} or ${name|default} substitutions, looked up in order:
+ *		1. pattern captures
+ *		2. client_ip, client_port, file
+ *		3. "<capture>.<name>" then "<client_ip>.<name>" in the data file
+ *		4. "<name>" in the data file
+ *	The data file holds key=value lines and is re-read when it changes.
+ *
+ *	Patterns and templates are compiled once, when the config is loaded.
+ */
+
+#define TFTP_VIRTUAL_CHECK_INTERVAL	1000	// ms between data file mtime checks
+
+struct TFTP_TEMPLATE_SEGMENT{
+	int var;				// 0 = literal text, 1 = variable
+	std::string text;		// Literal text | variable name
+	std::string fallback;	// ${name|fallback}
+};
+
+struct TFTP_VIRTUAL_PROVIDER{
+	std::vector<TFTP_TEMPLATE_SEGMENT> pattern;
+	std::vector<TFTP_TEMPLATE_SEGMENT> body;
+	std::string data_file;
+	std::map<std::string, std::string> data;
+	long data_mtime;		// ns
+	long data_checked;		// tftp_now_ms() of the last mtime check
+};
+
+class TFTP_VIRTUAL{
+private:
+	std::vector<TFTP_VIRTUAL_PROVIDER> providers;
+
+	static int compile(const std::string& text, const char* open,
+					   std::vector<TFTP_TEMPLATE_SEGMENT>* out);
+	static int match(const std::vector<TFTP_TEMPLATE_SEGMENT>& pattern, size_t seg,
+					 const char* name, std::map<std::string, std::string>* captures);
+	static int loadData(TFTP_VIRTUAL_PROVIDER* p);
+
+public:
+	long rendered;
+
+	TFTP_VIRTUAL();
+
+	int load(const char* config);
+	int render(const char* name, struct sockaddr_in* client, std::string* out);
+	int count();
+};
+
+#endif